@@ -0,0 +1,482 @@
+/*
+ * batch.c - untty with many files
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "compiler.h"
+#include "debug.h"
+#include "untty.h"
+
+/*
+ * Files are read, not mapped: an archive on NFS can have a file
+ * truncated under us, and that's a short read() but a SIGBUS in a
+ * mapping.
+ */
+#define BATCH_BUFSZ     (256 * 1024)
+
+struct batch_file {
+        char *path;
+        char *out;
+};
+
+struct batch {
+        const struct batch_config *config;
+        struct batch_file *files;
+        size_t n_files;
+        size_t alloc;
+        size_t next;
+        bool failed;
+
+        /*
+         * Files found by walk_dir() that already end in the suffix;
+         * they're only output from an earlier run if what they'd have
+         * been made from is being stripped too.
+         */
+        char **suffixed;
+        size_t n_suffixed;
+        size_t suffixed_alloc;
+
+        /* don't walk into our own output */
+        bool have_output_dir;
+        dev_t output_dev;
+        ino_t output_ino;
+};
+
+static int
+write_fd(void *data, const char *buf, size_t len)
+{
+        int fd = *(int *)data;
+
+        while (len) {
+                ssize_t rc = write(fd, buf, len);
+
+                if (rc < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                buf += rc;
+                len -= rc;
+        }
+        return 0;
+}
+
+static void
+add_file(struct batch *b, const char *path, const char *rel)
+{
+        const struct batch_config *config = b->config;
+        struct batch_file *f;
+        int rc;
+
+        if (b->n_files == b->alloc) {
+                b->alloc = b->alloc ? b->alloc * 2 : 64;
+                b->files = reallocarray(b->files, b->alloc, sizeof(*b->files));
+                if (!b->files)
+                        err(1, "Could not allocate memory");
+        }
+        f = &b->files[b->n_files++];
+
+        f->path = strdup(path);
+        if (config->output_dir)
+                rc = asprintf(&f->out, "%s/%s%s", config->output_dir, rel,
+                              config->suffix);
+        else
+                rc = asprintf(&f->out, "%s%s", path, config->suffix);
+        if (!f->path || rc < 0)
+                err(1, "Could not allocate memory");
+}
+
+static void
+add_suffixed(struct batch *b, const char *path)
+{
+        if (b->n_suffixed == b->suffixed_alloc) {
+                b->suffixed_alloc = b->suffixed_alloc ?
+                                    b->suffixed_alloc * 2 : 16;
+                b->suffixed = reallocarray(b->suffixed, b->suffixed_alloc,
+                                           sizeof(*b->suffixed));
+                if (!b->suffixed)
+                        err(1, "Could not allocate memory");
+        }
+        b->suffixed[b->n_suffixed] = strdup(path);
+        if (!b->suffixed[b->n_suffixed++])
+                err(1, "Could not allocate memory");
+}
+
+static bool
+has_suffix(const char *name, const char *suffix)
+{
+        size_t len = strlen(name), slen = strlen(suffix);
+
+        return slen && len >= slen && !strcmp(name + len - slen, suffix);
+}
+
+/*
+ * Output for a directory goes in a directory of the same name under
+ * output_dir, the way cp -r does it.
+ */
+static void
+walk_dir(struct batch *b, const char *path, const char *rel)
+{
+        const struct batch_config *config = b->config;
+        struct dirent *de;
+        DIR *dir;
+
+        if (config->output_dir) {
+                char *outdir;
+
+                if (asprintf(&outdir, "%s/%s", config->output_dir, rel) < 0)
+                        err(1, "Could not allocate memory");
+                if (mkdir(outdir, 0777) < 0 && errno != EEXIST) {
+                        warn("Could not create \"%s\"", outdir);
+                        b->failed = true;
+                        free(outdir);
+                        return;
+                }
+                free(outdir);
+        }
+
+        dir = opendir(path);
+        if (!dir) {
+                warn("Could not open \"%s\"", path);
+                b->failed = true;
+                return;
+        }
+
+        while ((de = readdir(dir)) != NULL) {
+                char *child, *child_rel;
+                struct stat sb;
+
+                if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                        continue;
+                if (asprintf(&child, "%s/%s", path, de->d_name) < 0 ||
+                    asprintf(&child_rel, "%s/%s", rel, de->d_name) < 0)
+                        err(1, "Could not allocate memory");
+
+                if (lstat(child, &sb) < 0) {
+                        warn("Could not stat \"%s\"", child);
+                        b->failed = true;
+                } else if (S_ISDIR(sb.st_mode)) {
+                        if (b->have_output_dir &&
+                            sb.st_dev == b->output_dev &&
+                            sb.st_ino == b->output_ino)
+                                debug("skipping output directory \"%s\"", child);
+                        else
+                                walk_dir(b, child, child_rel);
+                } else if (!S_ISREG(sb.st_mode)) {
+                        debug("skipping \"%s\"", child);
+                } else if (!config->output_dir &&
+                           has_suffix(de->d_name, config->suffix)) {
+                        add_suffixed(b, child);
+                } else {
+                        add_file(b, child, child_rel);
+                }
+
+                free(child);
+                free(child_rel);
+        }
+        closedir(dir);
+}
+
+static const char *
+base_name(char *path)
+{
+        char *slash;
+        size_t len = strlen(path);
+
+        while (len > 1 && path[len - 1] == '/')
+                path[--len] = '\0';
+        slash = strrchr(path, '/');
+        return slash && slash[1] ? slash + 1 : path;
+}
+
+static int
+cmp_out(const void *a, const void *b)
+{
+        const struct batch_file *fa = *(const struct batch_file **)a;
+        const struct batch_file *fb = *(const struct batch_file **)b;
+
+        return strcmp(fa->out, fb->out);
+}
+
+static int
+cmp_path(const void *a, const void *b)
+{
+        const char *pa = *(const char **)a;
+        const char *pb = *(const char **)b;
+
+        return strcmp(pa, pb);
+}
+
+/*
+ * Every input path, sorted, for is_input().
+ */
+static const char **
+sort_paths(const struct batch *b)
+{
+        const char **paths;
+
+        paths = calloc(b->n_files ? b->n_files : 1, sizeof(*paths));
+        if (!paths)
+                err(1, "Could not allocate memory");
+        for (size_t i = 0; i < b->n_files; i++)
+                paths[i] = b->files[i].path;
+        qsort(paths, b->n_files, sizeof(*paths), cmp_path);
+        return paths;
+}
+
+static bool
+is_input(const struct batch *b, const char **paths, const char *path)
+{
+        return bsearch(&path, paths, b->n_files, sizeof(*paths),
+                       cmp_path) != NULL;
+}
+
+/*
+ * A file under a -r directory that ends in the suffix is left alone if
+ * it's the output for a file next to it that's being stripped now; if
+ * it isn't, it's not ours to skip, and stripping it would just stack
+ * another suffix on it.
+ */
+static void
+check_suffixed(struct batch *b, const char **paths)
+{
+        size_t slen = strlen(b->config->suffix);
+
+        for (size_t i = 0; i < b->n_suffixed; i++) {
+                const char *path = b->suffixed[i];
+                char *from;
+
+                from = strndup(path, strlen(path) - slen);
+                if (!from)
+                        err(1, "Could not allocate memory");
+                if (is_input(b, paths, from)) {
+                        debug("skipping \"%s\"", path);
+                } else {
+                        warnx("\"%s\" already ends in \"%s\"", path,
+                              b->config->suffix);
+                        b->failed = true;
+                }
+                free(from);
+        }
+}
+
+/*
+ * Outputs are named from the last part of each path given, so a/log
+ * and b/log (or two -r roots called log) would both go to
+ * output_dir/log; with two workers truncating and writing the same file,
+ * one of them would quietly lose.  An output that's also an input, as
+ * with --suffix .x a a.x, would be truncated before it's read.  Catch
+ * both before anything's written.
+ */
+static bool
+check_outputs(struct batch *b, const char **paths)
+{
+        struct batch_file **sorted;
+        bool ok = true;
+
+        for (size_t i = 0; i < b->n_files; i++) {
+                if (!is_input(b, paths, b->files[i].out))
+                        continue;
+                warnx("\"%s\" would be written over the input \"%s\"",
+                      b->files[i].path, b->files[i].out);
+                ok = false;
+        }
+
+        if (b->n_files < 2)
+                return ok;
+        sorted = calloc(b->n_files, sizeof(*sorted));
+        if (!sorted)
+                err(1, "Could not allocate memory");
+        for (size_t i = 0; i < b->n_files; i++)
+                sorted[i] = &b->files[i];
+        qsort(sorted, b->n_files, sizeof(*sorted), cmp_out);
+
+        for (size_t i = 1; i < b->n_files; i++) {
+                if (strcmp(sorted[i-1]->out, sorted[i]->out))
+                        continue;
+                warnx("\"%s\" and \"%s\" would both be written to \"%s\"",
+                      sorted[i-1]->path, sorted[i]->path, sorted[i]->out);
+                ok = false;
+        }
+        free(sorted);
+        return ok;
+}
+
+static bool
+strip_file(struct batch *b, const struct batch_file *f, char *buf)
+{
+        struct untty *ctx = NULL;
+        struct stat in_sb, out_sb;
+        int in_fd, out_fd = -1;
+        bool ok = false;
+        ssize_t len;
+
+        in_fd = open(f->path, O_RDONLY|O_CLOEXEC);
+        if (in_fd < 0) {
+                warn("Could not open \"%s\"", f->path);
+                return false;
+        }
+        if (fstat(in_fd, &in_sb) < 0) {
+                warn("Could not stat \"%s\"", f->path);
+                goto out;
+        }
+        if (stat(f->out, &out_sb) == 0 && out_sb.st_dev == in_sb.st_dev &&
+            out_sb.st_ino == in_sb.st_ino) {
+                warnx("Not writing \"%s\" over itself", f->path);
+                goto out;
+        }
+        posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        out_fd = open(f->out, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+        if (out_fd < 0) {
+                warn("Could not open \"%s\"", f->out);
+                goto out;
+        }
+
+        ctx = untty_new(b->config->exprs, b->config->flags, write_fd, &out_fd);
+        if (!ctx) {
+                warnx("%s", untty_error());
+                goto out;
+        }
+
+        while ((len = read(in_fd, buf, BATCH_BUFSZ)) != 0) {
+                if (len < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        warn("Could not read \"%s\"", f->path);
+                        goto out;
+                }
+                if (untty_feed(ctx, buf, len) < 0) {
+                        warnx("%s: %s", f->out, untty_error());
+                        goto out;
+                }
+        }
+        if (untty_finish(ctx) < 0) {
+                warnx("%s: %s", f->out, untty_error());
+                goto out;
+        }
+        ok = true;
+        debug("\"%s\" -> \"%s\"", f->path, f->out);
+out:
+        untty_free(ctx);
+        if (out_fd >= 0 && close(out_fd) < 0 && ok) {
+                warn("Could not write to \"%s\"", f->out);
+                ok = false;
+        }
+        close(in_fd);
+        return ok;
+}
+
+static void *
+batch_worker(void *data)
+{
+        struct batch *b = data;
+        char *buf;
+
+        buf = malloc(BATCH_BUFSZ);
+        if (!buf)
+                err(1, "Could not allocate memory");
+
+        while (true) {
+                size_t i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+
+                if (i >= b->n_files)
+                        break;
+                if (!strip_file(b, &b->files[i], buf))
+                        __atomic_store_n(&b->failed, true, __ATOMIC_RELAXED);
+        }
+
+        free(buf);
+        return NULL;
+}
+
+bool
+run_batch(const struct batch_config *config)
+{
+        struct batch batch;
+        struct batch *b = &batch;
+        pthread_t *threads;
+        unsigned int jobs;
+        const char **paths;
+        struct stat sb;
+
+        memset(b, 0, sizeof(*b));
+        b->config = config;
+
+        if (config->output_dir) {
+                if (stat(config->output_dir, &sb) < 0)
+                        err(1, "Could not open \"%s\"", config->output_dir);
+                if (!S_ISDIR(sb.st_mode))
+                        errx(1, "\"%s\" is not a directory", config->output_dir);
+                b->have_output_dir = true;
+                b->output_dev = sb.st_dev;
+                b->output_ino = sb.st_ino;
+        }
+
+        for (size_t i = 0; i < config->n_paths; i++) {
+                char *path = config->paths[i];
+
+                if (stat(path, &sb) < 0) {
+                        warn("Could not open \"%s\"", path);
+                        b->failed = true;
+                } else if (!S_ISDIR(sb.st_mode)) {
+                        add_file(b, path, base_name(path));
+                } else if (!config->recursive) {
+                        warnx("\"%s\" is a directory", path);
+                        b->failed = true;
+                } else {
+                        walk_dir(b, path, base_name(path));
+                }
+        }
+
+        jobs = config->jobs;
+        if (jobs > b->n_files)
+                jobs = b->n_files;
+        paths = sort_paths(b);
+        check_suffixed(b, paths);
+        if (!check_outputs(b, paths)) {
+                b->failed = true;
+                jobs = 0;
+        }
+        free(paths);
+        debug("%zu files on %u threads", b->n_files, jobs);
+
+        threads = calloc(jobs, sizeof(*threads));
+        if (!threads && jobs)
+                err(1, "Could not allocate memory");
+        for (unsigned int i = 0; i < jobs; i++) {
+                errno = pthread_create(&threads[i], NULL, batch_worker, b);
+                if (errno)
+                        err(1, "Could not create thread");
+        }
+        for (unsigned int i = 0; i < jobs; i++)
+                pthread_join(threads[i], NULL);
+        free(threads);
+
+        for (size_t i = 0; i < b->n_files; i++) {
+                free(b->files[i].path);
+                free(b->files[i].out);
+        }
+        free(b->files);
+        for (size_t i = 0; i < b->n_suffixed; i++)
+                free(b->suffixed[i]);
+        free(b->suffixed);
+
+        return !b->failed;
+}
+
+// vim:fenc=utf-8:tw=75:et
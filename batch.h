@@ -0,0 +1,41 @@
+/*
+ * batch.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "untty.h"
+
+/*
+ * Batch mode: strip many files in one run, each to its own output file.
+ * A file's output is output_dir/<its name> if there's an output_dir, and
+ * next to it otherwise, with suffix added either way.  With recursive,
+ * directories are walked and their structure is repeated under
+ * output_dir.
+ *
+ * Files are stripped on a pool of threads; on network filesystems the
+ * time goes to waiting on open(), read() and close(), not to stripping,
+ * so by default there are more threads than CPUs.
+ */
+#define BATCH_MIN_JOBS  16
+
+struct batch_config {
+        const struct untty_exprs *exprs;
+        unsigned int flags;
+        const char *output_dir;
+        const char *suffix;
+        char **paths;
+        size_t n_paths;
+        bool recursive;
+        unsigned int jobs;
+};
+
+extern bool run_batch(const struct batch_config *config);
+
+#endif /* !BATCH_H_ */
+// vim:fenc=utf-8:tw=75:et
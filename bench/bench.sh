@@ -0,0 +1,76 @@
+#!/bin/bash
+#
+# bench.sh - run untty over generated corpora and check the results
+#
+# Usage: bench.sh [--update-golden]
+#
+# Environment:
+#   UNTTY         untty to benchmark (./untty)
+#   UNTTY_ARGS    extra options for it
+#   BENCH_SIZES   corpus sizes in MiB ("1 16")
+#   BENCH_RUNS    runs per corpus; the fastest counts (3)
+#   BENCH_DIR     where corpora and outputs go (bench/data)
+#
+# bench/golden.sha256 has the hash of untty's output for each corpus with
+# the built-in expressions.  A change that makes those come out
+# differently is a behavior change, not a speedup; if it's meant to be,
+# rerun with --update-golden and commit the new hashes along with it.
+
+set -e
+set -u
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+untty=${UNTTY:-$top/untty}
+args=${UNTTY_ARGS:-}
+sizes=${BENCH_SIZES:-1 16}
+runs=${BENCH_RUNS:-3}
+dir=${BENCH_DIR:-$top/bench/data}
+golden=$top/bench/golden.sha256
+kinds="plain systemd screen curses"
+update=false
+failed=0
+
+if [ $# -gt 0 ] && [ "$1" = "--update-golden" ]; then
+        update=true
+fi
+
+mkdir -p "$dir"
+if $update; then
+        : >"$dir/golden.new"
+fi
+
+printf "%-16s %8s %10s %12s %10s\n" corpus MiB MB/s bytes/esc "RSS KiB"
+for size in $sizes; do
+        for kind in $kinds; do
+                name=$kind-${size}M
+                corpus=$dir/$name
+                if [ ! -f "$corpus" ]; then
+                        "$top/bench/gencorpus" "$kind" $((size * 1048576)) >"$corpus.tmp"
+                        mv "$corpus.tmp" "$corpus"
+                fi
+
+                # the built-in expressions, not whatever ~/.config has
+                UNTTY_ESCAPE_EXPRS=/nonexistent \
+                "$top/bench/runbench" "$runs" "$corpus.out" "$corpus" \
+                        "$untty" $args 2>/dev/null
+
+                sum=$(sha256sum <"$corpus.out" | cut -d' ' -f1)
+                if $update; then
+                        echo "$sum  $name" >>"$dir/golden.new"
+                        continue
+                fi
+                want=$(awk -v n="$name" '$2 == n { print $1 }' "$golden")
+                if [ -z "$want" ]; then
+                        echo "$name: no golden hash" >&2
+                elif [ "$sum" != "$want" ]; then
+                        echo "$name: output differs from golden" >&2
+                        failed=1
+                fi
+        done
+done
+
+if $update; then
+        sort -k2 -V "$dir/golden.new" >"$golden"
+        rm -f "$dir/golden.new"
+fi
+exit $failed
@@ -0,0 +1,194 @@
+/*
+ * gencorpus.c - reproducible input for make bench
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Everything comes from one xorshift64* stream with a fixed seed, so a
+ * given kind and size is the same file on every machine, and the golden
+ * hashes in golden.sha256 stay good.
+ */
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static uint32_t
+rnd(uint32_t n)
+{
+        rng_state ^= rng_state >> 12;
+        rng_state ^= rng_state << 25;
+        rng_state ^= rng_state >> 27;
+        return ((rng_state * 0x2545f4914f6cdd1dull) >> 32) % n;
+}
+
+static const char * const words[] = {
+        "the", "device", "kernel", "started", "module", "loaded", "usb",
+        "network", "service", "mounted", "filesystem", "target", "reached",
+        "scsi", "host", "link", "up", "down", "eth0", "firmware", "version",
+        "timeout", "waiting", "for", "job", "completed", "failed", "ok",
+        "/dev/sda1", "0x00000000fed40000", "[mem", "reserved]", "cpu0:",
+};
+#define N_WORDS (sizeof(words) / sizeof(words[0]))
+
+static const char * const units[] = {
+        "dev-sda2.device", "systemd-udevd.service", "NetworkManager.service",
+        "sshd.service", "dev-mapper-luks\\x2droot.device", "boot.mount",
+        "systemd-journald.service", "firewalld.service",
+};
+#define N_UNITS (sizeof(units) / sizeof(units[0]))
+
+static void
+put_words(FILE *out, int min, int max)
+{
+        int n = min + rnd(max - min + 1);
+
+        for (int i = 0; i < n; i++)
+                fprintf(out, "%s%s", i ? " " : "", words[rnd(N_WORDS)]);
+}
+
+static void
+gen_plain(FILE *out)
+{
+        put_words(out, 3, 20);
+        fputc('\n', out);
+}
+
+/*
+ * systemd's boot status: "[  OK  ]" lines, and the spinner it redraws
+ * over and over with CR and \x1b[K while a job is running.
+ */
+static void
+gen_systemd(FILE *out)
+{
+        const char *unit = units[rnd(N_UNITS)];
+        int frames = rnd(12);
+
+        for (int i = 0; i < frames; i++) {
+                int pos = i % 6;
+
+                fputs("\r\x1b[K[", out);
+                for (int j = 0; j < 6; j++) {
+                        if (j == pos)
+                                fputs("\x1b[0;1;31m*\x1b[0m", out);
+                        else if (j == pos + 1 || j == pos - 1)
+                                fputs("\x1b[0;31m*\x1b[0m", out);
+                        else
+                                fputc(' ', out);
+                }
+                fprintf(out, "] A start job is running for %s (%ds / 1min 30s)",
+                        unit, i);
+        }
+        if (frames)
+                fputs("\r\x1b[K", out);
+        if (rnd(10) == 0)
+                fprintf(out, "[\x1b[0;1;31mFAILED\x1b[0m] Failed to start %s.\n",
+                        unit);
+        else
+                fprintf(out, "[\x1b[0;32m  OK  \x1b[0m] Started %s.\n", unit);
+}
+
+/*
+ * screen(1) logging a serial console sometimes turns the kernel's
+ * "[    5.953653]" timestamps into "\x1b[[    5.953653]".
+ */
+static void
+gen_screen(FILE *out)
+{
+        unsigned int secs = rnd(100000);
+
+        fprintf(out, "%s[%5u.%06u] ", rnd(3) ? "\x1b[" : "", secs,
+                rnd(1000000));
+        put_words(out, 2, 12);
+        fputs(rnd(4) ? "\r\n" : "\n", out);
+}
+
+/*
+ * A full screen curses redraw: cursor addressing, attributes, and
+ * clearing to end of line, with hardly any text between them.
+ */
+static void
+gen_curses(FILE *out)
+{
+        int rows = 5 + rnd(20);
+
+        fputs("\x1b[?25l\x1b[H", out);
+        for (int r = 1; r <= rows; r++) {
+                int cells = 1 + rnd(8);
+
+                for (int c = 0; c < cells; c++) {
+                        fprintf(out, "\x1b[%d;%dH", r, 1 + rnd(80));
+                        fprintf(out, "\x1b[%d;%dm", rnd(2), 30 + rnd(8));
+                        fprintf(out, "%s", words[rnd(N_WORDS)]);
+                        if (rnd(3) == 0)
+                                fputs("\x1b[K", out);
+                }
+                fputs("\x1b[0m", out);
+        }
+        fputs("\x1b[?25h\n", out);
+}
+
+static const struct {
+        const char *name;
+        void (*gen)(FILE *out);
+} kinds[] = {
+        { "plain", gen_plain },
+        { "systemd", gen_systemd },
+        { "screen", gen_screen },
+        { "curses", gen_curses },
+        { NULL, NULL }
+};
+
+int
+main(int argc, char *argv[])
+{
+        void (*gen)(FILE *out) = NULL;
+        unsigned long long size;
+        char *end = NULL;
+        char *buf;
+        size_t len = 0;
+        FILE *out;
+
+        if (argc != 3) {
+                fprintf(stderr, "Usage: gencorpus <kind> <bytes>\n");
+                fprintf(stderr, "Kinds:");
+                for (int i = 0; kinds[i].name; i++)
+                        fprintf(stderr, " %s", kinds[i].name);
+                fprintf(stderr, "\n");
+                exit(1);
+        }
+
+        for (int i = 0; kinds[i].name; i++)
+                if (!strcmp(argv[1], kinds[i].name))
+                        gen = kinds[i].gen;
+        if (!gen)
+                errx(1, "Unknown kind \"%s\"", argv[1]);
+
+        size = strtoull(argv[2], &end, 10);
+        if (!end || *end || size == 0)
+                errx(1, "Invalid size \"%s\"", argv[2]);
+
+        /*
+         * Generate whole records until there's enough, then cut it to
+         * exactly size bytes, so the sizes are round numbers.
+         */
+        out = open_memstream(&buf, &len);
+        if (!out)
+                err(1, "Could not allocate memory");
+        while (len < size) {
+                gen(out);
+                fflush(out);
+        }
+        fclose(out);
+
+        if (fwrite(buf, 1, size, stdout) != size || fflush(stdout) != 0)
+                err(1, "Could not write to stdout");
+        free(buf);
+        return 0;
+}
+
+// vim:fenc=utf-8:tw=75:et
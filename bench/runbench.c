@@ -0,0 +1,149 @@
+/*
+ * runbench.c - time one untty run for make bench
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Runs "<untty> [args...] <corpus>" with stdout going to <output>, the
+ * best of <runs> times, and prints one line:
+ *
+ *   <corpus name> <MiB> <MB/s> <bytes per escape> <peak RSS KiB>
+ *
+ * Bytes per escape is the corpus size over how many ESC bytes are in it.
+ */
+
+static double
+now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t
+count_escapes(const char *filename, size_t *sizep)
+{
+        struct stat sb;
+        size_t n = 0;
+        char *data;
+        int fd;
+
+        fd = open(filename, O_RDONLY);
+        if (fd < 0)
+                err(1, "Could not open \"%s\"", filename);
+        if (fstat(fd, &sb) < 0)
+                err(1, "Couldn't get file size for \"%s\"", filename);
+        *sizep = sb.st_size;
+        if (sb.st_size == 0) {
+                close(fd);
+                return 0;
+        }
+
+        data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+                err(1, "Couldn't map \"%s\"", filename);
+        for (const char *p = data; (p = memchr(p, '\x1b', data + sb.st_size - p)); p++)
+                n++;
+        munmap(data, sb.st_size);
+        close(fd);
+        return n;
+}
+
+static double
+run_once(char *argv[], const char *output, long *maxrss)
+{
+        struct rusage ru;
+        double start;
+        int status;
+        pid_t pid;
+
+        start = now();
+        pid = fork();
+        if (pid < 0)
+                err(1, "Could not fork");
+        if (pid == 0) {
+                int fd = open(output, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+
+                if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0)
+                        err(1, "Could not open \"%s\"", output);
+                execv(argv[0], argv);
+                err(1, "Could not run \"%s\"", argv[0]);
+        }
+        if (wait4(pid, &status, 0, &ru) < 0)
+                err(1, "Could not wait for \"%s\"", argv[0]);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                errx(1, "\"%s\" failed", argv[0]);
+
+        *maxrss = ru.ru_maxrss;
+        return now() - start;
+}
+
+int
+main(int argc, char *argv[])
+{
+        const char *corpus, *output, *name;
+        char **args;
+        double best = 0;
+        long maxrss = 0;
+        size_t size, escapes;
+        int runs;
+
+        if (argc < 5) {
+                fprintf(stderr, "Usage: runbench <runs> <output> <corpus> <untty> [args...]\n");
+                exit(1);
+        }
+        runs = atoi(argv[1]);
+        if (runs < 1)
+                errx(1, "Invalid number of runs \"%s\"", argv[1]);
+        output = argv[2];
+        corpus = argv[3];
+
+        args = calloc(argc - 4 + 2, sizeof(*args));
+        if (!args)
+                err(1, "Could not allocate memory");
+        memcpy(args, argv + 4, (argc - 4) * sizeof(*args));
+        args[argc - 4] = (char *)corpus;
+
+        escapes = count_escapes(corpus, &size);
+
+        for (int i = 0; i < runs; i++) {
+                long rss;
+                double t = run_once(args, output, &rss);
+
+                if (i == 0 || t < best)
+                        best = t;
+                if (rss > maxrss)
+                        maxrss = rss;
+        }
+
+        name = strrchr(corpus, '/');
+        name = name ? name + 1 : corpus;
+        printf("%-16s %8.1f %10.1f ", name, size / 1048576.0,
+               size / 1e6 / best);
+        if (escapes)
+                printf("%12.1f", (double)size / escapes);
+        else
+                printf("%12s", "-");
+        printf(" %10ld\n", maxrss);
+
+        free(args);
+        return 0;
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -10,6 +10,7 @@ extern char *__progname;
 
 #define UNUSED          __attribute__((__unused__))
 #define NORETURN        __attribute__((__noreturn__))
+#define ALWAYS_INLINE   __attribute__((__always_inline__))
 #define HIDDEN          __attribute__((__visibility__ ("hidden")))
 #define PUBLIC          __attribute__((__visibility__ ("default")))
 
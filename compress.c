@@ -0,0 +1,503 @@
+/*
+ * compress.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compiler.h"
+#include "compress.h"
+#include "debug.h"
+
+#define COMPRESS_BUFSZ  (256 * 1024)
+
+static const struct {
+        const char *name;
+        const char *magic;
+        size_t magic_len;
+        int default_level;
+        int max_level;
+        bool supported;
+} types[] = {
+        [COMPRESS_NONE] = { "none", "", 0, 0, 0, true },
+        [COMPRESS_GZIP] = { "gzip", "\x1f\x8b", 2, 6, 9,
+#ifdef HAVE_ZLIB
+                            true
+#endif
+                          },
+        [COMPRESS_XZ] = { "xz", "\xfd" "7zXZ\0", 6, 6, 9,
+#ifdef HAVE_LZMA
+                          true
+#endif
+                        },
+        [COMPRESS_ZSTD] = { "zstd", "\x28\xb5\x2f\xfd", 4, 3, 19,
+#ifdef HAVE_ZSTD
+                            true
+#endif
+                          },
+};
+#define N_TYPES (sizeof(types) / sizeof(types[0]))
+
+compress_type_t
+compress_detect(const void *data, size_t len)
+{
+        for (compress_type_t t = COMPRESS_GZIP; t < N_TYPES; t++) {
+                if (len < types[t].magic_len ||
+                    memcmp(data, types[t].magic, types[t].magic_len))
+                        continue;
+                if (!types[t].supported)
+                        errx(1, "Input is %s compressed, and %s support isn't built in",
+                             types[t].name, types[t].name);
+                return t;
+        }
+        return COMPRESS_NONE;
+}
+
+/*
+ * Whether data is too short to say, but could still turn out to be the
+ * start of a magic number.
+ */
+bool
+compress_maybe(const void *data, size_t len)
+{
+        for (compress_type_t t = COMPRESS_GZIP; t < N_TYPES; t++)
+                if (len < types[t].magic_len &&
+                    !memcmp(data, types[t].magic, len))
+                        return true;
+        return false;
+}
+
+const char *
+compress_name(compress_type_t type)
+{
+        return types[type].name;
+}
+
+/*
+ * spec is TYPE or TYPE:LEVEL
+ */
+void
+compress_parse(const char *spec, compress_type_t *type, int *level)
+{
+        const char *colon = strchr(spec, ':');
+        size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+        compress_type_t t;
+
+        for (t = COMPRESS_GZIP; t < N_TYPES; t++)
+                if (strlen(types[t].name) == len &&
+                    !strncmp(spec, types[t].name, len))
+                        break;
+        if (t == N_TYPES)
+                errx(1, "Unknown compression \"%s\"", spec);
+        if (!types[t].supported)
+                errx(1, "%s support isn't built in", types[t].name);
+
+        *type = t;
+        *level = types[t].default_level;
+        if (colon) {
+                char *end = NULL;
+                long l = strtol(colon + 1, &end, 10);
+
+                if (!end || *end || end == colon + 1 || l < 0 ||
+                    l > types[t].max_level)
+                        errx(1, "Invalid %s level \"%s\"", types[t].name,
+                             colon + 1);
+                *level = l;
+        }
+}
+
+struct decompress {
+        compress_type_t type;
+        const char *name;
+        bool done;
+        union {
+#ifdef HAVE_ZLIB
+                z_stream gz;
+#endif
+#ifdef HAVE_LZMA
+                lzma_stream xz;
+#endif
+#ifdef HAVE_ZSTD
+                ZSTD_DStream *zstd;
+#endif
+                char unused;
+        };
+};
+
+struct decompress *
+decompress_new(compress_type_t type, const char *name)
+{
+        struct decompress *z;
+
+        z = calloc(1, sizeof(*z));
+        if (!z)
+                err(1, "Could not allocate memory");
+        z->type = type;
+        z->name = name;
+
+        switch (type) {
+#ifdef HAVE_ZLIB
+        case COMPRESS_GZIP:
+                /* 32 means gzip or zlib, whichever the header says */
+                if (inflateInit2(&z->gz, 15 + 32) != Z_OK)
+                        errx(1, "Could not set up gzip decompression");
+                break;
+#endif
+#ifdef HAVE_LZMA
+        case COMPRESS_XZ:
+                z->xz = (lzma_stream)LZMA_STREAM_INIT;
+                if (lzma_stream_decoder(&z->xz, UINT64_MAX,
+                                        LZMA_CONCATENATED) != LZMA_OK)
+                        errx(1, "Could not set up xz decompression");
+                break;
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD:
+                z->zstd = ZSTD_createDStream();
+                if (!z->zstd || ZSTD_isError(ZSTD_initDStream(z->zstd)))
+                        errx(1, "Could not set up zstd decompression");
+                break;
+#endif
+        default:
+                errx(1, "%s support isn't built in", types[type].name);
+        }
+        debug("decompressing %s as %s", name, types[type].name);
+        return z;
+}
+
+/*
+ * gzip files can be several members end to end, which gzip -d takes as
+ * one file, so after the end of one, more input starts the next.
+ */
+size_t
+decompress_run(struct decompress *z, const char **in UNUSED,
+               size_t *in_len UNUSED, bool eof UNUSED, char *out UNUSED,
+               size_t out_size UNUSED)
+{
+        size_t produced = 0;
+
+        switch (z->type) {
+#ifdef HAVE_ZLIB
+        case COMPRESS_GZIP: {
+                int rc;
+
+                if (z->done) {
+                        if (*in_len == 0)
+                                return 0;
+                        inflateReset(&z->gz);
+                        z->done = false;
+                }
+                z->gz.next_in = (unsigned char *)*in;
+                z->gz.avail_in = *in_len;
+                z->gz.next_out = (unsigned char *)out;
+                z->gz.avail_out = out_size;
+                rc = inflate(&z->gz, Z_NO_FLUSH);
+                if (rc == Z_STREAM_END)
+                        z->done = true;
+                else if (rc != Z_OK && !(rc == Z_BUF_ERROR && z->gz.avail_in == 0))
+                        errx(2, "%s: not valid gzip data%s%s", z->name,
+                             z->gz.msg ? ": " : "", z->gz.msg ? z->gz.msg : "");
+                *in = (const char *)z->gz.next_in;
+                *in_len = z->gz.avail_in;
+                produced = out_size - z->gz.avail_out;
+                break;
+        }
+#endif
+#ifdef HAVE_LZMA
+        case COMPRESS_XZ: {
+                lzma_ret rc;
+
+                z->xz.next_in = (const uint8_t *)*in;
+                z->xz.avail_in = *in_len;
+                z->xz.next_out = (uint8_t *)out;
+                z->xz.avail_out = out_size;
+                rc = lzma_code(&z->xz, eof ? LZMA_FINISH : LZMA_RUN);
+                if (rc == LZMA_STREAM_END)
+                        z->done = true;
+                else if (rc != LZMA_OK && rc != LZMA_BUF_ERROR)
+                        errx(2, "%s: not valid xz data (error %d)", z->name, rc);
+                *in = (const char *)z->xz.next_in;
+                *in_len = z->xz.avail_in;
+                produced = out_size - z->xz.avail_out;
+                break;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD: {
+                ZSTD_inBuffer inbuf = { *in, *in_len, 0 };
+                ZSTD_outBuffer outbuf = { out, out_size, 0 };
+                size_t rc;
+
+                rc = ZSTD_decompressStream(z->zstd, &outbuf, &inbuf);
+                if (ZSTD_isError(rc))
+                        errx(2, "%s: not valid zstd data: %s", z->name,
+                             ZSTD_getErrorName(rc));
+                /* 0 means a frame just ended and everything is out */
+                z->done = rc == 0;
+                *in += inbuf.pos;
+                *in_len -= inbuf.pos;
+                produced = outbuf.pos;
+                break;
+        }
+#endif
+        default:
+                break;
+        }
+        return produced;
+}
+
+bool
+decompress_done(struct decompress *z)
+{
+        return z->done;
+}
+
+void
+decompress_free(struct decompress *z)
+{
+        if (!z)
+                return;
+        switch (z->type) {
+#ifdef HAVE_ZLIB
+        case COMPRESS_GZIP:
+                inflateEnd(&z->gz);
+                break;
+#endif
+#ifdef HAVE_LZMA
+        case COMPRESS_XZ:
+                lzma_end(&z->xz);
+                break;
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD:
+                ZSTD_freeDStream(z->zstd);
+                break;
+#endif
+        default:
+                break;
+        }
+        free(z);
+}
+
+struct compress {
+        compress_type_t type;
+        int fd;
+        const char *name;
+        bool sync;
+        char *buf;
+        union {
+#ifdef HAVE_ZLIB
+                z_stream gz;
+#endif
+#ifdef HAVE_LZMA
+                lzma_stream xz;
+#endif
+#ifdef HAVE_ZSTD
+                ZSTD_CStream *zstd;
+#endif
+                char unused;
+        };
+};
+
+static void
+write_all(struct compress *z, const char *buf, size_t len)
+{
+        while (len) {
+                ssize_t rc = write(z->fd, buf, len);
+
+                if (rc < 0) {
+                        if (errno == EAGAIN || errno == EINTR)
+                                continue;
+                        err(2, "Could not write to %s", z->name);
+                }
+                buf += rc;
+                len -= rc;
+        }
+}
+
+struct compress *
+compress_new(compress_type_t type, int level, int fd, const char *name,
+             bool sync)
+{
+        struct compress *z;
+
+        z = calloc(1, sizeof(*z));
+        if (!z)
+                err(1, "Could not allocate memory");
+        z->buf = malloc(COMPRESS_BUFSZ);
+        if (!z->buf)
+                err(1, "Could not allocate memory");
+        z->type = type;
+        z->fd = fd;
+        z->name = name;
+        z->sync = sync;
+
+        switch (type) {
+#ifdef HAVE_ZLIB
+        case COMPRESS_GZIP:
+                /* 16 means a gzip header rather than zlib's */
+                if (deflateInit2(&z->gz, level, Z_DEFLATED, 15 + 16, 8,
+                                 Z_DEFAULT_STRATEGY) != Z_OK)
+                        errx(1, "Could not set up gzip compression");
+                break;
+#endif
+#ifdef HAVE_LZMA
+        case COMPRESS_XZ:
+                z->xz = (lzma_stream)LZMA_STREAM_INIT;
+                if (lzma_easy_encoder(&z->xz, level,
+                                      LZMA_CHECK_CRC64) != LZMA_OK)
+                        errx(1, "Could not set up xz compression");
+                break;
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD:
+                z->zstd = ZSTD_createCStream();
+                if (!z->zstd || ZSTD_isError(ZSTD_initCStream(z->zstd, level)))
+                        errx(1, "Could not set up zstd compression");
+                break;
+#endif
+        default:
+                errx(1, "%s support isn't built in", types[type].name);
+        }
+        debug("compressing %s as %s level %d", name, types[type].name, level);
+        return z;
+}
+
+typedef enum {
+        RUN,
+        FLUSH,
+        FINISH,
+} action_t;
+
+/*
+ * Feed data through, writing out whatever comes back, until it's all
+ * been taken and (for FLUSH and FINISH) nothing more is held back.
+ */
+static void
+compress_run(struct compress *z, const void *data UNUSED, size_t len UNUSED,
+             action_t action UNUSED)
+{
+        switch (z->type) {
+#ifdef HAVE_ZLIB
+        case COMPRESS_GZIP: {
+                static const int flush[] = { Z_NO_FLUSH, Z_SYNC_FLUSH, Z_FINISH };
+                int rc;
+
+                z->gz.next_in = (unsigned char *)data;
+                z->gz.avail_in = len;
+                do {
+                        z->gz.next_out = (unsigned char *)z->buf;
+                        z->gz.avail_out = COMPRESS_BUFSZ;
+                        rc = deflate(&z->gz, flush[action]);
+                        if (rc == Z_STREAM_ERROR)
+                                errx(2, "Could not compress output");
+                        write_all(z, z->buf, COMPRESS_BUFSZ - z->gz.avail_out);
+                } while (z->gz.avail_out == 0 ||
+                         (action == FINISH && rc != Z_STREAM_END));
+                break;
+        }
+#endif
+#ifdef HAVE_LZMA
+        case COMPRESS_XZ: {
+                static const lzma_action flush[] = {
+                        LZMA_RUN, LZMA_SYNC_FLUSH, LZMA_FINISH
+                };
+                lzma_ret rc;
+
+                z->xz.next_in = data;
+                z->xz.avail_in = len;
+                do {
+                        z->xz.next_out = (uint8_t *)z->buf;
+                        z->xz.avail_out = COMPRESS_BUFSZ;
+                        rc = lzma_code(&z->xz, flush[action]);
+                        if (rc != LZMA_OK && rc != LZMA_STREAM_END &&
+                            rc != LZMA_BUF_ERROR)
+                                errx(2, "Could not compress output (error %d)", rc);
+                        write_all(z, z->buf, COMPRESS_BUFSZ - z->xz.avail_out);
+                } while (z->xz.avail_out == 0 || z->xz.avail_in > 0 ||
+                         (action != RUN && rc != LZMA_STREAM_END));
+                break;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD: {
+                static const ZSTD_EndDirective flush[] = {
+                        ZSTD_e_continue, ZSTD_e_flush, ZSTD_e_end
+                };
+                ZSTD_inBuffer inbuf = { data, len, 0 };
+                size_t rc;
+
+                do {
+                        ZSTD_outBuffer outbuf = { z->buf, COMPRESS_BUFSZ, 0 };
+
+                        rc = ZSTD_compressStream2(z->zstd, &outbuf, &inbuf,
+                                                  flush[action]);
+                        if (ZSTD_isError(rc))
+                                errx(2, "Could not compress output: %s",
+                                     ZSTD_getErrorName(rc));
+                        write_all(z, z->buf, outbuf.pos);
+                } while (action == RUN ? inbuf.pos < inbuf.size : rc != 0);
+                break;
+        }
+#endif
+        default:
+                break;
+        }
+}
+
+int
+compress_write(void *data, const char *buf, size_t len)
+{
+        struct compress *z = data;
+
+        compress_run(z, buf, len, z->sync ? FLUSH : RUN);
+        return 0;
+}
+
+void
+compress_finish(struct compress *z)
+{
+        compress_run(z, NULL, 0, FINISH);
+
+        switch (z->type) {
+#ifdef HAVE_ZLIB
+        case COMPRESS_GZIP:
+                deflateEnd(&z->gz);
+                break;
+#endif
+#ifdef HAVE_LZMA
+        case COMPRESS_XZ:
+                lzma_end(&z->xz);
+                break;
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD:
+                ZSTD_freeCStream(z->zstd);
+                break;
+#endif
+        default:
+                break;
+        }
+        free(z->buf);
+        free(z);
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,65 @@
+/*
+ * compress.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * gzip, xz and zstd, for reading compressed logs and writing compressed
+ * output without a zcat or zstd on either side of us.  Which of them
+ * actually work depends on what was found at build time; asking for one
+ * that wasn't is an error, not a silent pass-through.
+ */
+typedef enum {
+        COMPRESS_NONE,
+        COMPRESS_GZIP,
+        COMPRESS_XZ,
+        COMPRESS_ZSTD,
+} compress_type_t;
+
+/* the longest magic number we look for */
+#define COMPRESS_MAGIC_MAX      6
+
+extern compress_type_t compress_detect(const void *data, size_t len);
+extern bool compress_maybe(const void *data, size_t len);
+extern const char *compress_name(compress_type_t type);
+extern void compress_parse(const char *spec, compress_type_t *type,
+                           int *level);
+
+/*
+ * decompress_run() takes compressed bytes from *in, moving it along, and
+ * returns how many bytes it put in out.  eof says no more input is coming
+ * after *in.  Once it returns 0 at eof, decompress_done() says whether
+ * the data ended where a stream did, rather than being cut short.
+ */
+struct decompress;
+
+extern struct decompress *decompress_new(compress_type_t type,
+                                         const char *name);
+extern size_t decompress_run(struct decompress *z, const char **in,
+                             size_t *in_len, bool eof,
+                             char *out, size_t out_size);
+extern bool decompress_done(struct decompress *z);
+extern void decompress_free(struct decompress *z);
+
+/*
+ * compress_write() compresses data to fd.  With sync, everything is
+ * written out in a form that can be decompressed at the end of each
+ * compress_write(), at some cost in ratio.  compress_write() is an
+ * output_write_fn, so an output opened with output_open_cb() can feed
+ * it.  compress_finish() writes the end of the stream and frees z.
+ */
+struct compress;
+
+extern struct compress *compress_new(compress_type_t type, int level,
+                                     int fd, const char *name, bool sync);
+extern int compress_write(void *z, const char *data, size_t len);
+extern void compress_finish(struct compress *z);
+
+#endif /* !COMPRESS_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,532 @@
+/*
+ * daemon.c - untty --daemon
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "daemon.h"
+#include "debug.h"
+#include "untty.h"
+
+/*
+ * Every stream has its own struct untty, which is the strip state, its
+ * partial escape buffer, and a small output buffer; that and this is all
+ * a stream costs.  Reads all go through one buffer, since each one is
+ * fed to its stream before the next.
+ */
+#define DAEMON_READ_SIZE        (64 * 1024)
+#define DAEMON_READS_PER_WAKEUP 4
+#define STREAM_NAME_MAX         255
+
+struct stream {
+        struct stream *prev, *next;
+        int fd;
+        int out_fd;
+        bool socket;
+        bool dirty;
+        bool have_termios;
+        struct termios termios;
+        char *name;
+        struct untty *ctx;
+
+        /* a socket stream's first line, until there's a whole one */
+        size_t header_len;
+        char *header;
+};
+
+struct daemon {
+        const struct daemon_config *config;
+        int epfd;
+        int listen_fd;
+        int signal_fd;
+        int dir_fd;
+        struct stream *streams;
+        size_t n_streams;
+        char *readbuf;
+        bool dirty;
+        struct timespec flush_at;
+};
+
+/* epoll data for the fds that aren't streams */
+static char listen_tag, signal_tag;
+
+static int
+write_output(void *data, const char *buf, size_t len)
+{
+        struct stream *st = data;
+
+        while (len) {
+                ssize_t rc = write(st->out_fd, buf, len);
+
+                if (rc < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                buf += rc;
+                len -= rc;
+        }
+        return 0;
+}
+
+static void
+watch(struct daemon *d, int fd, void *ptr)
+{
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = ptr };
+
+        if (epoll_ctl(d->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+                err(1, "Could not add fd to epoll set");
+}
+
+static struct stream *
+stream_new(struct daemon *d, int fd, bool socket)
+{
+        struct stream *st;
+
+        st = calloc(1, sizeof(*st));
+        if (!st)
+                err(1, "Could not allocate memory");
+        st->fd = fd;
+        st->out_fd = -1;
+        st->socket = socket;
+
+        st->next = d->streams;
+        if (st->next)
+                st->next->prev = st;
+        d->streams = st;
+        d->n_streams += 1;
+
+        watch(d, fd, st);
+        return st;
+}
+
+/*
+ * Output names are plain file names in output_dir: no slashes, and no
+ * hidden files, so "." and ".." are out too.
+ */
+static bool
+valid_name(const char *name)
+{
+        if (!name[0] || name[0] == '.')
+                return false;
+        for (const char *c = name; *c; c++)
+                if (*c == '/' || !isprint((unsigned char)*c))
+                        return false;
+        return true;
+}
+
+/*
+ * Two streams appending to one file would interleave at every flush,
+ * usually mid-line, so a name can only have one stream at a time.
+ */
+static bool
+name_busy(struct daemon *d, const char *name)
+{
+        for (struct stream *st = d->streams; st; st = st->next)
+                if (st->name && !strcmp(st->name, name))
+                        return true;
+        return false;
+}
+
+/*
+ * Tell a socket client why its stream is being closed; it's one short
+ * line, so a nonblocking write() either takes it or the client is gone.
+ */
+static void
+refuse(struct stream *st, const char *why, const char *name)
+{
+        warnx("%s \"%s\"", why, name);
+        if (st->socket)
+                dprintf(st->fd, "untty: %s \"%s\"\n", why, name);
+}
+
+static bool
+stream_start(struct daemon *d, struct stream *st, const char *name)
+{
+        if (!valid_name(name)) {
+                refuse(st, "Invalid output name", name);
+                return false;
+        }
+        if (name_busy(d, name)) {
+                refuse(st, "Another stream is already writing to", name);
+                return false;
+        }
+
+        st->name = strdup(name);
+        if (!st->name)
+                err(1, "Could not allocate memory");
+
+        st->out_fd = openat(d->dir_fd, name,
+                            O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+        if (st->out_fd < 0) {
+                warn("Could not open \"%s/%s\"", d->config->output_dir, name);
+                return false;
+        }
+
+        st->ctx = untty_new(d->config->exprs, d->config->flags,
+                            write_output, st);
+        if (!st->ctx)
+                errx(1, "%s", untty_error());
+        debug("stream %d -> \"%s\"", st->fd, name);
+        return true;
+}
+
+static void
+stream_close(struct daemon *d, struct stream *st)
+{
+        if (st->ctx) {
+                if (untty_finish(st->ctx) < 0)
+                        warnx("%s: %s", st->name, untty_error());
+                untty_free(st->ctx);
+        }
+        if (st->out_fd >= 0)
+                close(st->out_fd);
+        if (st->have_termios)
+                tcsetattr(st->fd, TCSANOW, &st->termios);
+        epoll_ctl(d->epfd, EPOLL_CTL_DEL, st->fd, NULL);
+        close(st->fd);
+        debug("stream %d (\"%s\") closed", st->fd, st->name ? st->name : "");
+
+        if (st->prev)
+                st->prev->next = st->next;
+        else
+                d->streams = st->next;
+        if (st->next)
+                st->next->prev = st->prev;
+        d->n_streams -= 1;
+
+        free(st->header);
+        free(st->name);
+        free(st);
+}
+
+/*
+ * Everything on a socket up to the first NL is the output name; returns
+ * how much of buf that used, or -1 if it's no good.
+ */
+static ssize_t
+read_header(struct daemon *d, struct stream *st, const char *buf, size_t len)
+{
+        const char *nl = memchr(buf, '\n', len);
+        size_t n = nl ? (size_t)(nl - buf) : len;
+
+        if (!st->header) {
+                st->header = malloc(STREAM_NAME_MAX + 1);
+                if (!st->header)
+                        err(1, "Could not allocate memory");
+        }
+        if (st->header_len + n > STREAM_NAME_MAX) {
+                warnx("Output name on connection %d is too long", st->fd);
+                return -1;
+        }
+        memcpy(st->header + st->header_len, buf, n);
+        st->header_len += n;
+        if (!nl)
+                return len;
+
+        if (st->header_len && st->header[st->header_len - 1] == '\r')
+                st->header_len -= 1;
+        st->header[st->header_len] = '\0';
+        if (!stream_start(d, st, st->header))
+                return -1;
+        free(st->header);
+        st->header = NULL;
+        return n + 1;
+}
+
+static void
+mark_dirty(struct daemon *d, struct stream *st)
+{
+        st->dirty = true;
+        if (d->dirty)
+                return;
+
+        d->dirty = true;
+        clock_gettime(CLOCK_MONOTONIC, &d->flush_at);
+        d->flush_at.tv_sec += d->config->flush_timeout / 1000;
+        d->flush_at.tv_nsec += (d->config->flush_timeout % 1000) * 1000000;
+        if (d->flush_at.tv_nsec >= 1000000000) {
+                d->flush_at.tv_sec += 1;
+                d->flush_at.tv_nsec -= 1000000000;
+        }
+}
+
+static void
+stream_input(struct daemon *d, struct stream *st)
+{
+        for (int i = 0; i < DAEMON_READS_PER_WAKEUP; i++) {
+                const char *buf = d->readbuf;
+                ssize_t len;
+
+                len = read(st->fd, d->readbuf, DAEMON_READ_SIZE);
+                if (len < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN)
+                                return;
+                        /* EIO is how a pty says the other end is gone */
+                        if (errno != EIO)
+                                warn("Could not read from %s",
+                                     st->name ? st->name : "connection");
+                        len = 0;
+                }
+                if (len == 0) {
+                        stream_close(d, st);
+                        return;
+                }
+
+                if (!st->ctx) {
+                        ssize_t used = read_header(d, st, buf, len);
+
+                        if (used < 0) {
+                                stream_close(d, st);
+                                return;
+                        }
+                        buf += used;
+                        len -= used;
+                        if (len == 0)
+                                continue;
+                }
+
+                if (untty_feed(st->ctx, buf, len) < 0) {
+                        warnx("%s: %s", st->name, untty_error());
+                        stream_close(d, st);
+                        return;
+                }
+                mark_dirty(d, st);
+        }
+}
+
+static void
+flush_streams(struct daemon *d)
+{
+        struct stream *st, *next;
+
+        for (st = d->streams; st; st = next) {
+                next = st->next;
+                if (!st->dirty)
+                        continue;
+                st->dirty = false;
+                if (untty_flush(st->ctx) < 0) {
+                        warnx("%s: %s", st->name, untty_error());
+                        stream_close(d, st);
+                }
+        }
+        d->dirty = false;
+}
+
+/*
+ * How long epoll_wait() can sleep before buffered output is due out.
+ */
+static int
+wait_timeout(struct daemon *d)
+{
+        struct timespec now;
+        int64_t ms;
+
+        if (!d->dirty)
+                return -1;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ms = (d->flush_at.tv_sec - now.tv_sec) * 1000 +
+             (d->flush_at.tv_nsec - now.tv_nsec) / 1000000;
+        return ms < 0 ? 0 : ms;
+}
+
+static void
+accept_connections(struct daemon *d)
+{
+        while (true) {
+                int fd = accept4(d->listen_fd, NULL, NULL,
+                                 SOCK_NONBLOCK|SOCK_CLOEXEC);
+
+                if (fd < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                                continue;
+                        if (errno != EAGAIN)
+                                warn("Could not accept connection");
+                        return;
+                }
+                debug("connection %d", fd);
+                stream_new(d, fd, true);
+        }
+}
+
+static void
+listen_on(struct daemon *d, const char *path)
+{
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        struct stat sb;
+
+        if (strlen(path) >= sizeof(addr.sun_path))
+                errx(1, "Socket path \"%s\" is too long", path);
+        strcpy(addr.sun_path, path);
+
+        /* a socket left behind by an earlier run is fair game */
+        if (lstat(path, &sb) == 0 && S_ISSOCK(sb.st_mode))
+                unlink(path);
+
+        d->listen_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+        if (d->listen_fd < 0)
+                err(1, "Could not create socket");
+        if (bind(d->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+                err(1, "Could not bind to \"%s\"", path);
+        if (listen(d->listen_fd, SOMAXCONN) < 0)
+                err(1, "Could not listen on \"%s\"", path);
+        watch(d, d->listen_fd, &listen_tag);
+}
+
+/*
+ * FIFOs are opened read-write, so there's always a writer and they
+ * don't hit end of file between one writer and the next.  ttys are put
+ * in raw mode, so nothing gets echoed back down the line or cooked on
+ * the way in, and put back when we're done.
+ */
+static void
+open_path(struct daemon *d, const char *path)
+{
+        struct stream *st;
+        struct termios raw;
+        const char *name;
+        struct stat sb;
+        int fd;
+
+        if (stat(path, &sb) < 0)
+                err(1, "Could not open \"%s\"", path);
+        if (S_ISFIFO(sb.st_mode))
+                fd = open(path, O_RDWR|O_NONBLOCK|O_CLOEXEC);
+        else if (S_ISCHR(sb.st_mode))
+                fd = open(path, O_RDONLY|O_NONBLOCK|O_NOCTTY|O_CLOEXEC);
+        else
+                errx(1, "\"%s\" is not a FIFO or a tty", path);
+        if (fd < 0)
+                err(1, "Could not open \"%s\"", path);
+
+        st = stream_new(d, fd, false);
+        if (tcgetattr(fd, &st->termios) == 0) {
+                st->have_termios = true;
+                raw = st->termios;
+                cfmakeraw(&raw);
+                tcsetattr(fd, TCSANOW, &raw);
+        }
+
+        name = strrchr(path, '/');
+        name = name ? name + 1 : path;
+        if (!stream_start(d, st, name))
+                exit(1);
+}
+
+void
+run_daemon(const struct daemon_config *config)
+{
+        struct epoll_event events[64];
+        struct daemon daemon;
+        struct daemon *d = &daemon;
+        sigset_t mask;
+        bool running = true;
+
+        memset(d, 0, sizeof(*d));
+        d->config = config;
+        d->listen_fd = -1;
+
+        d->readbuf = malloc(DAEMON_READ_SIZE);
+        if (!d->readbuf)
+                err(1, "Could not allocate memory");
+
+        d->dir_fd = open(config->output_dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (d->dir_fd < 0)
+                err(1, "Could not open \"%s\"", config->output_dir);
+
+        d->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (d->epfd < 0)
+                err(1, "Could not create epoll set");
+
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+        sigaddset(&mask, SIGHUP);
+        sigprocmask(SIG_BLOCK, &mask, NULL);
+        signal(SIGPIPE, SIG_IGN);
+        d->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+        if (d->signal_fd < 0)
+                err(1, "Could not create signalfd");
+        watch(d, d->signal_fd, &signal_tag);
+
+        if (config->socket_path)
+                listen_on(d, config->socket_path);
+        for (size_t i = 0; i < config->n_paths; i++)
+                open_path(d, config->paths[i]);
+
+        if (d->listen_fd < 0 && config->n_paths == 0)
+                errx(1, "--daemon needs --listen or at least one FIFO or tty");
+
+        while (running) {
+                int n = epoll_wait(d->epfd, events, 64, wait_timeout(d));
+
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        err(1, "Could not wait for input");
+                }
+
+                for (int i = 0; i < n; i++) {
+                        void *ptr = events[i].data.ptr;
+
+                        if (ptr == &listen_tag) {
+                                accept_connections(d);
+                        } else if (ptr == &signal_tag) {
+                                struct signalfd_siginfo si;
+
+                                if (read(d->signal_fd, &si, sizeof(si)) > 0)
+                                        debug("got signal %u; exiting",
+                                              si.ssi_signo);
+                                running = false;
+                        } else {
+                                stream_input(d, ptr);
+                        }
+                }
+
+                /*
+                 * Streams only get closed from their own event, and each
+                 * fd is in events[] once, so nothing later in it has been
+                 * freed.  Flushing can close them too, so it goes after.
+                 */
+                if (d->dirty && wait_timeout(d) == 0)
+                        flush_streams(d);
+
+                /* only FIFOs and no listener: done when they all are */
+                if (d->listen_fd < 0 && d->n_streams == 0)
+                        running = false;
+        }
+
+        while (d->streams)
+                stream_close(d, d->streams);
+        if (d->listen_fd >= 0) {
+                close(d->listen_fd);
+                unlink(config->socket_path);
+        }
+        close(d->signal_fd);
+        close(d->epfd);
+        close(d->dir_fd);
+        free(d->readbuf);
+}
+
+// vim:fenc=utf-8:tw=75:et
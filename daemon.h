@@ -0,0 +1,33 @@
+/*
+ * daemon.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+#include <stddef.h>
+
+#include "untty.h"
+
+/*
+ * untty --daemon: one process stripping any number of streams at once,
+ * all with the same expression set.  Streams come from connections to a
+ * Unix socket, where the first line names the output file, and from
+ * FIFOs and ttys named on the command line, which write to a file named
+ * after them.  Outputs are appended to, in output_dir.
+ */
+struct daemon_config {
+        const struct untty_exprs *exprs;
+        unsigned int flags;
+        const char *socket_path;
+        const char *output_dir;
+        char **paths;
+        size_t n_paths;
+        int flush_timeout;
+};
+
+extern void run_daemon(const struct daemon_config *config);
+
+#endif /* !DAEMON_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -6,18 +6,13 @@
 #ifndef DEBUG_H_
 #define DEBUG_H_
 
-extern bool debug_arg_, debug_once_;
+/*
+ * Set by untty -d or UNTTY_DEBUG in untty(1), and by untty_set_debug()
+ * for everyone else; the library itself never turns it on.
+ */
+extern bool debug_arg_;
 
-#define debug_arg ({                                                            \
-                if (debug_once_) {                                              \
-                        if(debug_arg_ || getenv("UNTTY_DEBUG")) {               \
-                                debug_arg_ = true;                              \
-                                setlinebuf(stdout);                             \
-                                setlinebuf(stderr);                             \
-                        }                                                       \
-                        debug_once_ = false;                                    \
-                }                                                               \
-                debug_arg_; })
+#define debug_arg debug_arg_
 
 #define debug(fmt, ...) ({ char *f_ = __FILE__; int l_ = __LINE__;              \
                 if (debug_arg) {                                                \
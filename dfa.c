@@ -0,0 +1,1208 @@
+/*
+ * dfa.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "debug.h"
+#include "dfa.h"
+
+#define DFA_MAX_STATES  4096
+#define DFA_MAX_REPEAT  32
+
+/*
+ * Parse tree for the subset of POSIX basic regular expressions (with the
+ * GNU \+, \? and \| extensions regcomp() accepts) that we can turn into
+ * an automaton.
+ */
+typedef enum {
+        N_EMPTY,
+        N_SET,
+        N_CAT,
+        N_ALT,
+        N_REPEAT,
+        N_GROUP,
+} node_type_t;
+
+#define REPEAT_INF      -1
+
+struct node {
+        node_type_t type;
+        int a, b;                       /* children */
+        int min, max;                   /* N_REPEAT */
+        int group;                      /* N_GROUP */
+        int set;                        /* N_SET */
+};
+
+typedef uint64_t charset_t[4];
+
+struct parser {
+        const char *re;
+        size_t pos;
+        bool unsupported;
+        int n_groups;
+
+        struct node *nodes;
+        size_t n_nodes, nodes_alloc;
+
+        charset_t *sets;
+        size_t n_sets, sets_alloc;
+};
+
+/*
+ * Returns NULL if there's no memory, and leaves ptr and *alloc as they
+ * were.  Running out just means the DFA doesn't get built, and
+ * regexec() does all the work.
+ */
+static void *
+grow(void *ptr, size_t *alloc, size_t need, size_t size)
+{
+        size_t n = *alloc ? *alloc * 2 : 64;
+
+        if (need <= *alloc)
+                return ptr;
+        if (n < need)
+                n = need;
+        ptr = reallocarray(ptr, n, size);
+        if (ptr)
+                *alloc = n;
+        return ptr;
+}
+
+/*
+ * There's always a spare node and set past the last one in use, so if
+ * memory runs out, the parse can carry on in the spare and give the
+ * expression up as unsupported at the end instead of unwinding.
+ */
+static int
+new_node(struct parser *p, node_type_t type, int a, int b)
+{
+        struct node *nodes, *n;
+
+        nodes = grow(p->nodes, &p->nodes_alloc, p->n_nodes + 2,
+                     sizeof(*p->nodes));
+        if (nodes)
+                p->nodes = nodes;
+        else
+                p->unsupported = true;
+        n = &p->nodes[p->n_nodes];
+        memset(n, 0, sizeof(*n));
+        n->type = type;
+        n->a = a;
+        n->b = b;
+        return nodes ? p->n_nodes++ : p->n_nodes;
+}
+
+static int
+new_set(struct parser *p)
+{
+        charset_t *sets;
+        int node;
+
+        sets = grow(p->sets, &p->sets_alloc, p->n_sets + 2, sizeof(*p->sets));
+        if (sets)
+                p->sets = sets;
+        else
+                p->unsupported = true;
+        memset(p->sets[p->n_sets], 0, sizeof(charset_t));
+        node = new_node(p, N_SET, -1, -1);
+        p->nodes[node].set = sets ? p->n_sets++ : p->n_sets;
+        return node;
+}
+
+static inline void
+set_add(charset_t set, unsigned char c)
+{
+        set[c / 64] |= 1ull << (c % 64);
+}
+
+static inline bool
+set_has(const charset_t set, unsigned char c)
+{
+        return set[c / 64] & (1ull << (c % 64));
+}
+
+static int
+literal(struct parser *p, unsigned char c)
+{
+        int node = new_set(p);
+
+        set_add(p->sets[p->nodes[node].set], c);
+        return node;
+}
+
+static const struct {
+        const char *name;
+        int (*fn)(int);
+} char_classes[] = {
+        { "alnum", isalnum },
+        { "alpha", isalpha },
+        { "blank", isblank },
+        { "cntrl", iscntrl },
+        { "digit", isdigit },
+        { "graph", isgraph },
+        { "lower", islower },
+        { "print", isprint },
+        { "punct", ispunct },
+        { "space", isspace },
+        { "upper", isupper },
+        { "xdigit", isxdigit },
+};
+
+static int
+parse_bracket(struct parser *p)
+{
+        const char *re = p->re;
+        int node = new_set(p);
+        charset_t set = { 0, };
+        bool negate = false;
+        bool first = true;
+
+        if (re[p->pos] == '^') {
+                negate = true;
+                p->pos++;
+        }
+
+        while (re[p->pos] != ']' || first) {
+                unsigned char lo, hi;
+
+                first = false;
+                if (re[p->pos] == '\0') {
+                        p->unsupported = true;
+                        return node;
+                }
+
+                if (re[p->pos] == '[' && re[p->pos+1] == ':') {
+                        const char *name = re + p->pos + 2;
+                        const char *end = strstr(name, ":]");
+                        unsigned int i;
+
+                        for (i = 0; end && i < sizeof(char_classes) / sizeof(char_classes[0]); i++) {
+                                if (strlen(char_classes[i].name) == (size_t)(end - name) &&
+                                    !strncmp(char_classes[i].name, name, end - name))
+                                        break;
+                        }
+                        if (!end || i == sizeof(char_classes) / sizeof(char_classes[0])) {
+                                p->unsupported = true;
+                                return node;
+                        }
+                        for (int c = 1; c < 256; c++)
+                                if (char_classes[i].fn(c))
+                                        set_add(set, c);
+                        p->pos = end - re + 2;
+                        continue;
+                }
+
+                /* collating symbols and equivalence classes */
+                if (re[p->pos] == '[' &&
+                    (re[p->pos+1] == '.' || re[p->pos+1] == '=')) {
+                        p->unsupported = true;
+                        return node;
+                }
+
+                lo = hi = re[p->pos++];
+                if (re[p->pos] == '-' && re[p->pos+1] != ']' &&
+                    re[p->pos+1] != '\0') {
+                        if (re[p->pos+1] == '[') {
+                                p->unsupported = true;
+                                return node;
+                        }
+                        hi = re[p->pos+1];
+                        p->pos += 2;
+                }
+                if (hi < lo) {
+                        p->unsupported = true;
+                        return node;
+                }
+                for (unsigned int c = lo; c <= hi; c++)
+                        set_add(set, c);
+        }
+        p->pos++;
+
+        for (int c = 1; c < 256; c++)
+                if (set_has(set, c) != negate)
+                        set_add(p->sets[p->nodes[node].set], c);
+        return node;
+}
+
+static int parse_alt(struct parser *p, int depth);
+
+static bool
+parse_number(struct parser *p, int *value)
+{
+        const char *re = p->re;
+        int n = 0;
+
+        if (!isdigit(re[p->pos]))
+                return false;
+        while (isdigit(re[p->pos])) {
+                n = n * 10 + re[p->pos++] - '0';
+                if (n > DFA_MAX_REPEAT)
+                        return false;
+        }
+        *value = n;
+        return true;
+}
+
+static int
+parse_atom(struct parser *p, int depth, bool at_start)
+{
+        const char *re = p->re;
+        unsigned char c = re[p->pos];
+        int node;
+
+        switch (c) {
+        case '.':
+                p->pos++;
+                node = new_set(p);
+                for (int i = 1; i < 256; i++)
+                        set_add(p->sets[p->nodes[node].set], i);
+                return node;
+        case '[':
+                p->pos++;
+                return parse_bracket(p);
+        case '*':
+                /* a leading '*' is an ordinary character */
+                p->pos++;
+                return literal(p, c);
+        case '^':
+                /* only an anchor at the start; we only handle that in
+                 * dfa_parse() */
+                if (at_start)
+                        p->unsupported = true;
+                p->pos++;
+                return literal(p, c);
+        case '$':
+                if (re[p->pos+1] == '\0' ||
+                    (re[p->pos+1] == '\\' &&
+                     (re[p->pos+2] == ')' || re[p->pos+2] == '|')))
+                        p->unsupported = true;
+                p->pos++;
+                return literal(p, c);
+        case '\\':
+                c = re[p->pos+1];
+                if (c == '(') {
+                        int group = ++p->n_groups;
+                        int inner;
+
+                        p->pos += 2;
+                        inner = parse_alt(p, depth + 1);
+                        if (re[p->pos] != '\\' || re[p->pos+1] != ')') {
+                                p->unsupported = true;
+                                return inner;
+                        }
+                        p->pos += 2;
+                        node = new_node(p, N_GROUP, inner, -1);
+                        p->nodes[node].group = group;
+                        return node;
+                }
+                /*
+                 * back references, \w \W \s \S \b \B \< \> \` \', and a
+                 * trailing backslash all need regexec().
+                 */
+                if (c == '\0' || isalnum(c) || strchr("<>`'{}()|+?", c)) {
+                        p->unsupported = true;
+                        p->pos += c ? 2 : 1;
+                        return new_node(p, N_EMPTY, -1, -1);
+                }
+                p->pos += 2;
+                return literal(p, c);
+        default:
+                p->pos++;
+                return literal(p, c);
+        }
+}
+
+static int
+parse_repeat(struct parser *p, int depth, bool at_start)
+{
+        const char *re = p->re;
+        int node = parse_atom(p, depth, at_start);
+
+        while (!p->unsupported) {
+                int min, max;
+
+                if (re[p->pos] == '*') {
+                        min = 0;
+                        max = REPEAT_INF;
+                        p->pos++;
+                } else if (re[p->pos] == '\\' && re[p->pos+1] == '+') {
+                        min = 1;
+                        max = REPEAT_INF;
+                        p->pos += 2;
+                } else if (re[p->pos] == '\\' && re[p->pos+1] == '?') {
+                        min = 0;
+                        max = 1;
+                        p->pos += 2;
+                } else if (re[p->pos] == '\\' && re[p->pos+1] == '{') {
+                        p->pos += 2;
+                        if (!parse_number(p, &min)) {
+                                p->unsupported = true;
+                                break;
+                        }
+                        max = min;
+                        if (re[p->pos] == ',') {
+                                p->pos++;
+                                max = REPEAT_INF;
+                                if (isdigit(re[p->pos]) &&
+                                    !parse_number(p, &max)) {
+                                        p->unsupported = true;
+                                        break;
+                                }
+                        }
+                        if (re[p->pos] != '\\' || re[p->pos+1] != '}' ||
+                            (max != REPEAT_INF && max < min)) {
+                                p->unsupported = true;
+                                break;
+                        }
+                        p->pos += 2;
+                } else {
+                        break;
+                }
+                node = new_node(p, N_REPEAT, node, -1);
+                p->nodes[node].min = min;
+                p->nodes[node].max = max;
+        }
+        return node;
+}
+
+static int
+parse_cat(struct parser *p, int depth)
+{
+        const char *re = p->re;
+        int node = -1;
+
+        while (!p->unsupported && re[p->pos] != '\0') {
+                int next;
+
+                if (re[p->pos] == '\\' &&
+                    (re[p->pos+1] == '|' || re[p->pos+1] == ')'))
+                        break;
+
+                /* \+, \? and \{ with nothing to repeat */
+                if (node < 0 && re[p->pos] == '\\' &&
+                    (re[p->pos+1] == '+' || re[p->pos+1] == '?' ||
+                     re[p->pos+1] == '{')) {
+                        p->unsupported = true;
+                        break;
+                }
+
+                next = parse_repeat(p, depth, node < 0);
+                node = node < 0 ? next : new_node(p, N_CAT, node, next);
+        }
+        if (node < 0)
+                node = new_node(p, N_EMPTY, -1, -1);
+        return node;
+}
+
+static int
+parse_alt(struct parser *p, int depth)
+{
+        const char *re = p->re;
+        int node = parse_cat(p, depth);
+
+        while (!p->unsupported && re[p->pos] == '\\' && re[p->pos+1] == '|') {
+                int next;
+
+                p->pos += 2;
+                next = parse_cat(p, depth);
+                node = new_node(p, N_ALT, node, next);
+        }
+        if (depth == 0 && re[p->pos] != '\0')
+                p->unsupported = true;
+        return node;
+}
+
+static bool
+nullable(struct parser *p, int n)
+{
+        struct node *node = &p->nodes[n];
+
+        switch (node->type) {
+        case N_EMPTY:
+                return true;
+        case N_SET:
+                return false;
+        case N_CAT:
+                return nullable(p, node->a) && nullable(p, node->b);
+        case N_ALT:
+                return nullable(p, node->a) || nullable(p, node->b);
+        case N_REPEAT:
+                return node->min == 0 || nullable(p, node->a);
+        case N_GROUP:
+                return nullable(p, node->a);
+        }
+        return true;
+}
+
+static bool
+has_group(struct parser *p, int n)
+{
+        struct node *node = &p->nodes[n];
+
+        switch (node->type) {
+        case N_GROUP:
+                return true;
+        case N_CAT:
+        case N_ALT:
+                return has_group(p, node->a) || has_group(p, node->b);
+        case N_REPEAT:
+                return has_group(p, node->a);
+        default:
+                return false;
+        }
+}
+
+/*
+ * The length of everything node n can match, or -1 if it isn't fixed.
+ */
+static int
+fixed_length(struct parser *p, int n)
+{
+        struct node *node = &p->nodes[n];
+        int a, b;
+
+        switch (node->type) {
+        case N_EMPTY:
+                return 0;
+        case N_SET:
+                return 1;
+        case N_CAT:
+                a = fixed_length(p, node->a);
+                b = fixed_length(p, node->b);
+                return a < 0 || b < 0 ? -1 : a + b;
+        case N_ALT:
+                a = fixed_length(p, node->a);
+                b = fixed_length(p, node->b);
+                return a == b ? a : -1;
+        case N_REPEAT:
+                a = fixed_length(p, node->a);
+                if (a < 0 || node->min != node->max)
+                        return -1;
+                return a * node->min;
+        case N_GROUP:
+                return fixed_length(p, node->a);
+        }
+        return -1;
+}
+
+/*
+ * Record how far each subexpression's end is from the end of the match.
+ * Returns false if any of them isn't a fixed distance from it, or can
+ * fail to participate in the match.
+ */
+static bool
+find_trims(struct parser *p, int n, int tail,
+           struct dfa_trim **trims, size_t *n_trims, size_t *alloc)
+{
+        struct node *node = &p->nodes[n];
+        int len;
+
+        switch (node->type) {
+        case N_CAT:
+                if (!find_trims(p, node->b, tail, trims, n_trims, alloc))
+                        return false;
+                len = fixed_length(p, node->b);
+                return find_trims(p, node->a,
+                                  tail < 0 || len < 0 ? -1 : tail + len,
+                                  trims, n_trims, alloc);
+        case N_GROUP: {
+                struct dfa_trim *more;
+
+                if (tail < 0)
+                        return false;
+                more = grow(*trims, alloc, *n_trims + 1, sizeof(**trims));
+                if (!more)
+                        return false;
+                *trims = more;
+                (*trims)[*n_trims].group = node->group;
+                (*trims)[*n_trims].tail = tail;
+                *n_trims += 1;
+                return find_trims(p, node->a, tail, trims, n_trims, alloc);
+        }
+        case N_ALT:
+        case N_REPEAT:
+                return !has_group(p, n);
+        default:
+                return true;
+        }
+}
+
+/*
+ * Thompson NFA.
+ */
+typedef enum {
+        S_SET,
+        S_SPLIT,
+        S_EPS,
+        S_MATCH,
+} nstate_type_t;
+
+struct nstate {
+        nstate_type_t type;
+        int out, out1;
+        int set;
+        uint32_t expr;
+};
+
+/*
+ * Like the parser, this keeps a spare state at the end, and carries on
+ * in it with failed set if memory runs out.
+ */
+struct nfa {
+        struct nstate *states;
+        size_t n_states, alloc;
+        bool failed;
+};
+
+static int
+nfa_state(struct nfa *nfa, nstate_type_t type, int out, int out1)
+{
+        struct nstate *states, *s;
+
+        states = grow(nfa->states, &nfa->alloc, nfa->n_states + 2,
+                      sizeof(*nfa->states));
+        if (states)
+                nfa->states = states;
+        else
+                nfa->failed = true;
+        s = &nfa->states[nfa->n_states];
+        memset(s, 0, sizeof(*s));
+        s->type = type;
+        s->out = out;
+        s->out1 = out1;
+        return states ? nfa->n_states++ : nfa->n_states;
+}
+
+/*
+ * Builds node n into the NFA, returning its start state; *end is an
+ * S_EPS state whose out still needs to be filled in.
+ */
+static int
+nfa_build(struct nfa *nfa, struct parser *p, size_t set_base, int n, int *end)
+{
+        struct node *node = &p->nodes[n];
+        int s, e, s1, e1, s2, e2;
+
+        switch (node->type) {
+        case N_EMPTY:
+                *end = s = nfa_state(nfa, S_EPS, -1, -1);
+                return s;
+        case N_SET:
+                e = nfa_state(nfa, S_EPS, -1, -1);
+                s = nfa_state(nfa, S_SET, e, -1);
+                nfa->states[s].set = set_base + node->set;
+                *end = e;
+                return s;
+        case N_CAT:
+                s1 = nfa_build(nfa, p, set_base, node->a, &e1);
+                s2 = nfa_build(nfa, p, set_base, node->b, &e2);
+                nfa->states[e1].out = s2;
+                *end = e2;
+                return s1;
+        case N_ALT:
+                s1 = nfa_build(nfa, p, set_base, node->a, &e1);
+                s2 = nfa_build(nfa, p, set_base, node->b, &e2);
+                e = nfa_state(nfa, S_EPS, -1, -1);
+                nfa->states[e1].out = e;
+                nfa->states[e2].out = e;
+                *end = e;
+                return nfa_state(nfa, S_SPLIT, s1, s2);
+        case N_GROUP:
+                return nfa_build(nfa, p, set_base, node->a, end);
+        case N_REPEAT:
+                s = e = nfa_state(nfa, S_EPS, -1, -1);
+                for (int i = 0; i < node->min; i++) {
+                        s1 = nfa_build(nfa, p, set_base, node->a, &e1);
+                        nfa->states[e].out = s1;
+                        e = e1;
+                }
+                if (node->max == REPEAT_INF) {
+                        int split;
+
+                        s1 = nfa_build(nfa, p, set_base, node->a, &e1);
+                        e2 = nfa_state(nfa, S_EPS, -1, -1);
+                        split = nfa_state(nfa, S_SPLIT, s1, e2);
+                        nfa->states[e1].out = split;
+                        nfa->states[e].out = split;
+                        e = e2;
+                } else {
+                        int last = nfa_state(nfa, S_EPS, -1, -1);
+
+                        for (int i = node->min; i < node->max; i++) {
+                                s1 = nfa_build(nfa, p, set_base, node->a, &e1);
+                                nfa->states[e].out =
+                                        nfa_state(nfa, S_SPLIT, s1, last);
+                                e = e1;
+                        }
+                        nfa->states[e].out = last;
+                        e = last;
+                }
+                *end = e;
+                return s;
+        }
+        return -1;
+}
+
+/*
+ * Sets of NFA states, kept sorted, for the subset construction.
+ */
+struct stateset {
+        int *ids;
+        size_t n;
+};
+
+struct closure {
+        struct nfa *nfa;
+        uint32_t *mark;
+        uint32_t gen;
+        int *stack;
+        int *out;
+        size_t n_out;
+};
+
+static void
+closure_add(struct closure *cl, int id)
+{
+        size_t sp = 0;
+
+        cl->stack[sp++] = id;
+        while (sp) {
+                struct nstate *s;
+
+                id = cl->stack[--sp];
+                if (id < 0 || cl->mark[id] == cl->gen)
+                        continue;
+                cl->mark[id] = cl->gen;
+                s = &cl->nfa->states[id];
+                switch (s->type) {
+                case S_SET:
+                case S_MATCH:
+                        cl->out[cl->n_out++] = id;
+                        break;
+                case S_SPLIT:
+                        cl->stack[sp++] = s->out1;
+                        /* fall through */
+                case S_EPS:
+                        cl->stack[sp++] = s->out;
+                        break;
+                }
+        }
+}
+
+static int
+cmp_int(const void *a, const void *b)
+{
+        int x = *(const int *)a, y = *(const int *)b;
+
+        return x < y ? -1 : x > y;
+}
+
+static uint64_t
+stateset_hash(const int *ids, size_t n)
+{
+        uint64_t h = 0xcbf29ce484222325ull;
+
+        for (size_t i = 0; i < n; i++) {
+                h ^= (uint32_t)ids[i];
+                h *= 0x100000001b3ull;
+        }
+        return h ^ n;
+}
+
+struct builder {
+        struct stateset *sets;
+        size_t n_sets, sets_alloc;
+        uint32_t *hash;
+        size_t hash_size;
+};
+
+static bool
+stateset_equal(const struct stateset *s, const int *ids, size_t n)
+{
+        return s->n == n && !memcmp(s->ids, ids, n * sizeof(*ids));
+}
+
+/*
+ * Returns the DFA state for this set of NFA states, adding it if it's
+ * new, or -1 if we'd go past DFA_MAX_STATES or there's no memory.
+ */
+static int64_t
+builder_intern(struct builder *b, const int *ids, size_t n)
+{
+        uint64_t h = stateset_hash(ids, n);
+        size_t slot = h & (b->hash_size - 1);
+        struct stateset *sets, *s;
+
+        while (b->hash[slot] != UINT32_MAX) {
+                if (stateset_equal(&b->sets[b->hash[slot]], ids, n))
+                        return b->hash[slot];
+                slot = (slot + 1) & (b->hash_size - 1);
+        }
+        if (b->n_sets >= DFA_MAX_STATES) {
+                debug("DFA has more than %d states; using regexec()",
+                      DFA_MAX_STATES);
+                return -1;
+        }
+
+        sets = grow(b->sets, &b->sets_alloc, b->n_sets + 1, sizeof(*b->sets));
+        if (!sets) {
+                debug("Could not allocate memory for the DFA; using regexec()");
+                return -1;
+        }
+        b->sets = sets;
+        s = &b->sets[b->n_sets];
+        s->n = n;
+        s->ids = calloc(n ? n : 1, sizeof(*ids));
+        if (!s->ids) {
+                debug("Could not allocate memory for the DFA; using regexec()");
+                return -1;
+        }
+        memcpy(s->ids, ids, n * sizeof(*ids));
+        b->hash[slot] = b->n_sets;
+        return b->n_sets++;
+}
+
+static bool
+dfa_parse(const char *re, struct parser *p, int *root, bool *anchored)
+{
+        /* room for the spares */
+        p->nodes = grow(NULL, &p->nodes_alloc, 1, sizeof(*p->nodes));
+        p->sets = grow(NULL, &p->sets_alloc, 1, sizeof(*p->sets));
+        if (!p->nodes || !p->sets)
+                return false;
+
+        p->re = re;
+        p->pos = 0;
+        *anchored = false;
+        if (re[0] == '^') {
+                *anchored = true;
+                p->pos = 1;
+        }
+        *root = parse_alt(p, 0);
+        if (*anchored && p->nodes[*root].type == N_ALT)
+                p->unsupported = true;
+        return !p->unsupported && !nullable(p, *root);
+}
+
+struct dfa *
+dfa_compile(const char **exprs, size_t n_exprs, bool *handled)
+{
+        struct parser p;
+        struct nfa nfa = { NULL, 0, 0, false };
+        charset_t *sets = NULL;
+        size_t n_sets = 0, sets_alloc = 0;
+        struct dfa_trim *trims = NULL;
+        size_t n_trims = 0, trims_alloc = 0;
+        int *starts = NULL;
+        bool *anchors = NULL;
+        size_t n_starts = 0;
+        struct dfa *dfa = NULL;
+        struct builder b = { NULL, 0, 0, NULL, 0 };
+        struct closure cl = { NULL, NULL, 0, NULL, NULL, 0 };
+        size_t trans_alloc = 0;
+        int *unanchored = NULL;
+        size_t n_unanchored = 0;
+        uint8_t reps[256];
+        int64_t next;
+        size_t n_accept = 0, accept_alloc = 0;
+        bool nomem = false;
+        bool ok = true;
+
+        dfa = calloc(1, sizeof(*dfa));
+        starts = calloc(n_exprs ? n_exprs : 1, sizeof(*starts));
+        anchors = calloc(n_exprs ? n_exprs : 1, sizeof(*anchors));
+        /* room for the spare */
+        nfa.states = grow(NULL, &nfa.alloc, 1, sizeof(*nfa.states));
+        if (!dfa || !starts || !anchors || !nfa.states)
+                goto nomem;
+        dfa->n_exprs = n_exprs;
+        dfa->trim_off = calloc(n_exprs + 1, sizeof(*dfa->trim_off));
+        dfa->n_groups = calloc(n_exprs ? n_exprs : 1, sizeof(*dfa->n_groups));
+        if (!dfa->trim_off || !dfa->n_groups)
+                goto nomem;
+
+        for (size_t i = 0; i < n_exprs; i++) {
+                size_t trims_before = n_trims;
+                int root, end, match;
+                bool anchored;
+                charset_t *more;
+
+                memset(&p, 0, sizeof(p));
+                handled[i] = dfa_parse(exprs[i], &p, &root, &anchored) &&
+                             find_trims(&p, root, 0, &trims, &n_trims, &trims_alloc);
+                if (!handled[i]) {
+                        n_trims = trims_before;
+                } else {
+                        dfa->n_groups[i] = p.n_groups;
+                        starts[n_starts] = nfa_build(&nfa, &p, n_sets, root, &end);
+                        anchors[n_starts++] = anchored;
+                        match = nfa_state(&nfa, S_MATCH, -1, -1);
+                        nfa.states[match].expr = i;
+                        nfa.states[end].out = match;
+
+                        more = grow(sets, &sets_alloc, n_sets + p.n_sets,
+                                    sizeof(*sets));
+                        if (more) {
+                                sets = more;
+                                memcpy(sets + n_sets, p.sets,
+                                       p.n_sets * sizeof(*sets));
+                                n_sets += p.n_sets;
+                        } else {
+                                nomem = true;
+                        }
+                }
+                dfa->trim_off[i+1] = n_trims;
+                debug("expr[%zu] \"%s\": %s", i, exprs[i],
+                      handled[i] ? "dfa" : "regexec");
+                free(p.nodes);
+                free(p.sets);
+        }
+        dfa->trim = trims;
+
+        if (nomem || nfa.failed)
+                goto nomem;
+        if (n_starts == 0) {
+                ok = false;
+                goto out;
+        }
+
+        /*
+         * Split the bytes into classes that every charset treats the
+         * same way.  NUL ends the string as far as regexec() is
+         * concerned, so it gets a class of its own that goes nowhere.
+         */
+        memset(dfa->classes, 0, sizeof(dfa->classes));
+        for (int c = 1; c < 256; c++)
+                dfa->classes[c] = 1;
+        dfa->n_classes = 2;
+        for (size_t i = 0; i < n_sets; i++) {
+                int16_t remap[2][256];
+
+                memset(remap, 0xff, sizeof(remap));
+                for (int c = 1; c < 256; c++) {
+                        int in = set_has(sets[i], c);
+                        uint8_t old = dfa->classes[c];
+
+                        if (remap[in][old] < 0) {
+                                /* the first half of a split keeps its id */
+                                if (remap[!in][old] < 0)
+                                        remap[in][old] = old;
+                                else
+                                        remap[in][old] = dfa->n_classes++;
+                        }
+                        dfa->classes[c] = remap[in][old];
+                }
+        }
+        for (int c = 255; c >= 0; c--)
+                reps[dfa->classes[c]] = c;
+
+        cl.nfa = &nfa;
+        cl.mark = calloc(nfa.n_states, sizeof(*cl.mark));
+        cl.stack = calloc(nfa.n_states * 2 + 1, sizeof(*cl.stack));
+        cl.out = calloc(nfa.n_states, sizeof(*cl.out));
+        unanchored = calloc(nfa.n_states, sizeof(*unanchored));
+        b.hash_size = DFA_MAX_STATES * 2;
+        b.hash = malloc(b.hash_size * sizeof(*b.hash));
+        if (!cl.mark || !cl.stack || !cl.out || !unanchored || !b.hash)
+                goto nomem;
+        memset(b.hash, 0xff, b.hash_size * sizeof(*b.hash));
+        cl.gen = 0;
+
+        /*
+         * The dead state is the empty set, and nothing leaves it.  cl.out
+         * stands in for its (empty) list, so memcpy() never sees NULL.
+         */
+        if (builder_intern(&b, cl.out, 0) < 0) {
+                ok = false;
+                goto out;
+        }
+
+        cl.gen++;
+        cl.n_out = 0;
+        for (size_t i = 0; i < n_starts; i++)
+                if (!anchors[i])
+                        closure_add(&cl, starts[i]);
+        qsort(cl.out, cl.n_out, sizeof(*cl.out), cmp_int);
+        memcpy(unanchored, cl.out, cl.n_out * sizeof(*cl.out));
+        n_unanchored = cl.n_out;
+
+        cl.gen++;
+        cl.n_out = 0;
+        for (size_t i = 0; i < n_starts; i++)
+                closure_add(&cl, starts[i]);
+        qsort(cl.out, cl.n_out, sizeof(*cl.out), cmp_int);
+        next = builder_intern(&b, cl.out, cl.n_out);
+        if (next < 0) {
+                ok = false;
+                goto out;
+        }
+        dfa->start = next;
+
+        for (size_t d = 0; d < b.n_sets && ok; d++) {
+                uint32_t *trans;
+
+                trans = grow(dfa->trans, &trans_alloc,
+                             (d + 1) * dfa->n_classes, sizeof(*dfa->trans));
+                if (!trans)
+                        goto nomem;
+                dfa->trans = trans;
+                for (uint32_t k = 0; k < dfa->n_classes; k++) {
+                        /* builder_intern() may move b.sets */
+                        struct stateset *s = &b.sets[d];
+                        unsigned char c = reps[k];
+
+                        if (d == DFA_DEAD || c == '\0') {
+                                dfa->trans[d * dfa->n_classes + k] = DFA_DEAD;
+                                continue;
+                        }
+
+                        cl.gen++;
+                        cl.n_out = 0;
+                        for (size_t i = 0; i < s->n; i++) {
+                                struct nstate *ns = &nfa.states[s->ids[i]];
+
+                                if (ns->type == S_SET && set_has(sets[ns->set], c))
+                                        closure_add(&cl, ns->out);
+                        }
+                        for (size_t i = 0; i < n_unanchored; i++)
+                                closure_add(&cl, unanchored[i]);
+                        qsort(cl.out, cl.n_out, sizeof(*cl.out), cmp_int);
+
+                        next = builder_intern(&b, cl.out, cl.n_out);
+                        if (next < 0) {
+                                ok = false;
+                                break;
+                        }
+                        dfa->trans[d * dfa->n_classes + k] = next;
+                }
+        }
+        if (!ok)
+                goto out;
+
+        dfa->n_states = b.n_sets;
+        dfa->accept_off = calloc(b.n_sets + 1, sizeof(*dfa->accept_off));
+        if (!dfa->accept_off)
+                goto nomem;
+        for (size_t d = 0; d < b.n_sets; d++) {
+                struct stateset *s = &b.sets[d];
+
+                /*
+                 * NFA states are numbered in expression order, so this
+                 * list comes out sorted.
+                 */
+                dfa->accept_off[d] = n_accept;
+                for (size_t i = 0; i < s->n; i++) {
+                        struct nstate *ns = &nfa.states[s->ids[i]];
+                        uint32_t *accept;
+
+                        if (ns->type != S_MATCH)
+                                continue;
+                        accept = grow(dfa->accept, &accept_alloc,
+                                      n_accept + 1, sizeof(*dfa->accept));
+                        if (!accept)
+                                goto nomem;
+                        dfa->accept = accept;
+                        dfa->accept[n_accept++] = ns->expr;
+                }
+        }
+        dfa->accept_off[b.n_sets] = n_accept;
+        debug("DFA: %u states, %u byte classes, %zu NFA states",
+              dfa->n_states, dfa->n_classes, nfa.n_states);
+        goto out;
+
+nomem:
+        debug("Could not allocate memory for the DFA; using regexec()");
+        ok = false;
+out:
+        for (size_t d = 0; d < b.n_sets; d++)
+                free(b.sets[d].ids);
+        free(b.sets);
+        free(b.hash);
+        free(cl.mark);
+        free(cl.stack);
+        free(cl.out);
+        free(unanchored);
+        free(nfa.states);
+        free(sets);
+        free(starts);
+        free(anchors);
+        if (!ok) {
+                for (size_t i = 0; i < n_exprs; i++)
+                        handled[i] = false;
+                dfa_free(dfa);
+                return NULL;
+        }
+        return dfa;
+}
+
+void
+dfa_free(struct dfa *dfa)
+{
+        if (!dfa)
+                return;
+        if (dfa->mapped) {
+                free(dfa);
+                return;
+        }
+        free(dfa->trans);
+        free(dfa->accept_off);
+        free(dfa->accept);
+        free(dfa->trim_off);
+        free(dfa->trim);
+        free(dfa->n_groups);
+        free(dfa);
+}
+
+
+struct dfa_image {
+        uint32_t n_states;
+        uint32_t n_classes;
+        uint32_t start;
+        uint32_t n_accept;
+        uint32_t n_trims;
+        uint32_t n_exprs;
+        uint8_t classes[256];
+        /*
+         * followed by trans[n_states * n_classes],
+         * accept_off[n_states + 1], accept[n_accept],
+         * trim_off[n_exprs + 1], trim[n_trims], n_groups[n_exprs]
+         */
+        uint32_t data[];
+};
+
+static size_t
+image_words(uint64_t n_states, uint64_t n_classes, uint64_t n_accept,
+            uint64_t n_trims, uint64_t n_exprs)
+{
+        return n_states * n_classes + n_states + 1 + n_accept +
+               n_exprs + 1 + n_trims * 2 + n_exprs;
+}
+
+size_t
+dfa_image_size(const struct dfa *dfa)
+{
+        return sizeof(struct dfa_image) +
+               image_words(dfa->n_states, dfa->n_classes,
+                           dfa->accept_off[dfa->n_states],
+                           dfa->trim_off[dfa->n_exprs], dfa->n_exprs) *
+               sizeof(uint32_t);
+}
+
+void
+dfa_image_write(const struct dfa *dfa, void *image)
+{
+        struct dfa_image *di = image;
+        uint32_t *data = di->data;
+        size_t n;
+
+        di->n_states = dfa->n_states;
+        di->n_classes = dfa->n_classes;
+        di->start = dfa->start;
+        di->n_accept = dfa->accept_off[dfa->n_states];
+        di->n_trims = dfa->trim_off[dfa->n_exprs];
+        di->n_exprs = dfa->n_exprs;
+        memcpy(di->classes, dfa->classes, sizeof(di->classes));
+
+        n = (size_t)dfa->n_states * dfa->n_classes;
+        memcpy(data, dfa->trans, n * sizeof(*data));
+        data += n;
+        memcpy(data, dfa->accept_off, (dfa->n_states + 1) * sizeof(*data));
+        data += dfa->n_states + 1;
+        memcpy(data, dfa->accept, di->n_accept * sizeof(*data));
+        data += di->n_accept;
+        memcpy(data, dfa->trim_off, (dfa->n_exprs + 1) * sizeof(*data));
+        data += dfa->n_exprs + 1;
+        for (size_t i = 0; i < di->n_trims; i++) {
+                *data++ = dfa->trim[i].group;
+                *data++ = dfa->trim[i].tail;
+        }
+        memcpy(data, dfa->n_groups, dfa->n_exprs * sizeof(*data));
+}
+
+static bool
+offsets_ok(const uint32_t *off, size_t n, uint32_t limit)
+{
+        if (off[0] != 0 || off[n] != limit)
+                return false;
+        for (size_t i = 0; i < n; i++)
+                if (off[i] > off[i+1])
+                        return false;
+        return true;
+}
+
+struct dfa *
+dfa_map(const void *image, size_t size, size_t n_exprs)
+{
+        const struct dfa_image *di = image;
+        const uint32_t *data;
+        struct dfa *dfa;
+        size_t n;
+
+        if (size < sizeof(*di) || di->n_exprs != n_exprs ||
+            di->n_states < 2 || di->n_states > DFA_MAX_STATES ||
+            di->n_classes < 2 || di->n_classes > 256 ||
+            di->start >= di->n_states ||
+            size != sizeof(*di) + image_words(di->n_states, di->n_classes,
+                                              di->n_accept, di->n_trims,
+                                              di->n_exprs) * sizeof(uint32_t)) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        dfa = calloc(1, sizeof(*dfa));
+        if (!dfa)
+                return NULL;
+        dfa->mapped = true;
+        dfa->n_states = di->n_states;
+        dfa->n_classes = di->n_classes;
+        dfa->start = di->start;
+        dfa->n_exprs = di->n_exprs;
+        memcpy(dfa->classes, di->classes, sizeof(dfa->classes));
+
+        /*
+         * struct dfa_trim is two uint32_t, so trim[] can be used in
+         * place as well.
+         */
+        data = di->data;
+        n = (size_t)dfa->n_states * dfa->n_classes;
+        dfa->trans = (uint32_t *)data;
+        data += n;
+        dfa->accept_off = (uint32_t *)data;
+        data += dfa->n_states + 1;
+        dfa->accept = (uint32_t *)data;
+        data += di->n_accept;
+        dfa->trim_off = (uint32_t *)data;
+        data += dfa->n_exprs + 1;
+        dfa->trim = (struct dfa_trim *)data;
+        data += di->n_trims * 2;
+        dfa->n_groups = (uint32_t *)data;
+
+        for (int c = 0; c < 256; c++)
+                if (dfa->classes[c] >= dfa->n_classes)
+                        goto bad;
+        for (size_t i = 0; i < n; i++)
+                if (dfa->trans[i] >= dfa->n_states)
+                        goto bad;
+        if (!offsets_ok(dfa->accept_off, dfa->n_states, di->n_accept) ||
+            !offsets_ok(dfa->trim_off, dfa->n_exprs, di->n_trims))
+                goto bad;
+        for (size_t i = 0; i < di->n_accept; i++)
+                if (dfa->accept[i] >= dfa->n_exprs)
+                        goto bad;
+        return dfa;
+bad:
+        free(dfa);
+        errno = EINVAL;
+        return NULL;
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,99 @@
+/*
+ * dfa.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef DFA_H_
+#define DFA_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A single DFA built from every expression in an escape_exprs set that
+ * it knows how to handle.  It searches unanchored, the way regexec()
+ * does, so stepping it over buf+1 one byte at a time lands in an
+ * accepting state as soon as any expression matches something that ends
+ * at the current byte.  Expressions it can't do (back references, GNU
+ * word operators, anchors in odd places, subexpressions that aren't a
+ * fixed distance from the end of the match, ...) are left for regexec().
+ */
+
+#define DFA_DEAD        0
+
+struct dfa_trim {
+        uint32_t group;
+        uint32_t tail;
+};
+
+struct dfa {
+        uint32_t n_states;
+        uint32_t n_classes;
+        uint32_t start;
+        uint8_t classes[256];
+        uint32_t *trans;                /* n_states * n_classes */
+        uint32_t *accept_off;           /* n_states + 1 */
+        uint32_t *accept;               /* expression indices, ascending */
+        uint32_t *trim_off;             /* n_exprs + 1 */
+        struct dfa_trim *trim;
+        uint32_t *n_groups;             /* n_exprs */
+        size_t n_exprs;
+
+        bool mapped;                    /* arrays belong to an image */
+};
+
+extern struct dfa *dfa_compile(const char **exprs, size_t n_exprs,
+                               bool *handled);
+extern void dfa_free(struct dfa *dfa);
+
+/*
+ * A flat copy of a compiled DFA, for the expression cache.  It's all
+ * uint32_t in host byte order, so dfa_map() can point straight into a
+ * mapped image; it checks that every index in it is in range first, and
+ * returns NULL with errno set to EINVAL if not (or ENOMEM).
+ */
+extern size_t dfa_image_size(const struct dfa *dfa);
+extern void dfa_image_write(const struct dfa *dfa, void *image);
+extern struct dfa *dfa_map(const void *image, size_t size, size_t n_exprs);
+
+static inline uint32_t
+dfa_step(const struct dfa *dfa, uint32_t state, unsigned char c)
+{
+        return dfa->trans[state * dfa->n_classes + dfa->classes[c]];
+}
+
+static inline bool
+dfa_accepting(const struct dfa *dfa, uint32_t state)
+{
+        return dfa->accept_off[state] != dfa->accept_off[state+1];
+}
+
+/*
+ * What match() would make of regexec()'s answer for expression expr,
+ * given a whole match of length len ending at the end of the string.  It
+ * takes the smallest rm_eo of any subexpression, and each subexpression
+ * the DFA accepts sits a fixed distance from the end.  It also keeps
+ * going past nmatch (which is len) into the zeroed part of matches[]
+ * when there are no unused subexpression slots to stop it, which makes
+ * the answer 0.
+ */
+static inline size_t
+dfa_match_end(const struct dfa *dfa, uint32_t expr, size_t len)
+{
+        size_t end = len;
+
+        if (len <= dfa->n_groups[expr] + 1)
+                return 0;
+
+        for (uint32_t i = dfa->trim_off[expr]; i < dfa->trim_off[expr+1]; i++) {
+                const struct dfa_trim *t = &dfa->trim[i];
+
+                if (len - t->tail < end)
+                        end = len - t->tail;
+        }
+        return end;
+}
+
+#endif /* !DFA_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,19 @@
+/*
+ * error.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef ERROR_H_
+#define ERROR_H_
+
+/*
+ * Record an error for untty_error(), in the style of warn() and warnx().
+ * Both preserve errno.
+ */
+extern void set_error(const char *fmt, ...)
+        __attribute__((__format__(printf, 1, 2)));
+extern void set_errorx(const char *fmt, ...)
+        __attribute__((__format__(printf, 1, 2)));
+
+#endif /* !ERROR_H_ */
+// vim:fenc=utf-8:tw=75:et
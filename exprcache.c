@@ -0,0 +1,470 @@
+/*
+ * exprcache.c - precompiled expression sets
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "debug.h"
+#include "dfa.h"
+#include "error.h"
+#include "exprset.h"
+#include "untty.h"
+
+/*
+ * A cache file is this header followed by its sections, each 8-byte
+ * aligned, all in the byte order of whoever wrote it.  Loading one is an
+ * mmap(), a bounds check, and regcomp() of only the expressions the DFA
+ * doesn't handle; the rest get compiled if match() ever needs them.
+ *
+ * It's stale when the hash of its source text no longer matches.  To
+ * avoid reading the source just to hash it, the source's size and mtime
+ * are checked first, and a match there is taken as good enough.
+ */
+#define EXPRS_CACHE_MAGIC       "UNTTYEXC"
+#define EXPRS_CACHE_VERSION     1
+#define EXPRS_CACHE_BYTE_ORDER  0x01020304
+
+struct exprs_cache_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint64_t size;                  /* of the whole file */
+        uint64_t hash;                  /* exprs_hash() of the source */
+        uint64_t source_size;
+        int64_t source_mtime_sec;
+        int64_t source_mtime_nsec;
+        uint64_t source_off;            /* path, or 0 if there isn't one */
+        uint64_t n_exprs;
+        uint64_t exprs_off;             /* uint32_t offsets into text */
+        uint64_t text_off;              /* NUL terminated expressions */
+        uint64_t text_size;
+        uint64_t handled_off;           /* one byte per expression */
+        uint64_t dfa_off;               /* dfa_image_write(), or 0 */
+        uint64_t dfa_size;
+};
+
+struct exprs_cache {
+        const struct exprs_cache_header *hdr;
+        const char *data;
+        size_t size;
+        bool mapped;
+};
+
+#define ALIGN8(x)       (((x) + 7) & ~(uint64_t)7)
+
+static bool
+section_ok(const struct exprs_cache_header *hdr, uint64_t off, uint64_t size,
+           uint64_t align)
+{
+        return off >= sizeof(*hdr) && off <= hdr->size &&
+               size <= hdr->size - off && off % align == 0;
+}
+
+static bool
+cache_valid(const char *data, size_t size)
+{
+        const struct exprs_cache_header *hdr = (const void *)data;
+        const uint32_t *offsets;
+        const char *text;
+
+        if (size < sizeof(*hdr) ||
+            memcmp(hdr->magic, EXPRS_CACHE_MAGIC, sizeof(hdr->magic)) ||
+            hdr->version != EXPRS_CACHE_VERSION ||
+            hdr->byte_order != EXPRS_CACHE_BYTE_ORDER ||
+            hdr->size != size ||
+            hdr->n_exprs > UINT32_MAX)
+                return false;
+
+        if (hdr->source_off) {
+                if (!section_ok(hdr, hdr->source_off, 1, 1) ||
+                    !memchr(data + hdr->source_off, '\0',
+                            size - hdr->source_off))
+                        return false;
+        }
+
+        if (!section_ok(hdr, hdr->exprs_off, hdr->n_exprs * 4, 4) ||
+            !section_ok(hdr, hdr->text_off, hdr->text_size, 1) ||
+            !section_ok(hdr, hdr->handled_off, hdr->n_exprs, 1))
+                return false;
+        if (hdr->dfa_off && !section_ok(hdr, hdr->dfa_off, hdr->dfa_size, 4))
+                return false;
+
+        text = data + hdr->text_off;
+        if (hdr->text_size == 0 || text[hdr->text_size - 1] != '\0')
+                return false;
+        offsets = (const uint32_t *)(data + hdr->exprs_off);
+        for (uint64_t i = 0; i < hdr->n_exprs; i++)
+                if (offsets[i] >= hdr->text_size)
+                        return false;
+        return true;
+}
+
+struct exprs_cache *
+exprs_cache_open_mem(const void *data, size_t size)
+{
+        struct exprs_cache *cache;
+
+        if (!cache_valid(data, size))
+                return NULL;
+
+        cache = calloc(1, sizeof(*cache));
+        if (!cache) {
+                set_error("Could not allocate memory");
+                return NULL;
+        }
+        cache->data = data;
+        cache->size = size;
+        cache->hdr = data;
+        return cache;
+}
+
+/*
+ * Whether fd starts out like a cache, usable or not.
+ */
+bool
+exprs_cache_is_cache(int fd)
+{
+        char magic[sizeof(((struct exprs_cache_header *)0)->magic)];
+
+        return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+               !memcmp(magic, EXPRS_CACHE_MAGIC, sizeof(magic));
+}
+
+/*
+ * Returns NULL if fd isn't a cache this build can use.
+ */
+struct exprs_cache *
+exprs_cache_open(int fd, const char *filename)
+{
+        struct exprs_cache *cache;
+        struct stat sb;
+        void *data;
+
+        if (fstat(fd, &sb) < 0) {
+                set_error("Couldn't get file size for \"%s\"", filename);
+                return NULL;
+        }
+        if (!S_ISREG(sb.st_mode) || !exprs_cache_is_cache(fd) ||
+            (uint64_t)sb.st_size < sizeof(struct exprs_cache_header)) {
+                errno = EINVAL;
+                set_errorx("\"%s\" is not a usable expression cache",
+                           filename);
+                return NULL;
+        }
+
+        data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+                set_error("Couldn't map \"%s\"", filename);
+                return NULL;
+        }
+
+        cache = exprs_cache_open_mem(data, sb.st_size);
+        if (!cache) {
+                errno = EINVAL;
+                set_errorx("\"%s\" is not a usable expression cache",
+                           filename);
+                munmap(data, sb.st_size);
+                return NULL;
+        }
+        cache->mapped = true;
+        return cache;
+}
+
+void
+exprs_cache_close(struct exprs_cache *cache)
+{
+        if (!cache)
+                return;
+        if (cache->mapped)
+                munmap((void *)cache->data, cache->size);
+        free(cache);
+}
+
+const char *
+exprs_cache_source(const struct exprs_cache *cache)
+{
+        if (!cache->hdr->source_off)
+                return NULL;
+        return cache->data + cache->hdr->source_off;
+}
+
+bool
+exprs_cache_matches(const struct exprs_cache *cache, uint64_t hash)
+{
+        return cache->hdr->hash == hash;
+}
+
+/*
+ * Whether cache was made from what's in fd now.
+ */
+bool
+exprs_cache_fresh(const struct exprs_cache *cache, int fd,
+                  const char *filename)
+{
+        const struct exprs_cache_header *hdr = cache->hdr;
+        struct stat sb;
+        char *text;
+        size_t size;
+        uint64_t hash;
+
+        if (fstat(fd, &sb) < 0 || (uint64_t)sb.st_size != hdr->source_size)
+                return false;
+        if (sb.st_mtim.tv_sec == hdr->source_mtime_sec &&
+            sb.st_mtim.tv_nsec == hdr->source_mtime_nsec)
+                return true;
+
+        text = exprs_read_file(fd, filename, &size);
+        if (!text)
+                return false;
+        hash = exprs_hash(text, size - 1);
+        free(text);
+        if (lseek(fd, 0, SEEK_SET) < 0)
+                return false;
+
+        debug("\"%s\" has a new mtime; cache is %s", filename,
+              hash == hdr->hash ? "still good" : "stale");
+        return hash == hdr->hash;
+}
+
+/*
+ * Makes an expression set out of cache, which it takes over.
+ */
+struct untty_exprs *
+exprs_cache_use(struct exprs_cache *cache)
+{
+        const struct exprs_cache_header *hdr = cache->hdr;
+        const uint32_t *offsets;
+        const uint8_t *handled_in;
+        const char *text;
+        struct untty_exprs *ex;
+        const char **exprs = NULL;
+        regex_t *regexps = NULL;
+        bool *handled = NULL;
+        struct dfa *dfa = NULL;
+        size_t n_exprs = hdr->n_exprs;
+        size_t n_compiled = 0;
+        char errbuf[1024];
+
+        ex = calloc(1, sizeof(*ex));
+        exprs = calloc(n_exprs + 1, sizeof(*exprs));
+        regexps = calloc(n_exprs ? n_exprs : 1, sizeof(*regexps));
+        handled = calloc(n_exprs ? n_exprs : 1, sizeof(*handled));
+        if (!ex || !exprs || !regexps || !handled) {
+                set_error("Could not allocate memory");
+                goto err;
+        }
+
+        if (hdr->dfa_off) {
+                dfa = dfa_map(cache->data + hdr->dfa_off, hdr->dfa_size,
+                              n_exprs);
+                if (!dfa) {
+                        if (errno == ENOMEM)
+                                set_error("Could not allocate memory");
+                        else
+                                set_errorx("Invalid expression cache");
+                        goto err;
+                }
+        }
+
+        text = cache->data + hdr->text_off;
+        offsets = (const uint32_t *)(cache->data + hdr->exprs_off);
+        handled_in = (const uint8_t *)(cache->data + hdr->handled_off);
+        for (size_t i = 0; i < n_exprs; i++) {
+                exprs[i] = text + offsets[i];
+                handled[i] = dfa && handled_in[i];
+        }
+
+        for (size_t i = 0; i < n_exprs; i++) {
+                int rc;
+
+                if (handled[i])
+                        continue;
+                debug("expr[%zu]:%s", i, exprs[i]);
+                rc = regcomp(&regexps[i], exprs[i], 0);
+                if (rc != 0) {
+                        regerror(rc, &regexps[i], errbuf, sizeof(errbuf));
+                        set_errorx("Could not compile regexp \"%s\": %s",
+                                   exprs[i], errbuf);
+                        errno = EINVAL;
+                        goto err;
+                }
+                n_compiled = i + 1;
+        }
+
+        if (hdr->source_off) {
+                ex->source = strdup(cache->data + hdr->source_off);
+                if (!ex->source) {
+                        set_error("Could not allocate memory");
+                        goto err;
+                }
+        }
+        ex->hash = hdr->hash;
+        ex->source_size = hdr->source_size;
+        ex->source_mtime.tv_sec = hdr->source_mtime_sec;
+        ex->source_mtime.tv_nsec = hdr->source_mtime_nsec;
+        if (cache->mapped) {
+                ex->map = (void *)cache->data;
+                ex->map_size = cache->size;
+        }
+        free(cache);
+
+        if (setup_matcher_lazy(&ex->matcher, regexps, n_exprs, exprs, dfa,
+                               handled) < 0)
+                goto err;
+        return ex;
+err:
+        for (size_t i = 0; i < n_compiled; i++)
+                if (!handled[i])
+                        regfree(&regexps[i]);
+        dfa_free(dfa);
+        free(handled);
+        free(regexps);
+        free(exprs);
+        free(ex);
+        exprs_cache_close(cache);
+        return NULL;
+}
+
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+        while (len) {
+                ssize_t rc = write(fd, buf, len);
+
+                if (rc < 0) {
+                        if (errno == EAGAIN || errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                buf += rc;
+                len -= rc;
+        }
+        return 0;
+}
+
+PUBLIC int
+untty_exprs_save(const struct untty_exprs *ex, const char *filename)
+{
+        const struct matcher *m = &ex->matcher;
+        struct exprs_cache_header hdr;
+        char source[PATH_MAX];
+        size_t source_len = 0;
+        char *buf, *tmpname = NULL;
+        uint32_t *offsets;
+        uint64_t off = 0;
+        mode_t mode = 0644;
+        struct stat sb;
+        int fd, rc = -1;
+
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, EXPRS_CACHE_MAGIC, sizeof(hdr.magic));
+        hdr.version = EXPRS_CACHE_VERSION;
+        hdr.byte_order = EXPRS_CACHE_BYTE_ORDER;
+        hdr.hash = ex->hash;
+        hdr.source_size = ex->source_size;
+        hdr.source_mtime_sec = ex->source_mtime.tv_sec;
+        hdr.source_mtime_nsec = ex->source_mtime.tv_nsec;
+        hdr.n_exprs = m->n_exprs;
+
+        off = ALIGN8(sizeof(hdr));
+        if (ex->source) {
+                if (!realpath(ex->source, source) ||
+                    strlen(source) >= sizeof(source))
+                        snprintf(source, sizeof(source), "%s", ex->source);
+                source_len = strlen(source) + 1;
+                hdr.source_off = off;
+                off = ALIGN8(off + source_len);
+        }
+        hdr.exprs_off = off;
+        off = ALIGN8(off + m->n_exprs * 4);
+        hdr.text_off = off;
+        for (size_t i = 0; i < m->n_exprs; i++)
+                hdr.text_size += strlen(m->exprs[i]) + 1;
+        if (hdr.text_size == 0)
+                hdr.text_size = 1;
+        off = ALIGN8(off + hdr.text_size);
+        hdr.handled_off = off;
+        off = ALIGN8(off + m->n_exprs);
+        if (m->dfa) {
+                hdr.dfa_off = off;
+                hdr.dfa_size = dfa_image_size(m->dfa);
+                off = ALIGN8(off + hdr.dfa_size);
+        }
+        hdr.size = off;
+
+        buf = calloc(1, hdr.size);
+        if (!buf) {
+                set_error("Could not allocate memory");
+                return -1;
+        }
+        memcpy(buf, &hdr, sizeof(hdr));
+        if (source_len)
+                memcpy(buf + hdr.source_off, source, source_len);
+        offsets = (uint32_t *)(buf + hdr.exprs_off);
+        off = 0;
+        for (size_t i = 0; i < m->n_exprs; i++) {
+                size_t len = strlen(m->exprs[i]) + 1;
+
+                offsets[i] = off;
+                memcpy(buf + hdr.text_off + off, m->exprs[i], len);
+                off += len;
+                buf[hdr.handled_off + i] = m->handled[i];
+        }
+        if (m->dfa)
+                dfa_image_write(m->dfa, buf + hdr.dfa_off);
+
+        /*
+         * Write it next to where it's going and rename it into place, so
+         * nobody loading it at the same time sees half of one.
+         */
+        if (asprintf(&tmpname, "%s.XXXXXX", filename) < 0) {
+                tmpname = NULL;
+                set_error("Could not allocate memory");
+                goto out;
+        }
+        fd = mkstemp(tmpname);
+        if (fd < 0) {
+                set_error("Could not create \"%s\"", tmpname);
+                goto out;
+        }
+        if (write_all(fd, buf, hdr.size) < 0) {
+                set_error("Could not write to \"%s\"", tmpname);
+                close(fd);
+                unlink(tmpname);
+                goto out;
+        }
+        /* it's no more secret than what it was made from */
+        if (ex->source && stat(ex->source, &sb) == 0)
+                mode = sb.st_mode & 0666;
+        fchmod(fd, mode);
+        close(fd);
+        if (rename(tmpname, filename) < 0) {
+                set_error("Could not rename \"%s\" to \"%s\"", tmpname,
+                          filename);
+                unlink(tmpname);
+                goto out;
+        }
+        rc = 0;
+out:
+        free(tmpname);
+        free(buf);
+        return rc;
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,426 @@
+/*
+ * exprset.c - loading and compiling escape_exprs
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "debug.h"
+#include "error.h"
+#include "exprset.h"
+#include "strip.h"
+#include "untty.h"
+
+static void
+free_exprs(struct untty_exprs *ex, size_t n_compiled)
+{
+        for (size_t i = 0; i < n_compiled; i++)
+                if (matcher_compiled(&ex->matcher, i))
+                        regfree(&ex->matcher.regexps[i]);
+        free_matcher(&ex->matcher);
+        free(ex->matcher.regexps);
+        free(ex->matcher.exprs);
+        if (ex->map)
+                munmap(ex->map, ex->map_size);
+        free(ex->text);
+        free(ex->source);
+        free(ex);
+}
+
+uint64_t
+exprs_hash(const char *text, size_t size)
+{
+        uint64_t h = 0xcbf29ce484222325ull;
+
+        for (size_t i = 0; i < size; i++) {
+                h ^= (unsigned char)text[i];
+                h *= 0x100000001b3ull;
+        }
+        return h;
+}
+
+/*
+ * Split data (which ends with a NUL at data[size-1]) into lines, leaving
+ * out comments, and compile each one.
+ */
+static int
+compile_exprs(struct untty_exprs *ex, char *data, size_t size)
+{
+        char errbuf[1024];
+        regex_t *regexps;
+        const char **exprs;
+        size_t n_exprs = 0;
+        size_t allocation = 0;
+        char *cur = data;
+
+        exprs = NULL;
+        for (ssize_t limit = size, addend = 0; cur && limit; limit -= addend) {
+                char *next = memchr(cur, '\n', limit);
+
+                if (limit == 1 && cur[0] == 0)
+                        break;
+
+                if (next) {
+                        *next = 0;
+                        next++;
+                }
+
+                /* keep one spare so the list is always NULL terminated */
+                if (n_exprs + 1 >= allocation) {
+                        const char **new_exprs;
+
+                        allocation += 512;
+                        new_exprs = reallocarray(exprs, allocation,
+                                                 sizeof(char *));
+                        if (!new_exprs) {
+                                set_error("Could not allocate memory");
+                                free(exprs);
+                                return -1;
+                        }
+                        exprs = new_exprs;
+                }
+
+                if (cur[0] != '#') {
+                        exprs[n_exprs] = cur;
+                        n_exprs += 1;
+                }
+                addend = next ? next - cur : limit;
+                cur = next;
+        }
+        if (!exprs) {
+                exprs = calloc(1, sizeof(char *));
+                if (!exprs) {
+                        set_error("Could not allocate memory");
+                        return -1;
+                }
+        }
+        exprs[n_exprs] = NULL;
+        ex->matcher.exprs = exprs;
+
+        regexps = calloc(n_exprs ? n_exprs : 1, sizeof(*regexps));
+        if (!regexps) {
+                set_error("Could not allocate memory");
+                return -1;
+        }
+        ex->matcher.regexps = regexps;
+
+        for (unsigned int i = 0; exprs[i] != NULL; i++) {
+                int rc;
+
+                debug("expr[%u]:%s", i, exprs[i]);
+                rc = regcomp(&regexps[i], exprs[i], 0);
+                if (rc != 0) {
+                        regerror(rc, &regexps[i], errbuf, sizeof(errbuf));
+                        set_errorx("Could not compile regexp \"%s\": %s",
+                                   exprs[i], errbuf);
+                        ex->matcher.n_exprs = i;
+                        errno = EINVAL;
+                        return -1;
+                }
+        }
+        ex->matcher.n_exprs = n_exprs;
+
+        return setup_matcher(&ex->matcher, regexps, n_exprs, exprs);
+}
+
+static struct untty_exprs *
+exprs_new(char *text, size_t size, char *source)
+{
+        struct untty_exprs *ex;
+
+        ex = calloc(1, sizeof(*ex));
+        if (!ex) {
+                set_error("Could not allocate memory");
+                free(text);
+                free(source);
+                return NULL;
+        }
+        ex->text = text;
+        ex->source = source;
+        ex->hash = exprs_hash(text, size - 1);
+
+        if (compile_exprs(ex, text, size) < 0) {
+                int errno_ = errno;
+
+                free_exprs(ex, ex->matcher.n_exprs);
+                errno = errno_;
+                return NULL;
+        }
+        return ex;
+}
+
+PUBLIC struct untty_exprs *
+untty_exprs_new(const char *text, size_t size)
+{
+        char *data;
+
+        data = malloc(size + 1);
+        if (!data) {
+                set_error("Could not allocate memory");
+                return NULL;
+        }
+        memcpy(data, text, size);
+        data[size] = 0;
+
+        return exprs_new(data, size + 1, NULL);
+}
+
+/*
+ * The build puts a cache of the defaults in exprs.S too, unless it was
+ * made on a machine that can't share them with this one.
+ */
+PUBLIC struct untty_exprs *
+untty_exprs_default(void)
+{
+        struct exprs_cache *cache;
+
+        cache = exprs_cache_open_mem(default_exprs_cache,
+                                     default_exprs_cache_size);
+        if (cache) {
+                if (exprs_cache_matches(cache,
+                                        exprs_hash(default_exprs,
+                                                   default_exprs_size - 1)))
+                        return exprs_cache_use(cache);
+                exprs_cache_close(cache);
+        }
+        return untty_exprs_new(default_exprs, default_exprs_size - 1);
+}
+
+char *
+exprs_read_file(int fd, const char *filename, size_t *sizep)
+{
+        struct stat sb;
+        char *data;
+        size_t size, len = 0;
+        int rc;
+
+        rc = fstat(fd, &sb);
+        if (rc < 0) {
+                set_error("Couldn't get file size for \"%s\"", filename);
+                return NULL;
+        }
+
+        size = sb.st_size + 1;
+        data = malloc(size);
+        if (!data) {
+                set_error("Could not allocate memory");
+                return NULL;
+        }
+
+        for (;;) {
+                ssize_t ret;
+
+                if (len == size - 1) {
+                        char *new_data;
+
+                        size *= 2;
+                        new_data = realloc(data, size);
+                        if (!new_data) {
+                                set_error("Could not allocate memory");
+                                free(data);
+                                return NULL;
+                        }
+                        data = new_data;
+                }
+
+                ret = read(fd, data + len, size - 1 - len);
+                if (ret < 0) {
+                        if (errno == EAGAIN || errno == EINTR)
+                                continue;
+                        set_error("Could not read \"%s\"", filename);
+                        free(data);
+                        return NULL;
+                }
+                if (ret == 0)
+                        break;
+                len += ret;
+        }
+
+        data[len] = 0;
+        *sizep = len + 1;
+        return data;
+}
+
+static struct untty_exprs *
+exprs_load_source(int fd, char *filename)
+{
+        struct untty_exprs *ex;
+        struct stat sb;
+        char *data;
+        size_t size;
+
+        data = exprs_read_file(fd, filename, &size);
+        if (!data) {
+                free(filename);
+                return NULL;
+        }
+
+        ex = exprs_new(data, size, filename);
+        if (ex && fstat(fd, &sb) == 0) {
+                ex->source_size = sb.st_size;
+                ex->source_mtime = sb.st_mtim;
+        }
+        return ex;
+}
+
+/*
+ * Load filename, which can be a cache made by untty_exprs_save().  With
+ * use_cache, a fresh filename.cache is used instead of compiling
+ * filename, and a cache named directly is only used if its source is
+ * gone or hasn't changed.
+ */
+struct untty_exprs *
+exprs_load_file(const char *filename_in, bool use_cache)
+{
+        struct exprs_cache *cache = NULL;
+        struct untty_exprs *ex;
+        char *filename, *cachename = NULL;
+        int fd, cfd;
+
+        filename = strdup(filename_in);
+        if (!filename) {
+                set_error("Could not allocate memory");
+                return NULL;
+        }
+
+        fd = open(filename, O_RDONLY|O_CLOEXEC);
+        if (fd < 0) {
+                set_error("Could not open \"%s\"", filename);
+                free(filename);
+                return NULL;
+        }
+
+        if (use_cache && exprs_cache_is_cache(fd)) {
+                const char *source;
+                int sfd = -1;
+
+                cache = exprs_cache_open(fd, filename);
+                if (!cache) {
+                        close(fd);
+                        free(filename);
+                        return NULL;
+                }
+
+                source = exprs_cache_source(cache);
+                if (source)
+                        sfd = open(source, O_RDONLY|O_CLOEXEC);
+                close(fd);
+                if (sfd < 0 || exprs_cache_fresh(cache, sfd, source)) {
+                        if (sfd >= 0)
+                                close(sfd);
+                        debug("using expression cache \"%s\"", filename);
+                        free(filename);
+                        return exprs_cache_use(cache);
+                }
+
+                debug("\"%s\" is stale; compiling \"%s\"", filename, source);
+                free(filename);
+                filename = strdup(source);
+                exprs_cache_close(cache);
+                if (!filename) {
+                        set_error("Could not allocate memory");
+                        close(sfd);
+                        return NULL;
+                }
+                fd = sfd;
+        } else if (use_cache && asprintf(&cachename, "%s.cache", filename) > 0) {
+                cfd = open(cachename, O_RDONLY|O_CLOEXEC);
+                if (cfd >= 0 && exprs_cache_is_cache(cfd))
+                        cache = exprs_cache_open(cfd, cachename);
+                if (cfd >= 0)
+                        close(cfd);
+                if (cache && exprs_cache_fresh(cache, fd, filename)) {
+                        debug("using expression cache \"%s\"", cachename);
+                        close(fd);
+                        free(filename);
+                        free(cachename);
+                        return exprs_cache_use(cache);
+                }
+                if (cache)
+                        debug("\"%s\" is stale", cachename);
+                exprs_cache_close(cache);
+                free(cachename);
+        }
+
+        ex = exprs_load_source(fd, filename);
+        close(fd);
+        return ex;
+}
+
+PUBLIC struct untty_exprs *
+untty_exprs_load(const char *filename_in)
+{
+        struct untty_exprs *ex;
+        char *filename = NULL;
+        int rc;
+
+        if (filename_in)
+                return exprs_load_file(filename_in, true);
+
+        filename = getenv("UNTTY_ESCAPE_EXPRS");
+        if (filename)
+                filename = strdup(filename);
+        if (!filename) {
+                char *homedir = getenv("$HOME");
+
+                if (!homedir) {
+                        struct passwd *pwent;
+                        uid_t uid;
+
+                        uid = getuid();
+
+                        pwent = getpwuid(uid);
+                        if (!pwent) {
+                                set_error("Could not get user info");
+                                return NULL;
+                        }
+                        homedir = pwent->pw_dir;
+                }
+
+                rc = asprintf(&filename, "%s/.config/untty/escape_exprs",
+                              homedir);
+                if (rc <= 0)
+                        filename = NULL;
+        }
+        if (!filename) {
+                set_error("Could not allocate memory");
+                return NULL;
+        }
+
+        ex = exprs_load_file(filename, true);
+        if (!ex && errno == ENOENT) {
+                free(filename);
+                return untty_exprs_default();
+        }
+        free(filename);
+        return ex;
+}
+
+PUBLIC const char *
+untty_exprs_source(const struct untty_exprs *ex)
+{
+        return ex->source;
+}
+
+PUBLIC void
+untty_exprs_free(struct untty_exprs *ex)
+{
+        if (ex)
+                free_exprs(ex, ex->matcher.n_exprs);
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,61 @@
+/*
+ * exprset.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef EXPRSET_H_
+#define EXPRSET_H_
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "strip.h"
+
+extern const char *default_exprs;
+extern const uint64_t default_exprs_size;
+extern const char *default_exprs_cache;
+extern const uint64_t default_exprs_cache_size;
+
+struct untty_exprs {
+        struct matcher matcher;
+        char *text;
+        char *source;
+
+        /*
+         * What the set was compiled from, so a cache of it can tell
+         * when it's stale: a hash of the text, and the size and mtime
+         * of source if there is one.
+         */
+        uint64_t hash;
+        uint64_t source_size;
+        struct timespec source_mtime;
+
+        /* set when it was loaded from a cache file */
+        void *map;
+        size_t map_size;
+};
+
+extern uint64_t exprs_hash(const char *text, size_t size);
+extern char *exprs_read_file(int fd, const char *filename, size_t *sizep);
+extern struct untty_exprs *exprs_load_file(const char *filename,
+                                           bool use_cache);
+
+/*
+ * exprcache.c: compiled expression sets saved by untty_exprs_save().
+ */
+struct exprs_cache;
+
+extern bool exprs_cache_is_cache(int fd);
+extern struct exprs_cache *exprs_cache_open(int fd, const char *filename);
+extern struct exprs_cache *exprs_cache_open_mem(const void *data,
+                                                size_t size);
+extern const char *exprs_cache_source(const struct exprs_cache *cache);
+extern bool exprs_cache_fresh(const struct exprs_cache *cache, int fd,
+                              const char *filename);
+extern bool exprs_cache_matches(const struct exprs_cache *cache,
+                                uint64_t hash);
+extern struct untty_exprs *exprs_cache_use(struct exprs_cache *cache);
+extern void exprs_cache_close(struct exprs_cache *cache);
+
+#endif /* !EXPRSET_H_ */
+// vim:fenc=utf-8:tw=75:et
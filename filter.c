@@ -0,0 +1,196 @@
+/*
+ * filter.c - untty --match
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#include <err.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+#include "strip.h"
+
+static void
+line_set(struct filter_line *l, const char *data, size_t len, bool append)
+{
+        size_t off = append ? l->len : 0;
+
+        if (off + len > l->size) {
+                l->size = (off + len) * 2;
+                l->buf = realloc(l->buf, l->size);
+                if (!l->buf)
+                        err(1, "Could not allocate memory");
+        }
+        memcpy(l->buf + off, data, len);
+        l->len = off + len;
+}
+
+static bool
+regexps_match(struct filter *f, const char *data, size_t len, bool dfa_too)
+{
+        for (size_t i = 0; i < f->n_exprs; i++) {
+                regmatch_t m = { .rm_so = 0, .rm_eo = len };
+
+                if (f->handled[i] && !dfa_too)
+                        continue;
+                if (regexec(&f->regexps[i], data, 1, &m, REG_STARTEND) == 0)
+                        return true;
+        }
+        return false;
+}
+
+/*
+ * The DFA stops dead at NUL, since regexec() would for escape sequences;
+ * a line with one in it goes to regexec() whole, which takes NUL as just
+ * another byte with REG_STARTEND.
+ */
+static bool
+filter_match(struct filter *f, const char *data, size_t len)
+{
+        if (f->dfa) {
+                uint32_t state = f->dfa->start;
+
+                for (size_t i = 0; i < len; i++) {
+                        state = dfa_step(f->dfa, state, data[i]);
+                        if (dfa_accepting(f->dfa, state))
+                                return true;
+                        if (state == DFA_DEAD) {
+                                if (data[i] == '\0')
+                                        return regexps_match(f, data, len,
+                                                             true);
+                                break;
+                        }
+                }
+        }
+        return regexps_match(f, data, len, false);
+}
+
+static void
+filter_line(struct filter *f, const char *data, size_t len)
+{
+        size_t n = len && data[len-1] == NL ? len - 1 : len;
+
+        if (filter_match(f, data, n) != f->invert) {
+                if (f->gap && f->written && f->context)
+                        output_write(f->out, "--\n", 3);
+                for (unsigned int i = 0; i < f->n_before; i++) {
+                        struct filter_line *l;
+
+                        l = &f->before[(f->first_before + i) % f->context];
+                        output_write(f->out, l->buf, l->len);
+                }
+                f->n_before = 0;
+                output_write(f->out, data, len);
+                f->written = true;
+                f->gap = false;
+                f->after = f->context;
+        } else if (f->after) {
+                output_write(f->out, data, len);
+                f->after--;
+        } else if (f->context) {
+                unsigned int slot = (f->first_before + f->n_before) % f->context;
+
+                if (f->n_before == f->context) {
+                        f->first_before = (f->first_before + 1) % f->context;
+                        f->gap = true;
+                } else {
+                        f->n_before++;
+                }
+                line_set(&f->before[slot], data, len, false);
+        } else {
+                f->gap = true;
+        }
+}
+
+static int
+filter_write(void *data, const char *buf, size_t len)
+{
+        struct filter *f = data;
+
+        while (len) {
+                const char *nl = memchr(buf, NL, len);
+                size_t n = nl ? (size_t)(nl + 1 - buf) : len;
+
+                if (!nl) {
+                        line_set(&f->line, buf, n, true);
+                } else if (f->line.len) {
+                        line_set(&f->line, buf, n, true);
+                        filter_line(f, f->line.buf, f->line.len);
+                        f->line.len = 0;
+                } else {
+                        filter_line(f, buf, n);
+                }
+                buf += n;
+                len -= n;
+        }
+        return 0;
+}
+
+void
+filter_open(struct filter *f, struct output *out, const char **exprs,
+            size_t n_exprs, bool invert, unsigned int context)
+{
+        memset(f, 0, sizeof(*f));
+        f->out = out;
+        f->n_exprs = n_exprs;
+        f->invert = invert;
+        f->context = context;
+
+        f->regexps = calloc(n_exprs, sizeof(*f->regexps));
+        f->handled = calloc(n_exprs, sizeof(*f->handled));
+        f->before = calloc(context ? context : 1, sizeof(*f->before));
+        if (!f->regexps || !f->handled || !f->before)
+                err(1, "Could not allocate memory");
+
+        /* everything gets regcomp()ed, if only for its error messages */
+        for (size_t i = 0; i < n_exprs; i++) {
+                int rc = regcomp(&f->regexps[i], exprs[i], REG_NOSUB);
+
+                if (rc != 0) {
+                        char msg[256];
+
+                        regerror(rc, &f->regexps[i], msg, sizeof(msg));
+                        errx(1, "Invalid --match expression \"%s\": %s",
+                             exprs[i], msg);
+                }
+        }
+        f->dfa = dfa_compile(exprs, n_exprs, f->handled);
+
+        if (output_open_cb(&f->in, filter_write, f, OUTPUT_BUFSZ) < 0)
+                err(1, "Could not allocate memory");
+        f->in.line_buffered = out->line_buffered;
+}
+
+/*
+ * Everything up to the last NL goes through; a partial line can't be
+ * judged yet.
+ */
+void
+filter_flush(struct filter *f)
+{
+        output_flush(&f->in);
+        output_flush(f->out);
+}
+
+void
+filter_close(struct filter *f)
+{
+        output_close(&f->in);
+        if (f->line.len)
+                filter_line(f, f->line.buf, f->line.len);
+
+        for (size_t i = 0; i < f->n_exprs; i++)
+                regfree(&f->regexps[i]);
+        free(f->regexps);
+        free(f->handled);
+        dfa_free(f->dfa);
+        for (unsigned int i = 0; i < f->context; i++)
+                free(f->before[i].buf);
+        free(f->before);
+        free(f->line.buf);
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,61 @@
+/*
+ * filter.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include <regex.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "dfa.h"
+#include "output.h"
+
+/*
+ * --match: keep only the stripped lines that match any of exprs (or with
+ * invert, that match none of them), plus context lines on either side,
+ * with "--" between groups that aren't next to each other, like grep.
+ *
+ * The strip context writes to in, which hands each flush to the filter
+ * rather than to a file; kept lines go on to out.  exprs are basic
+ * regular expressions, like escape_exprs, and the ones the DFA can do
+ * are run through it together, so a line gets looked at once however
+ * many there are.  A line that's split between flushes is collected in
+ * line until its NL shows up, or filter_close() decides it's the last.
+ */
+struct filter_line {
+        char *buf;
+        size_t len;
+        size_t size;
+};
+
+struct filter {
+        struct output in;
+        struct output *out;
+
+        size_t n_exprs;
+        regex_t *regexps;
+        bool *handled;
+        struct dfa *dfa;
+        bool invert;
+        unsigned int context;
+
+        struct filter_line line;
+        struct filter_line *before;     /* ring of context lines */
+        unsigned int n_before;
+        unsigned int first_before;
+        unsigned int after;             /* context lines left to write */
+        bool written;
+        bool gap;                       /* lines dropped since the last */
+};
+
+extern void filter_open(struct filter *f, struct output *out,
+                        const char **exprs, size_t n_exprs, bool invert,
+                        unsigned int context);
+extern void filter_flush(struct filter *f);
+extern void filter_close(struct filter *f);
+
+#endif /* !FILTER_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,307 @@
+/*
+ * index.c - untty --index and --lookup
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "debug.h"
+#include "index.h"
+#include "untty.h"
+
+/*
+ * An index file is this header, in the byte order of whoever wrote it,
+ * followed by the checkpoints.  Each is the distance in output and then
+ * in input from the one before (the first from 0, 0), as LEB128, which
+ * keeps an every-line index to a few bytes a line.
+ *
+ * options and exprs_hash say how the output was stripped; an index is
+ * no use with anything else.  input_size is how much input it covers,
+ * and is filled in by index_close().
+ */
+#define INDEX_MAGIC             "UNTTYIDX"
+#define INDEX_VERSION           1
+#define INDEX_BYTE_ORDER        0x01020304
+
+struct index_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint32_t options;               /* UNTTY_* flags */
+        uint32_t reserved;
+        uint64_t exprs_hash;
+        uint64_t interval;
+        uint64_t input_size;
+};
+
+static void
+put_varint(FILE *f, uint64_t v)
+{
+        do {
+                int c = v & 0x7f;
+
+                v >>= 7;
+                putc(v ? c | 0x80 : c, f);
+        } while (v);
+}
+
+static bool
+get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+        *v = 0;
+        for (unsigned int shift = 0; *p < end && shift < 64; shift += 7) {
+                unsigned char c = *(*p)++;
+
+                *v |= (uint64_t)(c & 0x7f) << shift;
+                if (!(c & 0x80))
+                        return true;
+        }
+        return false;
+}
+
+void
+index_open(struct index *ix, const char *path, uint64_t interval,
+           const struct strip_config *config, uint64_t exprs_hash)
+{
+        struct index_header hdr = {
+                .magic = INDEX_MAGIC,
+                .version = INDEX_VERSION,
+                .byte_order = INDEX_BYTE_ORDER,
+                .options = strip_options(config),
+                .exprs_hash = exprs_hash,
+                .interval = interval,
+        };
+
+        memset(ix, 0, sizeof(*ix));
+        ix->name = path;
+        ix->interval = interval;
+        ix->next = interval;
+        ix->f = fopen(path, "we");
+        if (!ix->f)
+                err(1, "Could not open \"%s\"", path);
+        if (fwrite(&hdr, sizeof(hdr), 1, ix->f) != 1)
+                err(1, "Could not write \"%s\"", path);
+}
+
+static void
+index_add(struct index *ix, uint64_t out_off)
+{
+        put_varint(ix->f, out_off - ix->last_out);
+        put_varint(ix->f, ix->in_off - ix->last_in);
+        ix->last_out = out_off;
+        ix->last_in = ix->in_off;
+        ix->next = ix->in_off + ix->interval;
+}
+
+void
+index_feed(struct index *ix, struct strip *s, const char *data, size_t len)
+{
+        while (len) {
+                const char *nl = NULL;
+                size_t n = len;
+
+                if (ix->in_off + len > ix->next) {
+                        size_t skip = ix->next > ix->in_off ?
+                                      ix->next - ix->in_off : 0;
+
+                        nl = memchr(data + skip, NL, len - skip);
+                        if (nl)
+                                n = nl + 1 - data;
+                }
+
+                strip_feed(s, data, n);
+                ix->in_off += n;
+                data += n;
+                len -= n;
+                if (nl)
+                        index_add(ix, output_offset(s->out));
+        }
+}
+
+void
+index_close(struct index *ix)
+{
+        uint64_t size = ix->in_off;
+
+        if (fseek(ix->f, offsetof(struct index_header, input_size),
+                  SEEK_SET) < 0 ||
+            fwrite(&size, sizeof(size), 1, ix->f) != 1 ||
+            fclose(ix->f) == EOF)
+                err(1, "Could not write \"%s\"", ix->name);
+        ix->f = NULL;
+}
+
+/*
+ * Input from the checkpoint on, a line at a time.  A line's output is
+ * [from, out_off); any line that overlaps [start, end] gets copied.
+ */
+struct lookup {
+        struct strip strip;
+        struct output mem;
+        struct output *out;
+        uint64_t out_off;
+        uint64_t start;
+        uint64_t end;
+        bool done;
+
+        char *line;
+        size_t line_len;
+        size_t line_size;
+};
+
+static void
+lookup_line(struct lookup *lk, const char *data, size_t len, bool last)
+{
+        uint64_t from = lk->out_off;
+
+        strip_feed(&lk->strip, data, len);
+        if (last)
+                strip_finish(&lk->strip);
+        if (lk->strip.error)
+                errx(3, "%s", untty_error());
+        if (lk->mem.error) {
+                errno = lk->mem.error;
+                err(1, "Could not allocate memory");
+        }
+        lk->out_off += lk->mem.len;
+        lk->mem.len = 0;
+
+        if (lk->out_off > lk->start && from <= lk->end)
+                output_write(lk->out, data, len);
+        if (lk->out_off > lk->end)
+                lk->done = true;
+}
+
+static void
+lookup_feed(struct lookup *lk, const char *data, size_t len)
+{
+        while (len && !lk->done) {
+                const char *nl = memchr(data, NL, len);
+                size_t n = nl ? (size_t)(nl + 1 - data) : len;
+
+                if (nl && !lk->line_len) {
+                        lookup_line(lk, data, n, false);
+                } else {
+                        /* a line split between reads */
+                        if (lk->line_len + n > lk->line_size) {
+                                lk->line_size = (lk->line_len + n) * 2;
+                                lk->line = realloc(lk->line, lk->line_size);
+                                if (!lk->line)
+                                        err(1, "Could not allocate memory");
+                        }
+                        memcpy(lk->line + lk->line_len, data, n);
+                        lk->line_len += n;
+                        if (nl) {
+                                lookup_line(lk, lk->line, lk->line_len, false);
+                                lk->line_len = 0;
+                        }
+                }
+                data += n;
+                len -= n;
+        }
+}
+
+void
+index_lookup(const char *path, const struct strip_config *config,
+             uint64_t exprs_hash, struct input *in, struct output *out,
+             uint64_t start, uint64_t end)
+{
+        const struct index_header *hdr;
+        const unsigned char *p, *stop;
+        uint64_t cp_out = 0, cp_in = 0, skip;
+        struct lookup lk;
+        const char *data;
+        struct stat sb;
+        ssize_t len;
+        size_t size;
+        void *map;
+        int fd;
+
+        fd = open(path, O_RDONLY|O_CLOEXEC);
+        if (fd < 0)
+                err(1, "Could not open \"%s\"", path);
+        if (fstat(fd, &sb) < 0)
+                err(1, "Could not stat \"%s\"", path);
+        size = sb.st_size;
+        if (size < sizeof(*hdr))
+                errx(1, "\"%s\" is not an untty index", path);
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+                err(1, "Could not map \"%s\"", path);
+        close(fd);
+
+        hdr = map;
+        if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) ||
+            hdr->version != INDEX_VERSION ||
+            hdr->byte_order != INDEX_BYTE_ORDER)
+                errx(1, "\"%s\" is not an untty index", path);
+        if (hdr->options != strip_options(config) ||
+            hdr->exprs_hash != exprs_hash)
+                errx(1, "\"%s\" was written with different options or expressions",
+                     path);
+        /* offsets in compressed input are after decompression */
+        if (!in->z && fstat(in->fd, &sb) == 0 && S_ISREG(sb.st_mode) &&
+            (uint64_t)sb.st_size < hdr->input_size)
+                errx(1, "\"%s\" is shorter than when \"%s\" was written",
+                     in->name, path);
+
+        p = (const unsigned char *)(hdr + 1);
+        stop = (const unsigned char *)map + size;
+        while (p < stop) {
+                uint64_t d_out, d_in;
+
+                if (!get_varint(&p, stop, &d_out) ||
+                    !get_varint(&p, stop, &d_in))
+                        errx(1, "\"%s\" is corrupt", path);
+                if (cp_out + d_out > start)
+                        break;
+                cp_out += d_out;
+                cp_in += d_in;
+        }
+        munmap(map, size);
+        debug("output offset %ju is after checkpoint %ju -> %ju",
+              (uintmax_t)start, (uintmax_t)cp_out, (uintmax_t)cp_in);
+
+        memset(&lk, 0, sizeof(lk));
+        if (output_open_mem(&lk.mem, 0) < 0)
+                err(1, "Could not allocate memory");
+        strip_init(&lk.strip, config, &lk.mem);
+        lk.out = out;
+        lk.out_off = cp_out;
+        lk.start = start;
+        lk.end = end;
+
+        skip = cp_in;
+        while (!lk.done && (len = input_read(in, &data)) > 0) {
+                if ((uint64_t)len <= skip) {
+                        skip -= len;
+                        continue;
+                }
+                lookup_feed(&lk, data + skip, len - skip);
+                skip = 0;
+        }
+        if (!lk.done)
+                lookup_line(&lk, lk.line, lk.line_len, true);
+        if (lk.out_off <= start)
+                errx(1, "Output offset %ju is past the end of \"%s\"",
+                     (uintmax_t)start, in->name);
+
+        strip_free(&lk.strip);
+        output_close(&lk.mem);
+        free(lk.line);
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,53 @@
+/*
+ * index.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef INDEX_H_
+#define INDEX_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "input.h"
+#include "output.h"
+#include "strip.h"
+
+/*
+ * --index: where lines of the output came from in the input.  A line
+ * starts with nothing held back by the state machine, so at the start of
+ * one, stripping from the input offset produces exactly what follows the
+ * output offset.  index_feed() is strip_feed() that records a checkpoint
+ * at the first line to start at least interval input bytes after the
+ * last one; with an interval of 0, that's every line.
+ *
+ * index_lookup() finds the input lines that make up output bytes
+ * [start, end] and copies them, escapes and all, to out.  It only has to
+ * strip from the checkpoint before start.
+ */
+#define INDEX_INTERVAL  (64 * 1024)
+
+struct index {
+        FILE *f;
+        const char *name;
+        uint64_t interval;
+        uint64_t in_off;
+        uint64_t next;
+        uint64_t last_in;
+        uint64_t last_out;
+};
+
+extern void index_open(struct index *ix, const char *path,
+                       uint64_t interval, const struct strip_config *config,
+                       uint64_t exprs_hash);
+extern void index_feed(struct index *ix, struct strip *s, const char *data,
+                       size_t len);
+extern void index_close(struct index *ix);
+
+extern void index_lookup(const char *path, const struct strip_config *config,
+                         uint64_t exprs_hash, struct input *in,
+                         struct output *out, uint64_t start, uint64_t end);
+
+#endif /* !INDEX_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,483 @@
+/*
+ * input.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "compress.h"
+#include "debug.h"
+#include "input.h"
+
+/*
+ * Without inotify, --follow checks a regular file for more data this
+ * often.
+ */
+#define INPUT_POLL_MS   1000
+
+static volatile sig_atomic_t interrupted;
+static sigset_t wait_mask;
+
+static bool
+input_map(struct input *in)
+{
+        struct stat sb;
+        off_t offset;
+        char *map;
+
+        if (fstat(in->fd, &sb) < 0 || !S_ISREG(sb.st_mode) || sb.st_size == 0)
+                return false;
+
+        /*
+         * stdin may already have been read from, so only hand back what's
+         * past the current offset.
+         */
+        offset = lseek(in->fd, 0, SEEK_CUR);
+        if (offset < 0 || offset >= sb.st_size)
+                return false;
+
+        map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+        if (map == MAP_FAILED) {
+                debug("mmap(\"%s\") failed: %m; falling back to read()", in->name);
+                return false;
+        }
+        madvise(map, sb.st_size, MADV_SEQUENTIAL);
+
+        in->buf = map;
+        in->size = sb.st_size;
+        in->start = offset;
+        in->mapped = true;
+        debug("mapped %zu bytes of \"%s\" at offset %jd", in->size, in->name,
+              (intmax_t)offset);
+        return true;
+}
+
+/*
+ * A mapped file can be checked up front.  If it's compressed, the map
+ * becomes raw, all of the compressed data at once, and buf is where it
+ * gets decompressed to.
+ */
+static void
+input_check_map(struct input *in)
+{
+        compress_type_t type;
+
+        in->checked = true;
+        type = compress_detect(in->buf + in->start, in->size - in->start);
+        if (type == COMPRESS_NONE)
+                return;
+
+        in->z = decompress_new(type, in->name);
+        in->raw = in->buf;
+        in->raw_size = in->size;
+        in->raw_mapped = true;
+        in->raw_next = in->buf + in->start;
+        in->raw_len = in->size - in->start;
+        in->raw_eof = true;
+
+        in->mapped = false;
+        in->buf = malloc(INPUT_BUFSZ);
+        if (!in->buf)
+                err(1, "Could not allocate memory");
+}
+
+/*
+ * Anything else gets checked at its first read, which is in buf; if it's
+ * compressed, that's the start of raw.  A short first read that could
+ * still be a magic number gets topped up first.
+ */
+static void
+input_check_read(struct input *in, ssize_t *len)
+{
+        compress_type_t type;
+
+        in->checked = true;
+        while (*len > 0 && compress_maybe(in->buf, *len)) {
+                ssize_t rc = read(in->fd, in->buf + *len, INPUT_BUFSZ - *len);
+
+                if (rc < 0) {
+                        if (errno == EAGAIN || errno == EINTR)
+                                continue;
+                        err(2, "Could not read from %s", in->name);
+                }
+                if (rc == 0)
+                        break;
+                *len += rc;
+        }
+
+        type = compress_detect(in->buf, *len);
+        if (type == COMPRESS_NONE)
+                return;
+
+        in->z = decompress_new(type, in->name);
+        in->raw = in->buf;
+        in->raw_next = in->buf;
+        in->raw_len = *len;
+        in->buf = malloc(INPUT_BUFSZ);
+        if (!in->buf)
+                err(1, "Could not allocate memory");
+}
+
+static ssize_t
+input_read_compressed(struct input *in)
+{
+        while (true) {
+                size_t n;
+
+                if (in->raw_len == 0 && !in->raw_eof) {
+                        ssize_t rc = read(in->fd, in->raw, INPUT_BUFSZ);
+
+                        if (rc < 0) {
+                                if (errno == EAGAIN || errno == EINTR)
+                                        continue;
+                                err(2, "Could not read from %s", in->name);
+                        }
+                        in->raw_next = in->raw;
+                        in->raw_len = rc;
+                        in->raw_eof = rc == 0;
+                }
+
+                n = decompress_run(in->z, &in->raw_next, &in->raw_len,
+                                   in->raw_eof, in->buf, INPUT_BUFSZ);
+                if (n > 0)
+                        return n;
+                if (in->raw_eof && in->raw_len == 0) {
+                        if (!decompress_done(in->z))
+                                errx(2, "%s: compressed data is truncated",
+                                     in->name);
+                        in->done = true;
+                        return 0;
+                }
+        }
+}
+
+void
+input_open(struct input *in, const char *filename)
+{
+        memset(in, 0, sizeof(*in));
+        in->inotify_fd = -1;
+
+        if (filename) {
+                in->name = filename;
+                in->fd = open(filename, O_RDONLY);
+                if (in->fd < 0)
+                        err(1, "Could not open \"%s\"", filename);
+        } else {
+                in->name = "stdin";
+                in->fd = STDIN_FILENO;
+        }
+
+        if (input_map(in)) {
+                input_check_map(in);
+                return;
+        }
+
+        in->buf = malloc(INPUT_BUFSZ);
+        if (!in->buf)
+                err(1, "Could not allocate memory");
+}
+
+void
+input_interrupt(void)
+{
+        interrupted = 1;
+}
+
+static void
+catch_signal(int sig UNUSED)
+{
+        input_interrupt();
+}
+
+/*
+ * SIGINT, SIGTERM and SIGHUP end a --follow the same way end of file
+ * would, so what's been read gets finished and flushed.  They're only
+ * let in while waiting, so one can't slip in between checking
+ * interrupted and going to sleep.
+ */
+static void
+catch_signals(void)
+{
+        struct sigaction sa;
+        sigset_t block;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = catch_signal;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGHUP, &sa, NULL);
+
+        sigemptyset(&block);
+        sigaddset(&block, SIGINT);
+        sigaddset(&block, SIGTERM);
+        sigaddset(&block, SIGHUP);
+        sigprocmask(SIG_BLOCK, &block, &wait_mask);
+}
+
+void
+input_follow(struct input *in, int timeout, input_idle_fn idle,
+             void *idle_data)
+{
+        struct stat sb;
+
+        if (in->z)
+                errx(1, "Can't follow %s, since it's compressed", in->name);
+        if (in->mapped) {
+                munmap(in->buf, in->size);
+                if (lseek(in->fd, in->start, SEEK_SET) < 0)
+                        err(2, "Could not seek in %s", in->name);
+                in->mapped = false;
+                in->buf = malloc(INPUT_BUFSZ);
+                if (!in->buf)
+                        err(1, "Could not allocate memory");
+        }
+
+        in->follow = true;
+        in->timeout = timeout;
+        in->idle = idle;
+        in->idle_data = idle_data;
+        in->regular = fstat(in->fd, &sb) == 0 && S_ISREG(sb.st_mode);
+        catch_signals();
+
+        if (!in->regular)
+                return;
+
+        in->offset = lseek(in->fd, 0, SEEK_CUR);
+        if (in->offset < 0)
+                in->offset = 0;
+
+        in->inotify_fd = inotify_init1(IN_CLOEXEC|IN_NONBLOCK);
+        if (in->inotify_fd >= 0) {
+                char path[sizeof("/proc/self/fd/") + 11];
+
+                /* this works for stdin too, which has no name */
+                snprintf(path, sizeof(path), "/proc/self/fd/%d", in->fd);
+                if (inotify_add_watch(in->inotify_fd, path,
+                                      IN_MODIFY|IN_ATTRIB) < 0) {
+                        close(in->inotify_fd);
+                        in->inotify_fd = -1;
+                }
+        }
+        if (in->inotify_fd < 0)
+                debug("can't watch \"%s\" (%m); polling every %dms",
+                      in->name, INPUT_POLL_MS);
+}
+
+/*
+ * Waits for fd to be readable, up to timeout milliseconds (-1 for as
+ * long as it takes).  A negative fd just sleeps.  Returns whether it's
+ * readable, or -1 if we were interrupted.
+ */
+static int
+wait_for(int fd, int timeout)
+{
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        struct timespec ts = { timeout / 1000, (timeout % 1000) * 1000000 };
+        int rc;
+
+        if (interrupted)
+                return -1;
+        rc = ppoll(&pfd, 1, timeout < 0 ? NULL : &ts, &wait_mask);
+        if (rc < 0) {
+                if (errno != EINTR)
+                        err(2, "Could not wait for %s", fd < 0 ? "input" : "data");
+                return interrupted ? -1 : 0;
+        }
+        return rc > 0;
+}
+
+static void
+drain_inotify(struct input *in)
+{
+        char events[4096];
+
+        while (read(in->inotify_fd, events, sizeof(events)) > 0)
+                ;
+}
+
+/*
+ * A regular file we're following got shorter; start again from the top,
+ * the way tail -f does.
+ */
+static bool
+check_truncated(struct input *in)
+{
+        struct stat sb;
+
+        if (fstat(in->fd, &sb) < 0 || sb.st_size >= in->offset)
+                return false;
+
+        debug("\"%s\" was truncated to %jd bytes; reading from the start",
+              in->name, (intmax_t)sb.st_size);
+        if (lseek(in->fd, 0, SEEK_SET) < 0)
+                err(2, "Could not seek in %s", in->name);
+        in->offset = 0;
+        return true;
+}
+
+static ssize_t
+input_read_follow(struct input *in)
+{
+        bool idle = false;
+
+        while (true) {
+                int timeout = idle ? -1 : in->timeout;
+                ssize_t rc;
+                int ready;
+
+                if (!in->regular) {
+                        ready = wait_for(in->fd, timeout);
+                        if (ready < 0)
+                                break;
+                        if (ready == 0) {
+                                if (!idle && in->idle)
+                                        in->idle(in->idle_data);
+                                idle = true;
+                                continue;
+                        }
+                }
+
+                rc = read(in->fd, in->buf, INPUT_BUFSZ);
+                if (rc > 0) {
+                        in->offset += rc;
+                        return rc;
+                }
+                if (rc < 0) {
+                        if (errno == EAGAIN || errno == EINTR)
+                                continue;
+                        err(2, "Could not read from %s", in->name);
+                }
+                if (!in->regular)
+                        break;
+
+                if (check_truncated(in))
+                        continue;
+                if (in->inotify_fd >= 0) {
+                        ready = wait_for(in->inotify_fd, timeout);
+                        if (ready > 0)
+                                drain_inotify(in);
+                } else {
+                        if (timeout < 0 || timeout > INPUT_POLL_MS)
+                                timeout = INPUT_POLL_MS;
+                        ready = wait_for(-1, timeout);
+                }
+                if (ready < 0)
+                        break;
+                if (ready == 0) {
+                        if (!idle && in->idle)
+                                in->idle(in->idle_data);
+                        idle = true;
+                }
+        }
+
+        in->done = true;
+        return 0;
+}
+
+/*
+ * Start at offset into a regular file rather than at the top, to pick up
+ * where a --state-file says the last run stopped.  That's the middle of
+ * a stream, so it doesn't get checked for a compression magic number.
+ */
+void
+input_skip(struct input *in, off_t offset)
+{
+        in->checked = true;
+        if (in->mapped) {
+                if ((size_t)offset > in->size)
+                        errx(1, "Could not seek past the end of %s", in->name);
+                in->start = offset;
+                return;
+        }
+        if (lseek(in->fd, offset, SEEK_SET) < 0)
+                err(2, "Could not seek in %s", in->name);
+}
+
+/*
+ * Returns the number of bytes available at *data, or 0 at end of input.
+ */
+ssize_t
+input_read(struct input *in, const char **data)
+{
+        ssize_t rc;
+
+        if (in->done)
+                return 0;
+
+        if (in->follow) {
+                *data = in->buf;
+                return input_read_follow(in);
+        }
+
+        if (in->mapped) {
+                in->done = true;
+                *data = in->buf + in->start;
+                return in->size - in->start;
+        }
+
+        if (in->z) {
+                *data = in->buf;
+                return input_read_compressed(in);
+        }
+
+        while (true) {
+                rc = read(in->fd, in->buf, INPUT_BUFSZ);
+                if (rc >= 0)
+                        break;
+                if (errno == EAGAIN || errno == EINTR) {
+                        debug("read() == %zd; trying again.", rc);
+                        continue;
+                }
+                err(2, "Could not read from %s", in->name);
+        }
+        if (!in->checked) {
+                input_check_read(in, &rc);
+                if (in->z) {
+                        *data = in->buf;
+                        return input_read_compressed(in);
+                }
+        }
+        if (rc == 0)
+                in->done = true;
+        *data = in->buf;
+        return rc;
+}
+
+void
+input_close(struct input *in)
+{
+        if (in->mapped)
+                munmap(in->buf, in->size);
+        else
+                free(in->buf);
+        if (in->raw_mapped)
+                munmap(in->raw, in->raw_size);
+        else
+                free(in->raw);
+        decompress_free(in->z);
+        if (in->fd != STDIN_FILENO)
+                close(in->fd);
+        if (in->inotify_fd >= 0)
+                close(in->inotify_fd);
+        memset(in, 0, sizeof(*in));
+        in->fd = -1;
+}
+
+// vim:fenc=utf-8:tw=75:et
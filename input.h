@@ -0,0 +1,69 @@
+/*
+ * input.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef INPUT_H_
+#define INPUT_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Block-buffered input.  Regular files are mapped whole and handed back
+ * as a single span; anything else (pipes, ttys, sockets) is read in
+ * INPUT_BUFSZ sized chunks.
+ *
+ * After input_follow(), everything is read in chunks, and end of file on
+ * a regular file means waiting (with inotify) for it to grow rather than
+ * the end of input.  If nothing arrives for timeout milliseconds, idle()
+ * gets called once, so whoever's holding output back can flush it.
+ * Input only ends at a real end of file on a pipe or tty, or after
+ * input_interrupt().
+ *
+ * Otherwise, input that starts with a gzip, xz or zstd magic number is
+ * decompressed into buf as it's read.  The compressed bytes come from
+ * the map, which stays in raw, or are read into raw.  Compressed input
+ * is never mapped as far as anyone else can tell.
+ */
+#define INPUT_BUFSZ     (256 * 1024)
+
+typedef void (*input_idle_fn)(void *data);
+
+struct input {
+        int fd;
+        const char *name;
+        char *buf;
+        size_t size;
+        size_t start;
+        bool mapped;
+        bool done;
+
+        bool follow;
+        bool regular;
+        int inotify_fd;
+        int timeout;
+        input_idle_fn idle;
+        void *idle_data;
+        off_t offset;
+
+        bool checked;
+        struct decompress *z;
+        char *raw;
+        size_t raw_size;
+        bool raw_mapped;
+        const char *raw_next;
+        size_t raw_len;
+        bool raw_eof;
+};
+
+extern void input_open(struct input *in, const char *filename);
+extern void input_follow(struct input *in, int timeout,
+                         input_idle_fn idle, void *idle_data);
+extern void input_skip(struct input *in, off_t offset);
+extern ssize_t input_read(struct input *in, const char **data);
+extern void input_close(struct input *in);
+extern void input_interrupt(void);
+
+#endif /* !INPUT_H_ */
+// vim:fenc=utf-8:tw=75:et
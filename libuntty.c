@@ -0,0 +1,210 @@
+/*
+ * libuntty.c - the streaming API in untty.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "error.h"
+#include "exprset.h"
+#include "output.h"
+#include "strip.h"
+#include "untty.h"
+
+bool debug_arg_ = false;
+
+/*
+ * Contexts are meant to be cheap enough to have one per stream, so they
+ * get a much smaller buffer than untty(1) uses for stdout.
+ */
+#define UNTTY_BUFSZ     (16 * 1024)
+
+struct untty {
+        struct strip_config config;
+        struct strip strip;
+        struct output out;
+};
+
+static __thread char error_buf[1024];
+
+static void
+vset_error(bool show_errno, const char *fmt, va_list ap)
+{
+        int errno_ = errno;
+        int rc;
+
+        rc = vsnprintf(error_buf, sizeof(error_buf), fmt, ap);
+        if (show_errno && rc >= 0 && (size_t)rc < sizeof(error_buf))
+                snprintf(error_buf + rc, sizeof(error_buf) - rc, ": %s",
+                         strerror(errno_));
+        errno = errno_;
+}
+
+void
+set_error(const char *fmt, ...)
+{
+        va_list ap;
+
+        va_start(ap, fmt);
+        vset_error(true, fmt, ap);
+        va_end(ap);
+}
+
+void
+set_errorx(const char *fmt, ...)
+{
+        va_list ap;
+
+        va_start(ap, fmt);
+        vset_error(false, fmt, ap);
+        va_end(ap);
+}
+
+PUBLIC void
+untty_set_debug(int on)
+{
+        debug_arg_ = on;
+}
+
+PUBLIC const char *
+untty_error(void)
+{
+        return error_buf;
+}
+
+PUBLIC struct untty *
+untty_new(const struct untty_exprs *exprs, unsigned int flags,
+          untty_write_fn write, void *data)
+{
+        struct untty *ctx;
+
+        if (flags & ~(UNTTY_SPACE_AS_ESCAPE|UNTTY_BUILTIN_PARSER|
+                      UNTTY_RENDER|UNTTY_UTF8)) {
+                errno = EINVAL;
+                set_errorx("Invalid flags 0x%x", flags);
+                return NULL;
+        }
+        if (flags & UNTTY_RENDER) {
+                if (flags & UNTTY_SPACE_AS_ESCAPE) {
+                        errno = EINVAL;
+                        set_errorx("UNTTY_RENDER can't be used with UNTTY_SPACE_AS_ESCAPE");
+                        return NULL;
+                }
+        } else if (flags & UNTTY_BUILTIN_PARSER) {
+                if (flags & UNTTY_SPACE_AS_ESCAPE) {
+                        errno = EINVAL;
+                        set_errorx("UNTTY_BUILTIN_PARSER can't be used with UNTTY_SPACE_AS_ESCAPE");
+                        return NULL;
+                }
+        } else if (!exprs) {
+                errno = EINVAL;
+                set_errorx("No escape expressions");
+                return NULL;
+        }
+
+        ctx = calloc(1, sizeof(*ctx));
+        if (!ctx) {
+                set_error("Could not allocate memory");
+                return NULL;
+        }
+
+        ctx->config.matcher = exprs ? &exprs->matcher : NULL;
+        ctx->config.escape = (flags & UNTTY_SPACE_AS_ESCAPE) ? SPC : ESC;
+        ctx->config.builtin = flags & UNTTY_BUILTIN_PARSER;
+        ctx->config.render = flags & UNTTY_RENDER;
+        ctx->config.utf8 = flags & UNTTY_UTF8;
+
+        if ((write ? output_open_cb(&ctx->out, write, data, UNTTY_BUFSZ)
+                   : output_open_mem(&ctx->out, UNTTY_BUFSZ)) < 0) {
+                free(ctx);
+                return NULL;
+        }
+        strip_init(&ctx->strip, &ctx->config, &ctx->out);
+
+        return ctx;
+}
+
+/*
+ * A failed strip context already said why with set_error(), and stays
+ * failed until untty_finish().
+ */
+static int
+check_output(struct untty *ctx)
+{
+        if (ctx->strip.error) {
+                errno = ctx->strip.error;
+                return -1;
+        }
+        if (ctx->out.error) {
+                errno = ctx->out.error;
+                set_error("Could not write output");
+                return -1;
+        }
+        return 0;
+}
+
+PUBLIC int
+untty_feed(struct untty *ctx, const void *buf, size_t len)
+{
+        if (check_output(ctx) < 0)
+                return -1;
+        strip_feed(&ctx->strip, buf, len);
+        return check_output(ctx);
+}
+
+PUBLIC int
+untty_flush(struct untty *ctx)
+{
+        if (ctx->out.write_fn)
+                output_flush(&ctx->out);
+        return check_output(ctx);
+}
+
+PUBLIC int
+untty_finish(struct untty *ctx)
+{
+        int rc;
+
+        strip_finish(&ctx->strip);
+        if (ctx->out.write_fn)
+                output_flush(&ctx->out);
+        rc = check_output(ctx);
+
+        ctx->out.error = 0;
+        strip_init(&ctx->strip, &ctx->config, &ctx->out);
+        return rc;
+}
+
+PUBLIC size_t
+untty_take_output(struct untty *ctx, const char **buf)
+{
+        size_t len = ctx->out.len;
+
+        if (ctx->out.write_fn) {
+                *buf = NULL;
+                return 0;
+        }
+        *buf = ctx->out.buf;
+        ctx->out.len = 0;
+        return len;
+}
+
+PUBLIC void
+untty_free(struct untty *ctx)
+{
+        if (!ctx)
+                return;
+        /* anything not finished with untty_finish() is dropped */
+        ctx->out.len = 0;
+        output_close(&ctx->out);
+        strip_free(&ctx->strip);
+        free(ctx);
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,61 @@
+/*
+ * mkexprcache.c - build the cache of the default escape_exprs
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This runs on the build host, before exprs.S (which embeds its output)
+ * exists, so it has its own stand-ins for the symbols that provides.
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "exprset.h"
+#include "untty.h"
+
+const char *default_exprs = "";
+const uint64_t default_exprs_size = 1;
+const char *default_exprs_cache = NULL;
+const uint64_t default_exprs_cache_size = 0;
+
+int
+main(int argc, char *argv[])
+{
+        struct untty_exprs *exprs;
+        char *text;
+        size_t size;
+        int fd;
+
+        if (argc != 3) {
+                fprintf(stderr, "Usage: mkexprcache <escape_exprs> <cache>\n");
+                exit(1);
+        }
+
+        fd = open(argv[1], O_RDONLY);
+        if (fd < 0)
+                err(1, "Could not open \"%s\"", argv[1]);
+        text = exprs_read_file(fd, argv[1], &size);
+        if (!text)
+                errx(1, "%s", untty_error());
+        close(fd);
+
+        /*
+         * Made from the text alone, so it's matched against what's built
+         * in by hash, and not against a file that won't be there.
+         */
+        exprs = untty_exprs_new(text, size - 1);
+        if (!exprs)
+                errx(1, "%s", untty_error());
+        if (untty_exprs_save(exprs, argv[2]) < 0)
+                errx(1, "%s", untty_error());
+
+        untty_exprs_free(exprs);
+        free(text);
+        return 0;
+}
+
+// vim:fenc=utf-8:tw=75:et
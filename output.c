@@ -0,0 +1,257 @@
+/*
+ * output.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "debug.h"
+#include "error.h"
+#include "output.h"
+#include "stats.h"
+
+int
+output_open(struct output *out, int fd, const char *name, bool line_buffered)
+{
+        memset(out, 0, sizeof(*out));
+        out->fd = fd;
+        out->src_fd = -1;
+        out->name = name;
+        out->size = OUTPUT_BUFSZ;
+        out->line_buffered = line_buffered || isatty(fd);
+        out->buf = malloc(out->size);
+        if (!out->buf) {
+                set_error("Could not allocate memory");
+                return -1;
+        }
+        return 0;
+}
+
+int
+output_open_mem(struct output *out, size_t size)
+{
+        memset(out, 0, sizeof(*out));
+        out->fd = -1;
+        out->src_fd = -1;
+        out->name = "memory";
+        out->size = size ? size : OUTPUT_BUFSZ;
+        out->buf = malloc(out->size);
+        if (!out->buf) {
+                set_error("Could not allocate memory");
+                return -1;
+        }
+        return 0;
+}
+
+int
+output_open_cb(struct output *out, output_write_fn write_fn,
+               void *write_data, size_t size)
+{
+        if (output_open_mem(out, size) < 0)
+                return -1;
+        out->name = "callback";
+        out->write_fn = write_fn;
+        out->write_data = write_data;
+        return 0;
+}
+
+static inline bool
+output_is_mem(struct output *out)
+{
+        return out->fd < 0 && !out->write_fn;
+}
+
+/*
+ * If there's no more memory, buf stays as it was and error is set.
+ */
+static void
+output_grow(struct output *out, size_t need)
+{
+        size_t size = out->size * 2;
+        char *buf;
+
+        if (size < out->len + need)
+                size = out->len + need;
+        buf = realloc(out->buf, size);
+        if (!buf) {
+                out->error = errno;
+                return;
+        }
+        out->buf = buf;
+        out->size = size;
+}
+
+static void
+output_do_writev(struct output *out, struct iovec *iov, int iovcnt)
+{
+        if (out->write_fn) {
+                for (int i = 0; i < iovcnt && !out->error; i++) {
+                        if (iov[i].iov_len == 0)
+                                continue;
+                        errno = 0;
+                        if (out->write_fn(out->write_data, iov[i].iov_base,
+                                          iov[i].iov_len) < 0)
+                                out->error = errno ? errno : EIO;
+                }
+                return;
+        }
+
+        while (iovcnt > 0) {
+                ssize_t rc = writev(out->fd, iov, iovcnt);
+
+                if (rc < 0) {
+                        if (errno == EAGAIN || errno == EINTR)
+                                continue;
+                        debug("Could not write to %s: %m", out->name);
+                        out->error = errno;
+                        return;
+                }
+
+                while (iovcnt > 0 && (size_t)rc >= iov->iov_len) {
+                        rc -= iov->iov_len;
+                        iov++;
+                        iovcnt--;
+                }
+                if (iovcnt > 0) {
+                        iov->iov_base = (char *)iov->iov_base + rc;
+                        iov->iov_len -= rc;
+                }
+        }
+}
+
+static void
+output_writev(struct output *out, struct iovec *iov, int iovcnt)
+{
+        uint64_t start;
+
+        if (out->error)
+                return;
+        start = out->timed ? stats_clock() : 0;
+        for (int i = 0; i < iovcnt; i++)
+                out->written += iov[i].iov_len;
+        output_do_writev(out, iov, iovcnt);
+        if (out->timed)
+                out->write_ns += stats_clock() - start;
+}
+
+void
+output_flush(struct output *out)
+{
+        struct iovec iov = { out->buf, out->len };
+
+        if (output_is_mem(out)) {
+                /* nowhere to flush to, so make room instead */
+                if (out->len == out->size)
+                        output_grow(out, 1);
+                /* or if there's none, it's lost anyway */
+                if (out->len == out->size)
+                        out->len = 0;
+                return;
+        }
+        if (out->len == 0)
+                return;
+        output_writev(out, &iov, 1);
+        out->len = 0;
+}
+
+void
+output_set_source(struct output *out, int fd, const char *base, size_t size)
+{
+        out->src_fd = fd;
+        out->src_base = base;
+        out->src_size = size;
+}
+
+/*
+ * Send a span of the source map with copy_file_range(), so its blocks
+ * never come through us, and get shared instead of copied where the
+ * filesystem can do that.  If it won't work for this pair of files once,
+ * it won't work at all, so the rest goes through writev().
+ */
+static bool
+output_copy(struct output *out, const char *data, size_t len)
+{
+        uint64_t start;
+        loff_t off;
+
+        if (out->src_fd < 0 || len < OUTPUT_COPY_MIN ||
+            data < out->src_base || len > out->src_size ||
+            (size_t)(data - out->src_base) > out->src_size - len)
+                return false;
+
+        output_flush(out);
+        off = data - out->src_base;
+        start = out->timed ? stats_clock() : 0;
+        while (len) {
+                ssize_t rc = copy_file_range(out->src_fd, &off, out->fd, NULL,
+                                             len, 0);
+
+                if (rc < 0 && errno == EINTR)
+                        continue;
+                if (rc <= 0) {
+                        debug("copy_file_range() to %s failed: %m; using writev()",
+                              out->name);
+                        out->src_fd = -1;
+                        break;
+                }
+                data += rc;
+                len -= rc;
+                out->written += rc;
+        }
+        if (out->timed)
+                out->write_ns += stats_clock() - start;
+        if (len) {
+                struct iovec iov = { (void *)data, len };
+
+                output_writev(out, &iov, 1);
+        }
+        return true;
+}
+
+void
+output_write(struct output *out, const void *data, size_t len)
+{
+        if (output_is_mem(out) && len > out->size - out->len)
+                output_grow(out, len);
+        if (out->error)
+                return;
+
+        if (output_copy(out, data, len))
+                return;
+
+        if (len <= out->size - out->len) {
+                memcpy(out->buf + out->len, data, len);
+                out->len += len;
+        } else {
+                struct iovec iov[2] = {
+                        { out->buf, out->len },
+                        { (void *)data, len },
+                };
+
+                output_writev(out, iov, 2);
+                out->len = 0;
+        }
+
+        if (out->line_buffered && memchr(data, '\n', len))
+                output_flush(out);
+}
+
+void
+output_close(struct output *out)
+{
+        if (!output_is_mem(out))
+                output_flush(out);
+        free(out->buf);
+        out->buf = NULL;
+        out->len = out->size = 0;
+}
+
+// vim:fenc=utf-8:tw=75:et
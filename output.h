@@ -0,0 +1,106 @@
+/*
+ * output.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Buffered output straight to a file descriptor.  Small writes are
+ * collected in buf; anything that doesn't fit goes out with a single
+ * writev() of what's buffered plus the new data, so long spans from the
+ * input map never get copied.  Nothing is flushed until the buffer
+ * fills, at output_close(), or at every NL when line_buffered is set.
+ *
+ * An output opened with output_open_mem() has no fd; it just keeps
+ * growing buf, and whoever opened it takes buf/len when it's done.
+ *
+ * One opened with output_open_cb() hands each flush to write_fn instead
+ * of an fd.
+ *
+ * If a write fails, or a memory output can't grow, the errno is kept in
+ * error and later output is dropped; it's up to whoever opened the
+ * output to check.  The output_open*() functions return 0, or -1 with
+ * errno set if the buffer can't be allocated.
+ *
+ * With output_set_source(), fd is a regular file, and base is a map of
+ * the regular file src_fd; spans of at least OUTPUT_COPY_MIN bytes from
+ * the map are copied from src_fd with copy_file_range() instead of being
+ * written.
+ */
+#define OUTPUT_BUFSZ    (256 * 1024)
+#define OUTPUT_COPY_MIN (64 * 1024)
+
+typedef int (*output_write_fn)(void *data, const char *buf, size_t len);
+
+struct output {
+        int fd;
+        const char *name;
+        char *buf;
+        size_t len;
+        size_t size;
+        bool line_buffered;
+
+        output_write_fn write_fn;
+        void *write_data;
+        int error;
+
+        int src_fd;
+        const char *src_base;
+        size_t src_size;
+
+        /* for --stats and --profile; write_ns only counts if timed */
+        uint64_t written;
+        bool timed;
+        uint64_t write_ns;
+};
+
+extern int output_open(struct output *out, int fd, const char *name,
+                       bool line_buffered);
+extern int output_open_mem(struct output *out, size_t size);
+extern int output_open_cb(struct output *out, output_write_fn write_fn,
+                          void *write_data, size_t size);
+extern void output_set_source(struct output *out, int fd, const char *base,
+                              size_t size);
+extern void output_write(struct output *out, const void *data, size_t len);
+extern void output_flush(struct output *out);
+extern void output_close(struct output *out);
+
+static inline void
+output_putc(struct output *out, char c)
+{
+        if (out->len == out->size)
+                output_flush(out);
+        out->buf[out->len++] = c;
+        if (c == '\n' && out->line_buffered)
+                output_flush(out);
+}
+
+/*
+ * How much has gone to out so far, written or still buffered.
+ */
+static inline uint64_t
+output_offset(const struct output *out)
+{
+        return out->written + out->len;
+}
+
+/*
+ * Write c as "\xNN", the way print_buf() shows bytes it won't print.
+ */
+static inline void
+output_hex(struct output *out, unsigned char c)
+{
+        static const char hex[] = "0123456789abcdef";
+        char s[4] = { '\\', 'x', hex[c >> 4], hex[c & 0xf] };
+
+        output_write(out, s, sizeof(s));
+}
+
+#endif /* !OUTPUT_H_ */
+// vim:fenc=utf-8:tw=75:et
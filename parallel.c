@@ -0,0 +1,183 @@
+/*
+ * parallel.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "debug.h"
+#include "parallel.h"
+#include "untty.h"
+
+/*
+ * The state machine is back in NEED_ESCAPE with nothing buffered after
+ * every NL, so a mapped file can be cut into chunks just after a NL and
+ * each one stripped on its own.  Workers take chunks in order; the
+ * calling thread writes their output in the same order, and workers
+ * don't get more than window chunks ahead of it.
+ */
+struct chunk {
+        const char *data;
+        size_t len;
+        struct output out;
+        bool done;
+};
+
+struct pool {
+        const struct strip_config *config;
+        struct chunk *chunks;
+        size_t n_chunks;
+        size_t next;
+        size_t written;
+        size_t window;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+};
+
+static size_t
+split_chunks(struct chunk **chunksp, const char *data, size_t len)
+{
+        size_t n_chunks = 0, alloc = len / PARALLEL_CHUNK + 1;
+        struct chunk *chunks;
+        size_t start = 0;
+
+        chunks = calloc(alloc, sizeof(*chunks));
+        if (!chunks)
+                err(1, "Could not allocate memory");
+
+        while (start < len) {
+                size_t end = start + PARALLEL_CHUNK;
+                const char *nl;
+
+                if (end >= len) {
+                        end = len;
+                } else {
+                        nl = memchr(data + end, NL, len - end);
+                        end = nl ? (size_t)(nl - data) + 1 : len;
+                }
+
+                if (n_chunks == alloc) {
+                        alloc *= 2;
+                        chunks = reallocarray(chunks, alloc, sizeof(*chunks));
+                        if (!chunks)
+                                err(1, "Could not allocate memory");
+                }
+                memset(&chunks[n_chunks], 0, sizeof(*chunks));
+                chunks[n_chunks].data = data + start;
+                chunks[n_chunks].len = end - start;
+                n_chunks++;
+                start = end;
+        }
+
+        *chunksp = chunks;
+        return n_chunks;
+}
+
+static void *
+worker(void *arg)
+{
+        struct pool *pool = arg;
+
+        pthread_mutex_lock(&pool->lock);
+        while (true) {
+                struct strip strip;
+                struct chunk *chunk;
+                size_t i;
+
+                while (pool->next < pool->n_chunks &&
+                       pool->next >= pool->written + pool->window)
+                        pthread_cond_wait(&pool->cond, &pool->lock);
+                if (pool->next >= pool->n_chunks)
+                        break;
+                i = pool->next++;
+                pthread_mutex_unlock(&pool->lock);
+
+                chunk = &pool->chunks[i];
+                if (output_open_mem(&chunk->out,
+                                    chunk->len + chunk->len / 8) < 0)
+                        err(1, "Could not allocate memory");
+                strip_init(&strip, pool->config, &chunk->out);
+                strip_feed(&strip, chunk->data, chunk->len);
+                if (i == pool->n_chunks - 1)
+                        strip_finish(&strip);
+                else
+                        strip_free(&strip);
+                if (strip.error)
+                        errx(3, "%s", untty_error());
+                if (chunk->out.error) {
+                        errno = chunk->out.error;
+                        err(1, "Could not allocate memory");
+                }
+
+                pthread_mutex_lock(&pool->lock);
+                chunk->done = true;
+                pthread_cond_broadcast(&pool->cond);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        return NULL;
+}
+
+void
+strip_parallel(const struct strip_config *config, const char *data,
+               size_t len, struct output *out, unsigned int jobs)
+{
+        struct pool pool;
+        pthread_t *threads;
+        unsigned int n_threads;
+
+        memset(&pool, 0, sizeof(pool));
+        pool.config = config;
+        pool.n_chunks = split_chunks(&pool.chunks, data, len);
+        pool.window = jobs * 2;
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.cond, NULL);
+
+        n_threads = jobs < pool.n_chunks ? jobs : pool.n_chunks;
+        debug("%zu bytes in %zu chunks on %u threads", len, pool.n_chunks,
+              n_threads);
+
+        threads = calloc(n_threads, sizeof(*threads));
+        if (!threads)
+                err(1, "Could not allocate memory");
+        for (unsigned int i = 0; i < n_threads; i++) {
+                errno = pthread_create(&threads[i], NULL, worker, &pool);
+                if (errno)
+                        err(1, "Could not create thread");
+        }
+
+        for (size_t i = 0; i < pool.n_chunks; i++) {
+                struct chunk *chunk = &pool.chunks[i];
+
+                pthread_mutex_lock(&pool.lock);
+                while (!chunk->done)
+                        pthread_cond_wait(&pool.cond, &pool.lock);
+                pthread_mutex_unlock(&pool.lock);
+
+                output_write(out, chunk->out.buf, chunk->out.len);
+                output_close(&chunk->out);
+
+                pthread_mutex_lock(&pool.lock);
+                pool.written++;
+                pthread_cond_broadcast(&pool.cond);
+                pthread_mutex_unlock(&pool.lock);
+        }
+
+        for (unsigned int i = 0; i < n_threads; i++)
+                pthread_join(threads[i], NULL);
+
+        pthread_cond_destroy(&pool.cond);
+        pthread_mutex_destroy(&pool.lock);
+        free(threads);
+        free(pool.chunks);
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,25 @@
+/*
+ * parallel.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <stddef.h>
+
+#include "output.h"
+#include "strip.h"
+
+/*
+ * Inputs smaller than this many chunks aren't worth starting threads for.
+ */
+#define PARALLEL_CHUNK          (8 * 1024 * 1024)
+#define PARALLEL_MIN_CHUNKS     2
+
+extern void strip_parallel(const struct strip_config *config,
+                           const char *data, size_t len,
+                           struct output *out, unsigned int jobs);
+
+#endif /* !PARALLEL_H_ */
+// vim:fenc=utf-8:tw=75:et
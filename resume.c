@@ -0,0 +1,189 @@
+/*
+ * resume.c - untty --state-file
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "debug.h"
+#include "exprset.h"
+#include "resume.h"
+
+/*
+ * A state file is this header, in the byte order of whoever wrote it,
+ * and then strip.line_len bytes of --render's line.  It's written to a
+ * temporary file and renamed into place, so it's never half there.
+ */
+#define RESUME_MAGIC            "UNTTYRES"
+#define RESUME_VERSION          1
+#define RESUME_BYTE_ORDER       0x01020304
+
+struct resume_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint32_t options;               /* UNTTY_* flags */
+        uint32_t reserved;
+        uint64_t exprs_hash;
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t in_off;
+        uint64_t tail_hash;             /* of RESUME_TAIL bytes before in_off */
+        uint64_t out_size;
+        struct strip_saved strip;
+};
+
+static bool
+tail_hash(int fd, uint64_t off, uint64_t *hash)
+{
+        char buf[RESUME_TAIL];
+        size_t n = off < RESUME_TAIL ? off : RESUME_TAIL;
+
+        if (pread(fd, buf, n, off - n) != (ssize_t)n)
+                return false;
+        *hash = exprs_hash(buf, n);
+        return true;
+}
+
+static bool
+read_all(int fd, void *buf, size_t size)
+{
+        return read(fd, buf, size) == (ssize_t)size;
+}
+
+void
+resume_load(struct resume *r, const char *path,
+            const struct strip_config *config, uint64_t exprs_hash,
+            const struct input *in, int out_fd)
+{
+        struct resume_header hdr;
+        struct stat in_sb, out_sb;
+        uint64_t hash;
+        int fd;
+
+        memset(r, 0, sizeof(*r));
+        r->path = path;
+
+        fd = open(path, O_RDONLY|O_CLOEXEC);
+        if (fd < 0) {
+                if (errno != ENOENT)
+                        err(1, "Could not open \"%s\"", path);
+                debug("no \"%s\"; starting from the top", path);
+                return;
+        }
+        if (!read_all(fd, &hdr, sizeof(hdr)) ||
+            memcmp(hdr.magic, RESUME_MAGIC, sizeof(hdr.magic)) ||
+            hdr.version != RESUME_VERSION ||
+            hdr.byte_order != RESUME_BYTE_ORDER ||
+            !strip_saved_ok(&hdr.strip)) {
+                warnx("\"%s\" is not an untty state file; starting from the top",
+                      path);
+                goto out;
+        }
+        if (hdr.strip.line_len) {
+                r->line = malloc(hdr.strip.line_len);
+                if (!r->line)
+                        err(1, "Could not allocate memory");
+                if (!read_all(fd, r->line, hdr.strip.line_len)) {
+                        warnx("\"%s\" is truncated; starting from the top",
+                              path);
+                        goto out;
+                }
+        }
+
+        if (fstat(in->fd, &in_sb) < 0 || fstat(out_fd, &out_sb) < 0)
+                err(1, "Could not stat input or output");
+        if (hdr.options != strip_options(config) ||
+            hdr.exprs_hash != exprs_hash) {
+                debug("\"%s\" was stripped differently; starting from the top",
+                      in->name);
+                goto out;
+        }
+        if (hdr.dev != (uint64_t)in_sb.st_dev ||
+            hdr.ino != (uint64_t)in_sb.st_ino ||
+            hdr.in_off > (uint64_t)in_sb.st_size ||
+            !tail_hash(in->fd, hdr.in_off, &hash) || hash != hdr.tail_hash) {
+                debug("\"%s\" isn't the file we stopped in; starting from the top",
+                      in->name);
+                goto out;
+        }
+        if (hdr.out_size != (uint64_t)out_sb.st_size) {
+                debug("output is %jd bytes, not %ju; starting from the top",
+                      (intmax_t)out_sb.st_size, (uintmax_t)hdr.out_size);
+                goto out;
+        }
+
+        debug("resuming \"%s\" at %ju", in->name, (uintmax_t)hdr.in_off);
+        r->ok = true;
+        r->in_off = hdr.in_off;
+        r->saved = hdr.strip;
+out:
+        close(fd);
+        if (!r->ok) {
+                free(r->line);
+                r->line = NULL;
+        }
+}
+
+void
+resume_restore(struct resume *r, struct strip *s)
+{
+        if (strip_restore(s, &r->saved, r->line) < 0)
+                err(1, "Could not allocate memory");
+        free(r->line);
+        r->line = NULL;
+}
+
+void
+resume_save(const char *path, const struct strip_config *config,
+            uint64_t exprs_hash, const struct input *in, uint64_t in_off,
+            int out_fd, const struct strip *s)
+{
+        struct resume_header hdr;
+        struct stat in_sb, out_sb;
+        char *tmp;
+        FILE *f;
+
+        if (fstat(in->fd, &in_sb) < 0 || fstat(out_fd, &out_sb) < 0)
+                err(1, "Could not stat input or output");
+
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, RESUME_MAGIC, sizeof(hdr.magic));
+        hdr.version = RESUME_VERSION;
+        hdr.byte_order = RESUME_BYTE_ORDER;
+        hdr.options = strip_options(config);
+        hdr.exprs_hash = exprs_hash;
+        hdr.dev = in_sb.st_dev;
+        hdr.ino = in_sb.st_ino;
+        hdr.in_off = in_off;
+        if (!tail_hash(in->fd, in_off, &hdr.tail_hash))
+                err(2, "Could not read from %s", in->name);
+        hdr.out_size = out_sb.st_size;
+        strip_save(s, &hdr.strip);
+
+        if (asprintf(&tmp, "%s.tmp", path) < 0)
+                err(1, "Could not allocate memory");
+        f = fopen(tmp, "we");
+        if (!f)
+                err(1, "Could not open \"%s\"", tmp);
+        if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+            (s->line_len && fwrite(s->line, s->line_len, 1, f) != 1) ||
+            fclose(f) == EOF)
+                err(1, "Could not write \"%s\"", tmp);
+        if (rename(tmp, path) < 0)
+                err(1, "Could not rename \"%s\" to \"%s\"", tmp, path);
+        free(tmp);
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,47 @@
+/*
+ * resume.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef RESUME_H_
+#define RESUME_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "input.h"
+#include "strip.h"
+
+/*
+ * --state-file: how far into its input the last run got, and what its
+ * strip context was in the middle of, so a log that's only ever appended
+ * to can be stripped a piece at a time onto the end of the same output.
+ *
+ * resume_load() decides whether that's possible: the input has to be the
+ * same file (device, inode, and a hash of the RESUME_TAIL bytes before
+ * where we stopped), at least as long as it was, stripped the same way,
+ * and the output has to be exactly as long as we left it.  If so, ok is
+ * set, and resume_restore() puts the strip context back; otherwise the
+ * whole input gets stripped again into an emptied output.
+ */
+#define RESUME_TAIL     4096
+
+struct resume {
+        const char *path;
+        bool ok;
+        uint64_t in_off;
+        struct strip_saved saved;
+        char *line;
+};
+
+extern void resume_load(struct resume *r, const char *path,
+                        const struct strip_config *config,
+                        uint64_t exprs_hash, const struct input *in,
+                        int out_fd);
+extern void resume_restore(struct resume *r, struct strip *s);
+extern void resume_save(const char *path, const struct strip_config *config,
+                        uint64_t exprs_hash, const struct input *in,
+                        uint64_t in_off, int out_fd, const struct strip *s);
+
+#endif /* !RESUME_H_ */
+// vim:fenc=utf-8:tw=75:et
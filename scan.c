@@ -0,0 +1,162 @@
+/*
+ * scan.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define HAVE_SSE2
+#endif
+
+#include "compiler.h"
+#include "scan.h"
+
+static size_t
+scan_until2_scalar(const char *data, size_t len, char a, char b)
+{
+        size_t i;
+
+        for (i = 0; i < len; i++)
+                if (data[i] == a || data[i] == b)
+                        break;
+        return i;
+}
+
+#ifdef HAVE_SSE2
+static size_t
+scan_until2_sse2(const char *data, size_t len, char a, char b)
+{
+        const __m128i va = _mm_set1_epi8(a);
+        const __m128i vb = _mm_set1_epi8(b);
+        size_t i = 0;
+
+        for (; i + 16 <= len; i += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+                __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, va),
+                                           _mm_cmpeq_epi8(v, vb));
+                unsigned int mask = _mm_movemask_epi8(hit);
+
+                if (mask)
+                        return i + __builtin_ctz(mask);
+        }
+        return i + scan_until2_scalar(data + i, len - i, a, b);
+}
+
+static size_t __attribute__((__target__("avx2")))
+scan_until2_avx2(const char *data, size_t len, char a, char b)
+{
+        const __m256i va = _mm256_set1_epi8(a);
+        const __m256i vb = _mm256_set1_epi8(b);
+        size_t i = 0;
+
+        for (; i + 64 <= len; i += 64) {
+                __m256i v0 = _mm256_loadu_si256((const __m256i *)(data + i));
+                __m256i v1 = _mm256_loadu_si256((const __m256i *)(data + i + 32));
+                __m256i h0 = _mm256_or_si256(_mm256_cmpeq_epi8(v0, va),
+                                             _mm256_cmpeq_epi8(v0, vb));
+                __m256i h1 = _mm256_or_si256(_mm256_cmpeq_epi8(v1, va),
+                                             _mm256_cmpeq_epi8(v1, vb));
+                uint64_t mask = (uint32_t)_mm256_movemask_epi8(h0) |
+                                (uint64_t)(uint32_t)_mm256_movemask_epi8(h1) << 32;
+
+                if (mask)
+                        return i + __builtin_ctzll(mask);
+        }
+        for (; i + 32 <= len; i += 32) {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+                __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+                                              _mm256_cmpeq_epi8(v, vb));
+                uint32_t mask = _mm256_movemask_epi8(hit);
+
+                if (mask)
+                        return i + __builtin_ctz(mask);
+        }
+        return i + scan_until2_sse2(data + i, len - i, a, b);
+}
+#endif
+
+static inline bool
+is_text(unsigned char c)
+{
+        return (c >= 0x20 && c < 0x7f) || c == '\t' || c == '\n';
+}
+
+static size_t
+scan_text_scalar(const char *data, size_t len)
+{
+        size_t i;
+
+        for (i = 0; i < len; i++)
+                if (!is_text(data[i]))
+                        break;
+        return i;
+}
+
+#ifdef HAVE_SSE2
+/*
+ * Compared as signed, everything from 0x80 up is below SPC too, so one
+ * compare finds C0 and non-ASCII both.  There's no AVX2 version: in
+ * anything but plain ASCII the runs between stops are short, and 32 byte
+ * vectors only made those slower.
+ */
+static size_t
+scan_text_sse2(const char *data, size_t len)
+{
+        const __m128i spc = _mm_set1_epi8(0x20);
+        const __m128i del = _mm_set1_epi8(0x7f);
+        const __m128i tab = _mm_set1_epi8('\t');
+        const __m128i nl = _mm_set1_epi8('\n');
+        size_t i = 0;
+
+        for (; i + 16 <= len; i += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+                __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, spc),
+                                           _mm_cmpeq_epi8(v, del));
+                __m128i ok = _mm_or_si128(_mm_cmpeq_epi8(v, tab),
+                                          _mm_cmpeq_epi8(v, nl));
+                unsigned int mask = _mm_movemask_epi8(_mm_andnot_si128(ok, bad));
+
+                if (mask)
+                        return i + __builtin_ctz(mask);
+        }
+        return i + scan_text_scalar(data + i, len - i);
+}
+#endif
+
+static size_t (*scan_until2_impl)(const char *, size_t, char, char) =
+        scan_until2_scalar;
+
+static void __attribute__((__constructor__))
+scan_init(void)
+{
+#ifdef HAVE_SSE2
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+                scan_until2_impl = scan_until2_avx2;
+        else
+                scan_until2_impl = scan_until2_sse2;
+#endif
+}
+
+size_t
+scan_until2(const char *data, size_t len, char a, char b)
+{
+        return scan_until2_impl(data, len, a, b);
+}
+
+size_t
+scan_text(const char *data, size_t len)
+{
+#ifdef HAVE_SSE2
+        return scan_text_sse2(data, len);
+#else
+        return scan_text_scalar(data, len);
+#endif
+}
+
+// vim:fenc=utf-8:tw=75:et
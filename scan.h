@@ -0,0 +1,25 @@
+/*
+ * scan.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include <stddef.h>
+
+/*
+ * Returns the offset of the first byte in data[0..len) that is either a
+ * or b, or len if there isn't one.
+ */
+extern size_t scan_until2(const char *data, size_t len, char a, char b);
+
+/*
+ * Returns the offset of the first byte in data[0..len) that isn't
+ * printable ASCII, TAB or NL, or len if there isn't one.  This is the
+ * --utf8 fast path: everything it skips can be copied as it is.
+ */
+extern size_t scan_text(const char *data, size_t len);
+
+#endif /* !SCAN_H_ */
+// vim:fenc=utf-8:tw=75:et
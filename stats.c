@@ -0,0 +1,163 @@
+/*
+ * stats.c - untty --stats and --profile
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "stats.h"
+
+void
+stats_init(struct strip_stats *st, size_t n_exprs, bool profile)
+{
+        memset(st, 0, sizeof(*st));
+        st->profile = profile;
+        st->n_exprs = n_exprs;
+        st->matched = calloc(n_exprs ? n_exprs : 1, sizeof(*st->matched));
+        if (!st->matched)
+                err(1, "Could not allocate memory");
+}
+
+void
+stats_free(struct strip_stats *st)
+{
+        free(st->matched);
+        st->matched = NULL;
+}
+
+/*
+ * Expressions are regexps full of backslashes, and some of them have
+ * control characters in them.
+ */
+static void
+print_string(FILE *f, const char *s, bool json)
+{
+        fputc('"', f);
+        for (; *s; s++) {
+                unsigned char c = *s;
+
+                if (c == '"' || (json && c == '\\'))
+                        fprintf(f, "\\%c", c);
+                else if (isprint(c))
+                        fputc(c, f);
+                else if (json)
+                        fprintf(f, "\\u%04x", c);
+                else
+                        fprintf(f, "\\x%02hhx", c);
+        }
+        fputc('"', f);
+}
+
+static uint64_t
+removed(const struct strip_stats *st)
+{
+        uint64_t n = st->esc_dispatched + st->csi_dispatched;
+
+        for (size_t i = 0; i < st->n_exprs; i++)
+                n += st->matched[i];
+        return n;
+}
+
+/*
+ * Whatever isn't read, scan, match or output is the state machine
+ * itself.  Clocks being what they are, it might come out a hair below 0.
+ */
+static uint64_t
+other_ns(const struct strip_stats *st)
+{
+        uint64_t phases = st->read_ns + st->scan_ns + st->match_ns +
+                          st->output_ns;
+
+        return st->total_ns > phases ? st->total_ns - phases : 0;
+}
+
+static void
+report_json(FILE *f, const struct strip_stats *st, const char **exprs)
+{
+        uint64_t other = other_ns(st);
+
+        fprintf(f, "{\"bytes_in\":%" PRIu64 ",\"bytes_out\":%" PRIu64,
+                st->bytes_in, st->bytes_out);
+        fprintf(f, ",\"escapes_removed\":%" PRIu64, removed(st));
+        fprintf(f, ",\"exprs\":[");
+        for (size_t i = 0; i < st->n_exprs; i++) {
+                fprintf(f, "%s{\"index\":%zu,\"expr\":", i ? "," : "", i);
+                print_string(f, exprs[i], true);
+                fprintf(f, ",\"matches\":%" PRIu64 "}", st->matched[i]);
+        }
+        fprintf(f, "]");
+        fprintf(f, ",\"unmatched\":%" PRIu64, st->unmatched);
+        fprintf(f, ",\"screen_salvaged\":%" PRIu64, st->screen_salvaged);
+        fprintf(f, ",\"restarted\":%" PRIu64, st->restarted);
+        fprintf(f, ",\"cut_short\":%" PRIu64, st->cut_short);
+        fprintf(f, ",\"unfinished\":%" PRIu64, st->unfinished);
+        fprintf(f, ",\"cr_to_nl\":%" PRIu64, st->cr_to_nl);
+        fprintf(f, ",\"esc_dispatched\":%" PRIu64, st->esc_dispatched);
+        fprintf(f, ",\"csi_dispatched\":%" PRIu64, st->csi_dispatched);
+        if (st->profile)
+                fprintf(f, ",\"profile\":{\"total_ns\":%" PRIu64
+                        ",\"read_ns\":%" PRIu64 ",\"scan_ns\":%" PRIu64
+                        ",\"match_ns\":%" PRIu64 ",\"output_ns\":%" PRIu64
+                        ",\"other_ns\":%" PRIu64 "}",
+                        st->total_ns, st->read_ns, st->scan_ns,
+                        st->match_ns, st->output_ns, other);
+        fprintf(f, "}\n");
+}
+
+static void
+report_phase(FILE *f, const char *name, uint64_t ns, uint64_t total)
+{
+        fprintf(f, "  %-8s %10.3f ms %5.1f%%\n", name, ns / 1e6,
+                total ? ns * 100.0 / total : 0.0);
+}
+
+void
+stats_report(FILE *f, const struct strip_stats *st, const char **exprs,
+             bool json)
+{
+        if (json) {
+                report_json(f, st, exprs);
+                return;
+        }
+
+        fprintf(f, "bytes in:                 %" PRIu64 "\n", st->bytes_in);
+        fprintf(f, "bytes out:                %" PRIu64 "\n", st->bytes_out);
+        fprintf(f, "escapes removed:          %" PRIu64 "\n", removed(st));
+        for (size_t i = 0; i < st->n_exprs; i++) {
+                fprintf(f, "  %10" PRIu64 "  [%zu] ", st->matched[i], i);
+                print_string(f, exprs[i], false);
+                fputc('\n', f);
+        }
+        if (st->esc_dispatched || st->csi_dispatched) {
+                fprintf(f, "  %10" PRIu64 "  ESC sequences\n", st->esc_dispatched);
+                fprintf(f, "  %10" PRIu64 "  CSI sequences\n", st->csi_dispatched);
+        }
+        fprintf(f, "unmatched after 16 bytes: %" PRIu64 "\n", st->unmatched);
+        fprintf(f, "  screen(1) \\x1b[[ salvaged: %" PRIu64 "\n",
+                st->screen_salvaged);
+        fprintf(f, "restarted at an escape:   %" PRIu64 "\n", st->restarted);
+        fprintf(f, "cut short by CR/NL:       %" PRIu64 "\n", st->cut_short);
+        fprintf(f, "unfinished at the end:    %" PRIu64 "\n", st->unfinished);
+        fprintf(f, "CR rewritten as NL:       %" PRIu64 "\n", st->cr_to_nl);
+
+        if (st->profile) {
+                uint64_t other = other_ns(st);
+
+                fprintf(f, "time:      %10.3f ms\n", st->total_ns / 1e6);
+                report_phase(f, "read", st->read_ns, st->total_ns);
+                report_phase(f, "scan", st->scan_ns, st->total_ns);
+                report_phase(f, "match", st->match_ns, st->total_ns);
+                report_phase(f, "output", st->output_ns, st->total_ns);
+                report_phase(f, "other", other, st->total_ns);
+        }
+}
+
+// vim:fenc=utf-8:tw=75:et
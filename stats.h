@@ -0,0 +1,80 @@
+/*
+ * stats.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * What --stats and --profile report.  A strip context with stats set
+ * counts what happens to every escape it sees; matched[] is indexed the
+ * same as the matcher's exprs[].  With profile set, it also adds up the
+ * time spent in scan_until2() and match(); read_ns comes from whoever
+ * reads the input, and output_ns from the output's write_ns.
+ */
+struct strip_stats {
+        bool profile;
+
+        uint64_t bytes_in;
+        uint64_t bytes_out;
+
+        /* the regexp state machine */
+        uint64_t *matched;
+        size_t n_exprs;
+        uint64_t unmatched;
+        uint64_t screen_salvaged;
+        uint64_t restarted;
+        uint64_t cut_short;
+        uint64_t unfinished;
+        uint64_t cr_to_nl;
+
+        /* --builtin-parser */
+        uint64_t esc_dispatched;
+        uint64_t csi_dispatched;
+
+        uint64_t total_ns;
+        uint64_t read_ns;
+        uint64_t scan_ns;
+        uint64_t match_ns;
+        uint64_t output_ns;
+};
+
+static inline uint64_t
+stats_clock(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * For timing a phase: start = stats_start(st); ...; stats_stop(st,
+ * &st->phase_ns, start).  Both are free unless profile is set.
+ */
+static inline uint64_t
+stats_start(const struct strip_stats *st)
+{
+        return st->profile ? stats_clock() : 0;
+}
+
+static inline void
+stats_stop(const struct strip_stats *st, uint64_t *counter, uint64_t start)
+{
+        if (st->profile)
+                *counter += stats_clock() - start;
+}
+
+extern void stats_init(struct strip_stats *st, size_t n_exprs, bool profile);
+extern void stats_report(FILE *f, const struct strip_stats *st,
+                         const char **exprs, bool json);
+extern void stats_free(struct strip_stats *st);
+
+#endif /* !STATS_H_ */
+// vim:fenc=utf-8:tw=75:et
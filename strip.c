@@ -0,0 +1,1128 @@
+/*
+ * strip.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "debug.h"
+#include "dfa.h"
+#include "error.h"
+#include "output.h"
+#include "scan.h"
+#include "strip.h"
+#include "untty.h"
+#include "utf8.h"
+#include "vtparse.h"
+
+/*
+ * The feed loops and what they call are instantiated twice: once with
+ * tracing set, for -d and UNTTY_DEBUG, and once without, where every
+ * trace() compiles away and the hot paths don't even test debug_arg.
+ */
+#define trace(fmt, ...) ({                                              \
+                if (tracing)                                            \
+                        debug(fmt, ##__VA_ARGS__);                      \
+        })
+
+/*
+ * --utf8: printable ASCII, TAB, NL and well-formed UTF-8 other than the
+ * C1 controls are copied as they are; every other byte is written as
+ * \xNN.  A character cut off at the end of data is kept in s->u8 until
+ * the next call says whether it's finished.
+ */
+static void
+text_flush(struct strip *s)
+{
+        for (size_t i = 0; i < s->u8_len; i++)
+                output_hex(s->out, s->u8[i]);
+        s->u8_len = 0;
+}
+
+static void
+text_char(struct output *out, const char *seq, size_t n)
+{
+        if (n == 2 && utf8_is_c1(seq)) {
+                output_hex(out, seq[0]);
+                output_hex(out, seq[1]);
+        } else {
+                output_write(out, seq, n);
+        }
+}
+
+static void
+text_write(struct strip *s, const char *data, size_t len)
+{
+        struct output *out = s->out;
+        size_t i = 0;
+
+        while (s->u8_len && i < len) {
+                unsigned char lead = s->u8[0];
+
+                if (!utf8_continues(lead, s->u8_len, data[i])) {
+                        text_flush(s);
+                        break;
+                }
+                s->u8[s->u8_len++] = data[i++];
+                if (s->u8_len == utf8_need(lead)) {
+                        text_char(out, s->u8, s->u8_len);
+                        s->u8_len = 0;
+                }
+        }
+
+        /* runs of good text, ASCII or not, are written in one go */
+        for (size_t start = i; i < len; start = i) {
+                unsigned char lead = 0;
+                size_t need = 0, k = 0;
+
+                while (true) {
+                        i += scan_text(data + i, len - i);
+                        if (i == len)
+                                break;
+
+                        lead = data[i];
+                        need = utf8_need(lead);
+                        for (k = 1; k < need && i + k < len; k++)
+                                if (!utf8_continues(lead, k, data[i + k]))
+                                        break;
+                        if (!need || k < need || utf8_is_c1(data + i))
+                                break;
+                        i += need;
+                }
+                output_write(out, data + start, i - start);
+                if (i == len)
+                        break;
+
+                if (need && k == need) {
+                        /* C1 */
+                        text_char(out, data + i, need);
+                        i += need;
+                } else if (need && i + k == len) {
+                        memcpy(s->u8, data + i, k);
+                        s->u8_len = k;
+                        break;
+                } else {
+                        /* what followed gets looked at on its own */
+                        output_hex(out, lead);
+                        i++;
+                }
+        }
+}
+
+static inline void
+put_text(struct strip *s, const char *data, size_t len)
+{
+        if (s->config->utf8)
+                text_write(s, data, len);
+        else
+                output_write(s->out, data, len);
+}
+
+static inline void
+put_char(struct strip *s, char c)
+{
+        if (s->config->utf8)
+                text_write(s, &c, 1);
+        else
+                output_putc(s->out, c);
+}
+
+static inline ALWAYS_INLINE void
+print_buf(struct strip *s, char *buf, ssize_t pos, const bool tracing)
+{
+        struct output *out = s->out;
+        bool utf8 = s->config->utf8;
+
+        if (tracing)
+                fprintf(stderr, "print_buf:\"");
+        for (int i = 0; i < pos; i++) {
+                if (buf[i] == CR)
+                        continue;
+                if (utf8) {
+                        if (tracing && isprint(buf[i]))
+                                fputc(buf[i], stderr);
+                        else if (tracing)
+                                fprintf(stderr, "\\x%02hhx", buf[i]);
+                        text_write(s, buf + i, 1);
+                } else if (isprint(buf[i]) || buf[i] == NL) {
+                        if (buf[i] == NL && tracing)
+                                fprintf(stderr, "\\x%02hhx", buf[i]);
+                        else if (tracing)
+                                fputc(buf[i], stderr);
+                        output_putc(out, buf[i]);
+                } else {
+                        if (tracing)
+                                fprintf(stderr, "\\x%02hhx", buf[i]);
+                        output_hex(out, buf[i]);
+                }
+        }
+        if (tracing) {
+                fprintf(stderr, "\"\n");
+        }
+}
+
+/*
+ * Decimal, without going through printf() for every escape.
+ */
+static void
+put_number(struct output *out, uint64_t n)
+{
+        char digits[20];
+        size_t i = sizeof(digits);
+
+        do {
+                digits[--i] = '0' + n % 10;
+                n /= 10;
+        } while (n);
+        output_write(out, digits + i, sizeof(digits) - i);
+}
+
+#define put_literal(out, s) output_write((out), (s), sizeof(s) - 1)
+
+/*
+ * --escapes-out: one line of JSON for each sequence an expression
+ * matched.  Bytes that aren't printable are written as \u00NN, the way
+ * --stats=json writes expressions.
+ */
+static void
+record_escape(struct strip *s, uint64_t offset, const char *seq, size_t len)
+{
+        static const char hex[] = "0123456789abcdef";
+        struct output *out = s->escapes;
+
+        put_literal(out, "{\"offset\":");
+        put_number(out, offset);
+        put_literal(out, ",\"length\":");
+        put_number(out, len);
+        put_literal(out, ",\"expr\":");
+        put_number(out, s->matched);
+        put_literal(out, ",\"seq\":\"");
+        for (size_t i = 0; i < len; i++) {
+                unsigned char c = seq[i];
+
+                if (c == '"' || c == '\\') {
+                        output_putc(out, '\\');
+                        output_putc(out, c);
+                } else if (isprint(c)) {
+                        output_putc(out, c);
+                } else {
+                        char u[6] = { '\\', 'u', '0', '0',
+                                      hex[c >> 4], hex[c & 0xf] };
+
+                        output_write(out, u, sizeof(u));
+                }
+        }
+        put_literal(out, "\"}\n");
+}
+
+static char *printables(char *str)
+{
+        static char buf[1024];
+        char *current = buf;
+
+        buf[0] = '\0';
+        for (int i = 0; str && str[i]; i++) {
+                if (isprint(str[i]))
+                        current = stpncpy(current, str+i, 1);
+                else
+                        current += sprintf(current, "\\x%02hhx", str[i]);
+                buf[i+1] = '\0';
+        }
+        return buf;
+}
+
+int
+setup_matcher(struct matcher *m, regex_t *regexps, size_t n_exprs,
+              const char **exprs)
+{
+        memset(m, 0, sizeof(*m));
+        m->regexps = regexps;
+        m->exprs = exprs;
+        m->n_exprs = n_exprs;
+
+        m->handled = calloc(n_exprs ? n_exprs : 1, sizeof(*m->handled));
+        if (!m->handled) {
+                set_error("Could not allocate memory");
+                return -1;
+        }
+        m->dfa = dfa_compile(exprs, n_exprs, m->handled);
+        return 0;
+}
+
+/*
+ * Takes ownership of dfa and handled, if it succeeds.  regexps must
+ * already have every expression that isn't handled compiled.
+ */
+int
+setup_matcher_lazy(struct matcher *m, regex_t *regexps, size_t n_exprs,
+                   const char **exprs, struct dfa *dfa, bool *handled)
+{
+        memset(m, 0, sizeof(*m));
+        m->lazy = calloc(1, sizeof(*m->lazy));
+        if (!m->lazy) {
+                set_error("Could not allocate memory");
+                return -1;
+        }
+        pthread_mutex_init(&m->lazy->lock, NULL);
+
+        m->regexps = regexps;
+        m->exprs = exprs;
+        m->n_exprs = n_exprs;
+        m->dfa = dfa;
+        m->handled = handled;
+        return 0;
+}
+
+/*
+ * Whether regexps[i] has been compiled and so needs regfree().
+ */
+bool
+matcher_compiled(const struct matcher *m, size_t i)
+{
+        return !m->lazy || !m->handled[i] || m->lazy->done;
+}
+
+void
+free_matcher(struct matcher *m)
+{
+        dfa_free(m->dfa);
+        free(m->handled);
+        if (m->lazy) {
+                pthread_mutex_destroy(&m->lazy->lock);
+                free(m->lazy);
+        }
+}
+
+/*
+ * If one won't compile, the ones before it are freed again, so the next
+ * caller can have another go.
+ */
+static bool
+compile_handled(const struct matcher *m)
+{
+        struct lazy_regexps *lazy = m->lazy;
+        char errbuf[1024];
+        bool ok = true;
+
+        if (!lazy || __atomic_load_n(&lazy->done, __ATOMIC_ACQUIRE))
+                return true;
+
+        pthread_mutex_lock(&lazy->lock);
+        for (size_t i = 0; !lazy->done && i < m->n_exprs; i++) {
+                int rc;
+
+                if (!m->handled[i])
+                        continue;
+                debug("regcomp(\"%s\")", m->exprs[i]);
+                rc = regcomp(&m->regexps[i], m->exprs[i], 0);
+                if (rc != 0) {
+                        regerror(rc, &m->regexps[i], errbuf, sizeof(errbuf));
+                        set_errorx("Could not compile regexp \"%s\": %s",
+                                   m->exprs[i], errbuf);
+                        while (i-- > 0)
+                                if (m->handled[i])
+                                        regfree(&m->regexps[i]);
+                        ok = false;
+                        break;
+                }
+        }
+        if (ok)
+                __atomic_store_n(&lazy->done, true, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&lazy->lock);
+        return ok;
+}
+
+/*
+ * Call whenever buf gets anything other than one more byte on the end.
+ */
+static inline void
+match_reset(struct strip *s)
+{
+        s->scanned = 0;
+        s->early = false;
+}
+
+static inline ALWAYS_INLINE ssize_t
+match(struct strip *s, char *buf, ssize_t pos, const bool tracing,
+      const bool counting)
+{
+        const struct matcher *m = s->config->matcher;
+        const char **exprs = m->exprs;
+        char errbuf[1024];
+        regmatch_t matches[80];
+        ssize_t ret = -1;
+        int matched = -1;
+        ssize_t len = pos - 1;
+
+        buf[pos] = '\0';
+
+        if (m->dfa) {
+                if (s->scanned == 0)
+                        s->dfa_state = m->dfa->start;
+                while (s->scanned < len) {
+                        s->dfa_state = dfa_step(m->dfa, s->dfa_state, buf[1 + s->scanned++]);
+                        /*
+                         * A match that ends before the last byte means
+                         * buf was refilled from leftovers, and regexec()
+                         * might pick a different one; let it decide.
+                         */
+                        if (s->scanned < len && dfa_accepting(m->dfa, s->dfa_state))
+                                s->early = true;
+                }
+
+                if (!s->early && dfa_accepting(m->dfa, s->dfa_state)) {
+                        const struct dfa *dfa = m->dfa;
+
+                        for (uint32_t i = dfa->accept_off[s->dfa_state];
+                             i < dfa->accept_off[s->dfa_state+1]; i++) {
+                                uint32_t expr = dfa->accept[i];
+                                ssize_t mpos = dfa_match_end(dfa, expr, len);
+
+                                trace("dfa found a match: %s", exprs[expr]);
+                                if (ret < 0 || mpos < ret) {
+                                        matched = expr;
+                                        ret = mpos;
+                                }
+                        }
+                }
+        }
+
+        if (s->early && !compile_handled(m)) {
+                s->error = EINVAL;
+                return -1;
+        }
+
+        memset(matches, 0, sizeof(matches));
+        for (unsigned int i = 0; exprs[i] != NULL; i++) {
+                int rc;
+
+                if (m->handled[i] && !s->early)
+                        continue;
+
+                trace("regexec(\"%s\", \"%s\", %zd)", exprs[i], printables(buf+1), pos-1);
+                rc = regexec(&m->regexps[i], buf+1, pos-1, matches, 0);
+                if (rc != 0 && rc != REG_NOMATCH) {
+                        regerror(rc, &m->regexps[i], errbuf, sizeof(errbuf));
+                        set_errorx("Could not execute regexp \"%s\": %s",
+                                   exprs[i], errbuf);
+                        s->error = EINVAL;
+                        return -1;
+                }
+                if (rc == REG_NOMATCH)
+                        continue;
+                trace("found a match: %s", exprs[i]);
+                for (int j = 0; j < 80 && matches[j].rm_so != -1; j++)
+                {
+                        int mpos = matches[j].rm_eo;
+                        if (ret < 0 || mpos < ret ||
+                            (mpos == ret && (int)i < matched)) {
+                                matched = i;
+                                ret = mpos;
+                        }
+                }
+        }
+        if (ret >= 0) {
+                ret++;
+                s->matched = matched;
+                if (counting)
+                        s->stats->matched[matched]++;
+        }
+        if (matched > 0)
+                trace("Using shortest match at %zd chars: %s", ret-1, exprs[matched]);
+
+        return ret;
+}
+
+static char *
+get_state_name(state_t state)
+{
+        static char * state_names[] = {
+                "NEED_ESCAPE",
+                "NEED_ESCAPE_HAVE_CR",
+                "NEED_MATCH",
+                "DONE"
+        };
+        return state_names[state];
+}
+
+/*
+ * --builtin-parser: everything the ECMA-48 parser recognizes as a control
+ * sequence gets dropped, and what it prints or executes in GROUND goes
+ * through with the same CR handling as NEED_ESCAPE_HAVE_CR.
+ */
+static inline ALWAYS_INLINE void
+feed_builtin(struct strip *s, const char *data, size_t len, const bool tracing,
+             const bool counting)
+{
+        struct output *out = s->out;
+        struct vtparse *vt = &s->vt;
+        struct strip_stats *st = s->stats;
+
+        for (size_t i = 0; i < len; i++) {
+                vt_state_t state = vt->state;
+                unsigned char c;
+
+                if (state == VT_GROUND && !s->have_cr && !tracing) {
+                        uint64_t start = counting ? stats_start(st) : 0;
+                        size_t n = scan_until2(data + i, len - i, ESC, CR);
+
+                        if (counting)
+                                stats_stop(st, &st->scan_ns, start);
+                        put_text(s, data + i, n);
+                        i += n;
+                        if (i == len)
+                                break;
+                }
+
+                c = data[i];
+                if (s->u8_len && (c == ESC || c == CR))
+                        text_flush(s);
+                if (s->have_cr) {
+                        output_putc(out, NL);
+                        if (counting)
+                                st->cr_to_nl++;
+                        s->have_cr = false;
+                        if (c == NL || c == CR)
+                                continue;
+                }
+
+                switch (vtparse_byte(vt, c)) {
+                case VT_PRINT:
+                        put_char(s, c);
+                        break;
+                case VT_EXECUTE:
+                        if (counting && state != VT_GROUND &&
+                            (c == CR || c == NL))
+                                st->cut_short++;
+                        if (c == CR)
+                                s->have_cr = true;
+                        else
+                                put_char(s, c);
+                        break;
+                case VT_ESC_DISPATCH:
+                        if (counting)
+                                st->esc_dispatched++;
+                        trace("ESC dispatch \'%c\' (%u intermediates)",
+                              c, vt->n_intermediates);
+                        break;
+                case VT_CSI_DISPATCH:
+                        if (counting)
+                                st->csi_dispatched++;
+                        trace("CSI dispatch \'%c\' (%u params)",
+                              c, vt->n_params);
+                        break;
+                default:
+                        break;
+                }
+                if (vt->state != state)
+                        trace("%s->%s: \\x%02hhx", vtparse_state_name(state),
+                              vtparse_state_name(vt->state), c);
+        }
+}
+
+/*
+ * --render: the same parser as --builtin-parser, but CR, BS, and the CSI
+ * sequences that move the cursor along a line or erase it are applied to
+ * a one line virtual screen.  A line is only written out, as it finally
+ * looked, once it's done with: at NL, or when a sequence moves the
+ * cursor to another row.  A spinner that redraws itself a thousand times
+ * after CRs comes out once.
+ */
+static void
+render_commit(struct strip *s, bool nl)
+{
+        if (s->line_len)
+                put_text(s, s->line, s->line_len);
+        text_flush(s);
+        if (nl)
+                output_putc(s->out, NL);
+        s->line_len = 0;
+}
+
+/*
+ * A line that never ends doesn't get to use up all of memory; past
+ * RENDER_LINE_MAX it wraps, the way it would on a (very wide) terminal.
+ */
+static void
+render_put(struct strip *s, const char *data, size_t n)
+{
+        while (n) {
+                size_t k;
+
+                if (s->col >= RENDER_LINE_MAX) {
+                        render_commit(s, true);
+                        s->col = 0;
+                }
+                k = RENDER_LINE_MAX - s->col;
+                if (k > n)
+                        k = n;
+
+                if (s->col + k > s->line_size) {
+                        size_t size = s->line_size ? s->line_size * 2 : 256;
+                        char *line;
+
+                        while (size < s->col + k)
+                                size *= 2;
+                        line = realloc(s->line, size);
+                        if (!line) {
+                                set_error("Could not allocate memory");
+                                s->error = errno;
+                                return;
+                        }
+                        s->line = line;
+                        s->line_size = size;
+                }
+                if (s->col > s->line_len)
+                        memset(s->line + s->line_len, ' ',
+                               s->col - s->line_len);
+                memcpy(s->line + s->col, data, k);
+                s->col += k;
+                if (s->col > s->line_len)
+                        s->line_len = s->col;
+                data += k;
+                n -= k;
+        }
+}
+
+static void
+render_erase(struct strip *s, unsigned int how)
+{
+        switch (how) {
+        case 0:
+                if (s->col < s->line_len)
+                        s->line_len = s->col;
+                break;
+        case 1:
+                if (s->line_len)
+                        memset(s->line, ' ', s->col < s->line_len ?
+                                             s->col + 1 : s->line_len);
+                break;
+        default:
+                s->line_len = 0;
+                break;
+        }
+}
+
+/*
+ * Moving to another row finishes the line we were on.  Relative moves
+ * and NL leave us not knowing which row we're on, so any move after
+ * them counts.
+ */
+static void
+render_row(struct strip *s, int row)
+{
+        if ((row < 0 || row != s->row) && s->line_len)
+                render_commit(s, true);
+        s->row = row;
+}
+
+static inline unsigned int
+render_param(const struct vtparse *vt, unsigned int i, unsigned int dflt)
+{
+        return i < vt->n_params && vt->params[i] ? vt->params[i] : dflt;
+}
+
+static void
+render_csi(struct strip *s, unsigned char c)
+{
+        const struct vtparse *vt = &s->vt;
+        unsigned int n = render_param(vt, 0, 1);
+
+        if (vt->n_intermediates || vt->ignoring)
+                return;
+
+        switch (c) {
+        case 'K':               /* EL */
+        case 'J':               /* ED, as far as this line goes */
+                render_erase(s, render_param(vt, 0, 0));
+                break;
+        case 'G':               /* CHA */
+        case '`':               /* HPA */
+                s->col = n - 1;
+                break;
+        case 'C':               /* CUF */
+        case 'a':               /* HPR */
+                s->col += n;
+                break;
+        case 'D':               /* CUB */
+                s->col -= n < s->col ? n : s->col;
+                break;
+        case 'H':               /* CUP */
+        case 'f':               /* HVP */
+                render_row(s, n);
+                s->col = render_param(vt, 1, 1) - 1;
+                break;
+        case 'd':               /* VPA */
+                render_row(s, n);
+                break;
+        case 'A':               /* CUU */
+        case 'B':               /* CUD */
+                render_row(s, -1);
+                break;
+        case 'E':               /* CNL */
+        case 'F':               /* CPL */
+                render_row(s, -1);
+                s->col = 0;
+                break;
+        default:
+                break;
+        }
+        /* render_put() wraps at RENDER_LINE_MAX, so past it is all the same */
+        if (s->col > RENDER_LINE_MAX)
+                s->col = RENDER_LINE_MAX;
+}
+
+static inline ALWAYS_INLINE void
+feed_render(struct strip *s, const char *data, size_t len, const bool tracing,
+            const bool counting)
+{
+        struct vtparse *vt = &s->vt;
+        struct strip_stats *st = s->stats;
+
+        for (size_t i = 0; i < len; i++) {
+                vt_state_t state = vt->state;
+                unsigned char c;
+
+                /* everything from SPC up but DEL prints in GROUND */
+                if (state == VT_GROUND) {
+                        size_t n = 0;
+
+                        while (i + n < len &&
+                               (unsigned char)data[i + n] >= SPC &&
+                               data[i + n] != '\x7f')
+                                n++;
+                        render_put(s, data + i, n);
+                        i += n;
+                        if (i == len)
+                                break;
+                }
+
+                c = data[i];
+                switch (vtparse_byte(vt, c)) {
+                case VT_PRINT:
+                        render_put(s, (char *)&c, 1);
+                        break;
+                case VT_EXECUTE:
+                        if (counting && state != VT_GROUND &&
+                            (c == CR || c == NL))
+                                st->cut_short++;
+                        switch (c) {
+                        case NL:
+                        case '\v':
+                        case '\f':
+                                render_commit(s, true);
+                                s->col = 0;
+                                s->row = -1;
+                                break;
+                        case CR:
+                                /* the rewrite is to column 0, not a NL */
+                                if (counting)
+                                        st->cr_to_nl++;
+                                s->col = 0;
+                                break;
+                        case '\b':
+                                if (s->col)
+                                        s->col--;
+                                break;
+                        case '\0':
+                        case '\a':
+                                break;
+                        default:
+                                render_put(s, (char *)&c, 1);
+                                break;
+                        }
+                        break;
+                case VT_ESC_DISPATCH:
+                        trace("ESC dispatch \'%c\' (%u intermediates)",
+                              c, vt->n_intermediates);
+                        if (counting)
+                                st->esc_dispatched++;
+                        if (c == 'E' && !vt->n_intermediates) {
+                                /* NEL */
+                                render_commit(s, true);
+                                s->col = 0;
+                                s->row = -1;
+                        }
+                        break;
+                case VT_CSI_DISPATCH:
+                        trace("CSI dispatch \'%c\' (%u params) at column %zu",
+                              c, vt->n_params, s->col);
+                        if (counting)
+                                st->csi_dispatched++;
+                        render_csi(s, c);
+                        break;
+                default:
+                        break;
+                }
+                if (vt->state != state)
+                        trace("%s->%s: \\x%02hhx", vtparse_state_name(state),
+                              vtparse_state_name(vt->state), c);
+        }
+}
+
+void
+strip_init(struct strip *s, const struct strip_config *config,
+           struct output *out)
+{
+        memset(s, 0, sizeof(*s));
+        s->config = config;
+        s->out = out;
+        s->state = NEED_ESCAPE;
+        vtparse_init(&s->vt);
+        s->row = -1;
+}
+
+static inline ALWAYS_INLINE void
+feed_regexps(struct strip *s, const char *data, size_t len, const bool tracing,
+             const bool counting)
+{
+        struct output *out = s->out;
+        struct strip_stats *st = s->stats;
+        char escape = s->config->escape;
+        char *buf = s->buf;
+        ssize_t pos = s->pos;
+        state_t state = s->state;
+
+        for (size_t i = 0; i < len; i++) {
+                int rc;
+                char c;
+
+                /*
+                 * Everything but the escape character and CR goes
+                 * straight through in NEED_ESCAPE, so copy the whole
+                 * run up to the next one of those at once.
+                 */
+                if (state == NEED_ESCAPE && !tracing) {
+                        uint64_t start = counting ? stats_start(st) : 0;
+                        size_t n = scan_until2(data + i, len - i, escape, CR);
+
+                        if (counting)
+                                stats_stop(st, &st->scan_ns, start);
+
+                        put_text(s, data + i, n);
+                        i += n;
+                        if (i == len)
+                                break;
+                }
+
+                c = data[i];
+
+                if (isprint(c))
+                        trace("%s read \'%c\'", get_state_name(state), c);
+                else
+                        trace("%s read '\\x%02hhx'", get_state_name(state), c);
+
+                switch (state) {
+                case NEED_ESCAPE_HAVE_CR:
+                        output_putc(out, NL);
+                        if (counting)
+                                st->cr_to_nl++;
+                        trace("%s->NEED_ESCAPE: found CR/NL.",
+                              get_state_name(state));
+                        state = NEED_ESCAPE;
+                        if (c == NL || c == CR)
+                                continue;
+
+                        /* fall through */
+                case NEED_ESCAPE:
+                        if (s->u8_len && (c == escape || c == CR))
+                                text_flush(s);
+                        if (c == escape) {
+                                match_reset(s);
+                                buf[pos++] = c;
+                                buf[pos] = '\0';
+                                trace("%s->NEED_MATCH: Got ESC (\\x%02hhx)",
+                                      get_state_name(state), escape);
+                                state = NEED_MATCH;
+                        } else {
+                                if (c == CR)
+                                        state = NEED_ESCAPE_HAVE_CR;
+                                else
+                                        put_char(s, c);
+                        }
+                        continue;
+
+                case NEED_MATCH:
+                        buf[pos++] = c;
+                        buf[pos] = '\0';
+                        trace("new buffer:\"%s\" pos:%zd", buf, pos);
+
+                        if (c == CR || c == NL) {
+                                trace("%s->NEED_ESCAPE: Found %s.",
+                                      get_state_name(state), c == CR ? "return" : "newline");
+                                if (counting)
+                                        st->cut_short++;
+                                print_buf(s, buf, pos, tracing);
+                                pos = 0;
+                                buf[pos] = '\0';
+                                state = NEED_ESCAPE;
+                                continue;
+                        }
+
+                        if (pos <= 1)
+                                continue;
+
+                        if (counting) {
+                                uint64_t start = stats_start(st);
+
+                                rc = match(s, buf, pos, tracing, true);
+                                stats_stop(st, &st->match_ns, start);
+                        } else {
+                                rc = match(s, buf, pos, tracing, false);
+                        }
+                        if (rc < 0) {
+                                if (c == escape && pos > 1) {
+                                        if (counting)
+                                                st->restarted++;
+                                        trace("%s->NEED_MATCH: Found escape",
+                                              get_state_name(state));
+                                        //if (isprint(escape) || escape == SPC) {
+                                        //        print_buf(out, buf, pos-1);
+                                        //}
+                                        trace("Advancing %zd.", pos-1);
+                                        pos--;
+                                        buf[pos] = '\0';
+                                        print_buf(s, buf, pos, tracing);
+                                        trace("memset(\"%s\", '\\0', %zd)", buf, pos+1);
+                                        memset(buf, '\0', pos+1);
+                                        pos = 0;
+                                        match_reset(s);
+                                        buf[pos++] = c;
+                                        buf[pos] = '\0';
+                                        trace("new buffer:\"%s\" pos:%zd", buf, pos);
+                                        continue;
+                                }
+
+                                if (pos >= 16 || c == CR || c == NL) {
+                                        if (c == CR || c == NL) {
+                                                trace("%s->NEED_ESCAPE: Found %s.",
+                                                      get_state_name(state),
+                                                      c == CR ? "return" : "newline");
+                                                if (counting)
+                                                        st->cut_short++;
+                                                print_buf(s, buf, pos, tracing);
+                                        } else {
+                                                if (counting)
+                                                        st->unmatched++;
+                                                trace("%s->NEED_ESCAPE: Escape unmatched at %zd characters",
+                                                      get_state_name(state), pos);
+                                                /*
+                                                 * Sometimes linux booting logged
+                                                 * through screen(1) winds up with:
+                                                 * \x1b[[    5.953653]
+                                                 * So get rid of \x1b[ there,
+                                                 * because it's garbage.
+                                                 */
+                                                if (pos > 1 &&
+                                                    escape == ESC &&
+                                                    buf[0] == ESC &&
+                                                    buf[1] == '[') {
+                                                        if (counting)
+                                                                st->screen_salvaged++;
+                                                        print_buf(s, buf+2, pos-2, tracing);
+                                                } else
+                                                        print_buf(s, buf, pos, tracing);
+                                        }
+                                        pos = 0;
+                                        buf[pos] = '\0';
+                                        state = NEED_ESCAPE;
+                                }
+                                continue;
+                        }
+
+                        if (s->escapes)
+                                record_escape(s, s->in_off + i + 1 - pos,
+                                              buf, rc);
+                        match_reset(s);
+                        pos -= rc;
+                        if (pos > 0) {
+                                memmove(buf, buf+rc, pos);
+                                if (buf[0] == escape) {
+                                        trace("%s->NEED_MATCH: matched %d characters",
+                                              get_state_name(state), rc);
+                                        state = NEED_MATCH;
+                                }
+                        } else {
+                                trace("%s->NEED_ESCAPE: matched %d characters",
+                                      get_state_name(state), rc);
+                                state = NEED_ESCAPE;
+                        }
+                        buf[pos] = '\0';
+                        continue;
+
+                case DONE:
+                        /* only strip_finish() gets here */
+                        continue;
+                }
+        }
+
+        s->pos = pos;
+        s->state = state;
+        s->in_off += len;
+}
+
+/*
+ * Counting gets its own instantiation too, so it costs nothing when
+ * --stats is off; with -d it's decided as it goes, since tracing is slow
+ * enough anyway.
+ */
+void
+strip_feed(struct strip *s, const char *data, size_t len)
+{
+        bool counting = s->stats != NULL;
+
+        if (s->error)
+                return;
+
+        if (counting)
+                s->stats->bytes_in += len;
+
+        if (s->config->render) {
+                if (debug_arg)
+                        feed_render(s, data, len, true, counting);
+                else if (counting)
+                        feed_render(s, data, len, false, true);
+                else
+                        feed_render(s, data, len, false, false);
+                return;
+        }
+
+        if (s->config->builtin) {
+                if (debug_arg)
+                        feed_builtin(s, data, len, true, counting);
+                else if (counting)
+                        feed_builtin(s, data, len, false, true);
+                else
+                        feed_builtin(s, data, len, false, false);
+                return;
+        }
+
+        if (debug_arg)
+                feed_regexps(s, data, len, true, counting);
+        else if (counting)
+                feed_regexps(s, data, len, false, true);
+        else
+                feed_regexps(s, data, len, false, false);
+}
+
+void
+strip_finish(struct strip *s)
+{
+        if (s->error) {
+                strip_free(s);
+                return;
+        }
+
+        if (s->config->render) {
+                /* a last line with no NL doesn't get one */
+                render_commit(s, false);
+                strip_free(s);
+                return;
+        }
+
+        if (s->config->builtin) {
+                if (s->vt.state != VT_GROUND)
+                        debug("%s->DONE: read() == 0",
+                              vtparse_state_name(s->vt.state));
+                text_flush(s);
+                return;
+        }
+
+        debug("%s->DONE: read() == 0", get_state_name(s->state));
+        s->state = DONE;
+        if (s->pos && s->stats)
+                s->stats->unfinished++;
+        if (s->pos)
+                print_buf(s, s->buf, s->pos, debug_arg);
+        text_flush(s);
+        s->pos = 0;
+}
+
+void
+strip_free(struct strip *s)
+{
+        free(s->line);
+        s->line = NULL;
+        s->line_len = s->line_size = s->col = 0;
+}
+
+/*
+ * The UNTTY_* flags that would get this config from untty_new().
+ */
+uint32_t
+strip_options(const struct strip_config *config)
+{
+        return (config->escape == SPC ? UNTTY_SPACE_AS_ESCAPE : 0) |
+               (config->builtin ? UNTTY_BUILTIN_PARSER : 0) |
+               (config->render ? UNTTY_RENDER : 0) |
+               (config->utf8 ? UNTTY_UTF8 : 0);
+}
+
+void
+strip_save(const struct strip *s, struct strip_saved *saved)
+{
+        memset(saved, 0, sizeof(*saved));
+        saved->state = s->state;
+        saved->pos = s->pos;
+        memcpy(saved->buf, s->buf, s->pos);
+        saved->have_cr = s->have_cr;
+        saved->u8_len = s->u8_len;
+        memcpy(saved->u8, s->u8, s->u8_len);
+        saved->vt = s->vt;
+        saved->col = s->col;
+        saved->row = s->row;
+        saved->line_len = s->line_len;
+}
+
+bool
+strip_saved_ok(const struct strip_saved *saved)
+{
+        const struct vtparse *vt = &saved->vt;
+
+        return saved->state < DONE &&
+               saved->pos < sizeof(saved->buf) &&
+               saved->u8_len < sizeof(saved->u8) &&
+               vt->state < VT_N_STATES &&
+               vt->n_params <= VT_MAX_PARAMS &&
+               vt->n_intermediates <= VT_MAX_INTERMEDIATES &&
+               saved->col <= RENDER_LINE_MAX &&
+               saved->line_len <= RENDER_LINE_MAX;
+}
+
+int
+strip_restore(struct strip *s, const struct strip_saved *saved,
+              const char *line)
+{
+        s->state = saved->state;
+        s->pos = saved->pos;
+        memcpy(s->buf, saved->buf, saved->pos);
+        s->buf[s->pos] = '\0';
+        match_reset(s);
+        s->have_cr = saved->have_cr;
+        s->u8_len = saved->u8_len;
+        memcpy(s->u8, saved->u8, saved->u8_len);
+        s->vt = saved->vt;
+        s->col = saved->col;
+        s->row = saved->row;
+
+        if (saved->line_len) {
+                s->line = malloc(saved->line_len);
+                if (!s->line) {
+                        set_error("Could not allocate memory");
+                        return -1;
+                }
+                memcpy(s->line, line, saved->line_len);
+                s->line_len = s->line_size = saved->line_len;
+        }
+        return 0;
+}
+
+// vim:fenc=utf-8:tw=75:et
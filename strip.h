@@ -0,0 +1,170 @@
+/*
+ * strip.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef STRIP_H_
+#define STRIP_H_
+
+#include <pthread.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "output.h"
+#include "stats.h"
+#include "vtparse.h"
+
+#define ESC '\x1b'
+#define SPC '\x20'
+#define CR '\x0d'
+#define NL '\x0a'
+
+/* --render wraps lines longer than this */
+#define RENDER_LINE_MAX (1024 * 1024)
+
+typedef enum states {
+        NEED_ESCAPE,
+        NEED_ESCAPE_HAVE_CR,
+        NEED_MATCH,
+        DONE
+} state_t;
+
+/*
+ * The compiled escape expressions.  Nothing here changes once
+ * setup_matcher() is done with it, so any number of strip contexts can
+ * share one.  Expressions with handled[i] set are run by the DFA instead
+ * of regexec().
+ *
+ * A matcher loaded from an expression cache only has the regexps the DFA
+ * doesn't handle compiled; the rest are compiled under lazy->lock the
+ * first time match() needs regexec() to check the DFA's answer.
+ */
+struct lazy_regexps {
+        pthread_mutex_t lock;
+        bool done;
+};
+
+struct matcher {
+        regex_t *regexps;
+        const char **exprs;
+        size_t n_exprs;
+
+        struct dfa *dfa;
+        bool *handled;
+        struct lazy_regexps *lazy;
+};
+
+struct strip_config {
+        const struct matcher *matcher;
+        char escape;
+        bool builtin;
+        bool render;
+        bool utf8;
+};
+
+/*
+ * One stream's worth of the NEED_ESCAPE / NEED_ESCAPE_HAVE_CR /
+ * NEED_MATCH state machine (or the --builtin-parser one).  Every NL puts
+ * it back in NEED_ESCAPE with nothing buffered.
+ *
+ * If stats is set after strip_init(), everything gets counted in it.
+ */
+struct strip {
+        const struct strip_config *config;
+        struct output *out;
+        struct strip_stats *stats;
+
+        state_t state;
+        char buf[80];
+        ssize_t pos;
+
+        /*
+         * How far the DFA got through buf+1 since the last match_reset(),
+         * and whether it went past a match on the way.
+         */
+        uint32_t dfa_state;
+        ssize_t scanned;
+        bool early;
+
+        struct vtparse vt;
+        bool have_cr;
+
+        /*
+         * --render's virtual line: what's on it so far, where the
+         * cursor is, and which row it's on if a sequence has said so
+         * since the last NL (otherwise -1).
+         */
+        char *line;
+        size_t line_len;
+        size_t line_size;
+        size_t col;
+        int row;
+
+        /*
+         * --utf8: the start of a multibyte character that the last span
+         * of text ended in the middle of.
+         */
+        char u8[4];
+        size_t u8_len;
+
+        /*
+         * --escapes-out: where each match gets recorded, which
+         * expression matched last, and how much input the regexp state
+         * machine had been fed before this strip_feed().
+         */
+        struct output *escapes;
+        int matched;
+        uint64_t in_off;
+
+        /*
+         * If a regexp wouldn't compile or run, or there was no memory
+         * for the --render line, the errno; the reason went to
+         * set_error(), and nothing more gets stripped.
+         */
+        int error;
+};
+
+/*
+ * What a strip context is in the middle of, flattened for --state-file.
+ * strip_save() fills it in, and strip_restore() puts it back into a
+ * context fresh from strip_init() with the same config; line_len bytes of
+ * --render's line go along with it.  The DFA's progress through buf
+ * isn't kept, since match() can just start over on buf.  Anything read
+ * back from a file should pass strip_saved_ok() first.
+ */
+struct strip_saved {
+        uint32_t state;
+        uint32_t pos;
+        char buf[80];
+        uint8_t have_cr;
+        uint8_t u8_len;
+        char u8[4];
+        struct vtparse vt;
+        uint64_t col;
+        int32_t row;
+        uint64_t line_len;
+};
+
+extern int setup_matcher(struct matcher *m, regex_t *regexps,
+                         size_t n_exprs, const char **exprs);
+extern int setup_matcher_lazy(struct matcher *m, regex_t *regexps,
+                              size_t n_exprs, const char **exprs,
+                              struct dfa *dfa, bool *handled);
+extern bool matcher_compiled(const struct matcher *m, size_t i);
+extern void free_matcher(struct matcher *m);
+
+extern void strip_init(struct strip *s, const struct strip_config *config,
+                       struct output *out);
+extern void strip_feed(struct strip *s, const char *data, size_t len);
+extern void strip_finish(struct strip *s);
+extern void strip_free(struct strip *s);
+extern uint32_t strip_options(const struct strip_config *config);
+extern void strip_save(const struct strip *s, struct strip_saved *saved);
+extern bool strip_saved_ok(const struct strip_saved *saved);
+extern int strip_restore(struct strip *s, const struct strip_saved *saved,
+                         const char *line);
+
+#endif /* !STRIP_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -8,28 +8,32 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <pwd.h>
+#include <limits.h>
 #include <regex.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "debug.h"
+#include "batch.h"
 #include "compiler.h"
-
-bool debug_arg_ = false;
-bool debug_once_ = true;
-
-#define ESC '\x1b'
-#define SPC '\x20'
-#define CR '\x0d'
-#define NL '\x0a'
+#include "compress.h"
+#include "daemon.h"
+#include "exprset.h"
+#include "filter.h"
+#include "index.h"
+#include "input.h"
+#include "output.h"
+#include "parallel.h"
+#include "resume.h"
+#include "stats.h"
+#include "strip.h"
+#include "untty.h"
 
 void NORETURN
 usage(int rc)
@@ -37,461 +41,709 @@ usage(int rc)
         FILE *out = rc == 0 ? stdout : stderr;
 
         fprintf(out, "Usage: untty [options] [<filename>]\n");
+        fprintf(out, "       untty [options] --output-dir <DIR>|--suffix <SUFFIX> [-r] <filename>...\n");
+        fprintf(out, "       untty --daemon [options] --output-dir <DIR> [--listen <SOCKET>] [<FIFO|TTY>...]\n");
         fprintf(out, "Options:\n");
         fprintf(out, "  --show-defaults                 Show default regexps for escape codes\n");
         fprintf(out, "  --space-as-escape|-s            Use SPC instead of \\x1b as ESC\n");
         fprintf(out, "  --debug|-d                      Print debugging information on stderr\n");
         fprintf(out, "  --expression-file|-e <EXPRS>    Use regexps from <EXPRS> as escape codes\n");
+        fprintf(out, "  --line-buffered                 Flush output at the end of every line\n");
+        fprintf(out, "  --jobs|-j <N>                   Strip regular files with <N> threads\n");
+        fprintf(out, "  --builtin-parser                Strip ECMA-48 control sequences without regexps\n");
+        fprintf(out, "  --render                        Keep only the final state of redrawn lines\n");
+        fprintf(out, "  --utf8                          Pass UTF-8 through, write other non-text as \\xNN\n");
+        fprintf(out, "  --compile-exprs <EXPRS>         Save <EXPRS> compiled, as <EXPRS>.cache or <OUT>\n");
+        fprintf(out, "  --output|-o <OUT>               Write to <OUT> instead of stdout\n");
+        fprintf(out, "  --compress <TYPE>[:<LEVEL>]     Compress output with gzip, xz or zstd\n");
+        fprintf(out, "  --stats[=json]                  Count what was stripped, on stderr\n");
+        fprintf(out, "  --profile[=json]                --stats, and where the time went\n");
+        fprintf(out, "  --follow|-f                     Keep reading as <filename> grows\n");
+        fprintf(out, "  --flush-timeout <MS>            With --follow, flush after <MS> idle (100)\n");
+        fprintf(out, "  --daemon                        Strip many streams at once into <DIR>\n");
+        fprintf(out, "  --listen <SOCKET>               With --daemon, take streams on unix socket <SOCKET>\n");
+        fprintf(out, "  --output-dir <DIR>              Write output files in <DIR>\n");
+        fprintf(out, "  --suffix <SUFFIX>               Write each file's output to <filename><SUFFIX>\n");
+        fprintf(out, "  --recursive|-r                  Strip every file in directories given\n");
+        fprintf(out, "  --index <INDEX>                 Save where output lines came from in <INDEX>\n");
+        fprintf(out, "  --index-interval <BYTES>        Index a line every <BYTES> of input, or 0 for all\n");
+        fprintf(out, "  --lookup <START>[-<END>]        Show the input lines for output bytes <START>-<END>\n");
+        fprintf(out, "  --state-file <STATE>            Strip only what's new since the last run into <OUT>\n");
+        fprintf(out, "  --match <REGEX>                 Only write lines that match <REGEX>\n");
+        fprintf(out, "  --invert                        With --match, only write lines that don't match\n");
+        fprintf(out, "  --context <N>                   With --match, write <N> lines around each match\n");
+        fprintf(out, "  --escapes-out <FILE>            Write what each removed escape was to <FILE>, as JSON\n");
         exit(rc);
 }
 
-typedef enum states {
-        NEED_ESCAPE,
-        NEED_ESCAPE_HAVE_CR,
-        NEED_MATCH,
-        DONE
-} state_t;
-
+/*
+ * Write errors and stripping failures are only recorded by the code
+ * libuntty shares; here they end the run, with 2 for the output and 3
+ * for the expressions.
+ */
 static void
-print_buf(FILE *out, char *buf, ssize_t pos)
+check_output(const struct output *out)
 {
-        if (debug_arg)
-                fprintf(stderr, "print_buf:\"");
-        for (int i = 0; i < pos; i++) {
-                if (buf[i] == CR)
-                        continue;
-                if (isprint(buf[i]) || buf[i] == NL) {
-                        if (buf[i] == NL && debug_arg)
-                                fprintf(stderr, "\\x%02hhx", buf[i]);
-                        else if (debug_arg)
-                                fputc(buf[i], stderr);
-                        fputc(buf[i], out);
-                } else {
-                        if (debug_arg)
-                                fprintf(stderr, "\\x%02hhx", buf[i]);
-                        fprintf(out, "\\x%02hhx", buf[i]);
-                }
-        }
-        if (debug_arg) {
-                fprintf(stderr, "\"\n");
+        if (out->error) {
+                errno = out->error;
+                err(2, "Could not write to %s", out->name);
         }
-        fflush(out);
 }
 
-extern const char *default_exprs;
-extern const uint64_t default_exprs_size;
+static void
+check_strip(const struct strip *s, const struct output *out)
+{
+        if (s->error)
+                errx(3, "%s", untty_error());
+        check_output(out);
+        if (s->escapes)
+                check_output(s->escapes);
+}
 
-static void *exprs_map;
-static uint64_t exprs_map_size;
+static void
+flush_idle(void *data)
+{
+        output_flush(data);
+        check_output(data);
+}
 
 static void
-setup_regexps(char *filename_in, regex_t **regexps_p, size_t *n_exprs_p, const char ***exprs_p)
+filter_idle(void *data)
 {
-        char errbuf[1024];
-        int infd;
-        int rc;
-        regex_t *regexps;
-        const char **exprs = NULL;
-        size_t n_exprs = 0;
-        char *data, *cur;
-        size_t allocation = 0, size;
-        char *filename = NULL;
+        struct filter *f = data;
 
-        if (filename_in) {
-                filename = strdup(filename_in);
-        } else {
-                filename = getenv("UNTTY_ESCAPE_EXPRS");
-                if (filename)
-                        filename = strdup(filename);
-        }
-        if (!filename) {
-                char *homedir = getenv("$HOME");
+        filter_flush(f);
+        check_output(f->out);
+}
 
-                if (!homedir) {
-                        struct passwd *pwent;
-                        uid_t uid;
+/*
+ * A mapped file going to a regular file on the same filesystem can have
+ * its clean spans copied by the kernel, or shared outright where the
+ * filesystem does reflinks, which beats splitting it up across threads.
+ */
+static bool
+copy_source(struct input *in, struct output *out)
+{
+        struct stat in_sb, out_sb;
 
-                        uid = getuid();
+        if (!in->mapped || out->line_buffered ||
+            fstat(in->fd, &in_sb) < 0 || fstat(out->fd, &out_sb) < 0 ||
+            !S_ISREG(out_sb.st_mode) || in_sb.st_dev != out_sb.st_dev)
+                return false;
 
-                        pwent = getpwuid(uid);
-                        if (!pwent)
-                                err(1, "Could not get user info");
-                        homedir = pwent->pw_dir;
-                }
+        output_set_source(out, in->fd, in->buf, in->size);
+        return true;
+}
 
-                rc = asprintf(&filename, "%s/.config/untty/escape_exprs", homedir);
-                if (rc <= 0)
-                        filename = NULL;
-        }
-        if (!filename)
-                err(1, "Could not allocate memory");
+static uint64_t
+parse_offset(const char *s, char **end)
+{
+        uint64_t off;
 
-        infd = open(filename, O_RDONLY);
-        if (infd < 0) {
-                if (errno != ENOENT || filename_in != NULL)
-                        err(1, "Could not open \"%s\"", filename);
+        errno = 0;
+        off = strtoull(s, end, 10);
+        if (errno || *end == s || *s == '-')
+                errx(1, "Invalid offset: \"%s\"", s);
+        return off;
+}
+
+/*
+ * --lookup takes one output offset, or an inclusive range of them.
+ */
+static void
+parse_range(const char *s, uint64_t *start, uint64_t *end)
+{
+        char *p;
+
+        *start = *end = parse_offset(s, &p);
+        if (*p == '-')
+                *end = parse_offset(p + 1, &p);
+        if (*p || *end < *start)
+                errx(1, "Invalid range: \"%s\"", s);
+}
+
+static struct untty_exprs *
+load_exprs(const char *exprfile)
+{
+        struct untty_exprs *exprset;
 
-                cur = data = (char *)default_exprs;
-                size = default_exprs_size;
+        exprset = untty_exprs_load(exprfile);
+        if (!exprset)
+                errx(1, "%s", untty_error());
+        if (!untty_exprs_source(exprset)) {
                 fputs("======= default exprs ========\n", stderr);
                 fflush(stderr);
                 fwrite(default_exprs, 1, default_exprs_size, stderr);
                 fputs("======= default exprs ========\n", stderr);
                 fflush(stderr);
-        } else {
-                struct stat sb;
+        }
+        return exprset;
+}
 
-                rc = fstat(infd, &sb);
-                if (rc < 0)
-                        err(1, "Couldn't get file size for \"%s\"", filename);
+int
+main(int argc, char *argv[])
+{
+        struct untty_exprs *exprset = NULL;
+        struct strip_config config = { NULL, ESC, false };
+        struct strip strip;
+        const char *data;
+        ssize_t len;
+        long jobs = 0;
+        struct input input;
+        struct output output;
+        struct output *out = &output;
+        struct output *sink = out;
+        bool copying;
+        bool line_buffered = false;
+        char *filename = NULL;
+        char **paths;
+        size_t n_paths = 0;
+        char *exprfile = NULL;
+        char *outfile = NULL;
+        char *compile = NULL;
+        int outfd = STDOUT_FILENO;
+        bool follow = false;
+        long flush_timeout = 100;
+        bool daemon = false;
+        char *socket_path = NULL;
+        char *output_dir = NULL;
+        char *suffix = NULL;
+        bool recursive = false;
+        compress_type_t compress = COMPRESS_NONE;
+        int compress_level = 0;
+        struct compress *z = NULL;
+        struct strip_stats stats;
+        bool want_stats = false;
+        bool profile = false;
+        bool stats_json = false;
+        uint64_t start = 0;
+        char *indexfile = NULL;
+        struct index ix;
+        uint64_t interval = INDEX_INTERVAL;
+        bool lookup = false;
+        uint64_t lookup_start = 0, lookup_end = 0;
+        char *statefile = NULL;
+        struct resume rs = { .ok = false };
+        uint64_t in_off = 0;
+        const char **matches;
+        size_t n_matches = 0;
+        bool invert = false;
+        long context = 0;
+        struct filter filter;
+        char *escfile = NULL;
+        int escfd = -1;
+        struct output escout;
+
+        paths = calloc(argc, sizeof(*paths));
+        matches = calloc(argc, sizeof(*matches));
+        if (!paths || !matches)
+                err(1, "Could not allocate memory");
 
-                size = exprs_map_size = sb.st_size + 1;
-                exprs_map = cur = data = mmap(NULL, size, PROT_READ|PROT_WRITE,
-                                              MAP_PRIVATE, infd, 0);
-                if (!data)
-                        err(1, "Couldn't map \"%s\"", filename);
+        for (int i = 1; i < argc && argv[i] != 0; i++) {
+                if (!strcmp(argv[i], "--help") ||
+                    !strcmp(argv[i], "--usage") ||
+                    !strcmp(argv[i], "-?")) {
+                        usage(0);
+                        continue; // never happens
+                }
 
-                close(infd);
+                if (!strcmp(argv[i], "--version")) {
+                        printf("untty 1\n");
+                        exit(0);
+                }
 
-                data[sb.st_size] = 0;
-        }
+                if (!strcmp(argv[i], "--show-defaults")) {
+                        fwrite(default_exprs, 1, default_exprs_size-1, stdout);
+                        exit(0);
+                }
 
-        n_exprs = 0;
-        exprs = calloc(512, sizeof(char *));
-        if (!exprs)
-                err(1, "Could not allocate memory");
+                if (!strcmp(argv[i], "-d") ||
+                    !strcmp(argv[i], "--debug")) {
+                        debug_arg_ = true;
+                        continue;
+                }
 
-        for (ssize_t limit = size, addend = 0; cur && limit; limit -= addend) {
-                char *next = memchr(cur, '\n', limit);
+                if (!strcmp(argv[i], "-s") ||
+                    !strcmp(argv[i], "--space-as-escape")) {
+                        config.escape = SPC;
+                        continue;
+                }
 
-                if (limit == 1 && cur[0] == 0)
-                        break;
+                if (!strcmp(argv[i], "-e") ||
+                    !strcmp(argv[i], "--expression-file")) {
+                        if (i == argc-1)
+                                usage(1);
+                        exprfile = argv[++i];
+                        continue;
+                }
 
-                if (next) {
-                        *next = 0;
-                        next++;
+                if (!strcmp(argv[i], "--line-buffered")) {
+                        line_buffered = true;
+                        continue;
                 }
 
-                if (n_exprs % 512 == 0) {
-                        allocation += 512;
-                        exprs = reallocarray(exprs, allocation, sizeof(char *));
-                        if (!exprs)
-                                err(1, "Could not allocate memory");
+                if (!strcmp(argv[i], "-j") ||
+                    !strcmp(argv[i], "--jobs")) {
+                        char *end = NULL;
+
+                        if (i == argc-1)
+                                usage(1);
+                        jobs = strtol(argv[++i], &end, 10);
+                        if (!end || *end || jobs < 1)
+                                errx(1, "Invalid number of jobs: \"%s\"", argv[i]);
+                        continue;
                 }
 
-                if (cur[0] != '#') {
-                        exprs[n_exprs] = cur;
-                        n_exprs += 1;
+                if (!strcmp(argv[i], "--builtin-parser")) {
+                        config.builtin = true;
+                        continue;
                 }
-                addend = next ? next - cur : limit;
-                cur = next;
-        }
 
-        *n_exprs_p = n_exprs;
-        *exprs_p = exprs;
+                if (!strcmp(argv[i], "--render")) {
+                        config.render = true;
+                        continue;
+                }
 
-        regexps = calloc(n_exprs, sizeof(*regexps));
-        if (!regexps)
-                err(1, "Could not allocate memory");
+                if (!strcmp(argv[i], "--utf8")) {
+                        config.utf8 = true;
+                        continue;
+                }
 
-        for (unsigned int i = 0; exprs[i] != NULL; i++) {
-                int rc;
+                if (!strcmp(argv[i], "--compile-exprs")) {
+                        if (i == argc-1)
+                                usage(1);
+                        compile = argv[++i];
+                        continue;
+                }
 
-                debug("expr[%u]:%s", i, exprs[i]);
-                rc = regcomp(&regexps[i], exprs[i], 0);
-                if (rc != 0) {
-                        regerror(rc, &regexps[i], errbuf, sizeof(errbuf));
-                        errx(1, "Could not compile regexp \"%s\": %s", exprs[i], errbuf);
+                if (!strcmp(argv[i], "-f") ||
+                    !strcmp(argv[i], "--follow")) {
+                        follow = true;
+                        continue;
                 }
-        }
 
-        free(filename);
+                if (!strcmp(argv[i], "--flush-timeout")) {
+                        char *end = NULL;
 
-        *regexps_p = regexps;
-}
+                        if (i == argc-1)
+                                usage(1);
+                        flush_timeout = strtol(argv[++i], &end, 10);
+                        if (!end || *end || flush_timeout < 0 ||
+                            flush_timeout > INT_MAX)
+                                errx(1, "Invalid timeout: \"%s\"", argv[i]);
+                        continue;
+                }
 
-static char *printables(char *str)
-{
-        static char buf[1024];
-        char *current = buf;
-
-        buf[0] = '\0';
-        for (int i = 0; str && str[i]; i++) {
-                if (isprint(str[i]))
-                        current = stpncpy(current, str+i, 1);
-                else
-                        current += sprintf(current, "\\x%02hhx", str[i]);
-                buf[i+1] = '\0';
-        }
-        return buf;
-}
+                if (!strcmp(argv[i], "--daemon")) {
+                        daemon = true;
+                        continue;
+                }
 
-static ssize_t
-match(regex_t *regexps, char *buf, ssize_t pos, const char **exprs)
-{
-        char errbuf[1024];
-        regmatch_t matches[80];
-        ssize_t ret = -1;
-        int matched = -1;
+                if (!strcmp(argv[i], "--listen")) {
+                        if (i == argc-1)
+                                usage(1);
+                        socket_path = argv[++i];
+                        continue;
+                }
 
-        buf[pos] = '\0';
+                if (!strcmp(argv[i], "--output-dir")) {
+                        if (i == argc-1)
+                                usage(1);
+                        output_dir = argv[++i];
+                        continue;
+                }
 
-        memset(matches, 0, sizeof(matches));
-        for (unsigned int i = 0; exprs[i] != NULL; i++) {
-                int rc;
+                if (!strcmp(argv[i], "--suffix")) {
+                        if (i == argc-1)
+                                usage(1);
+                        suffix = argv[++i];
+                        continue;
+                }
 
-                debug("regexec(\"%s\", \"%s\", %zd)", exprs[i], printables(buf+1), pos-1);
-                rc = regexec(&regexps[i], buf+1, pos-1, matches, 0);
-                if (rc != 0 && rc != REG_NOMATCH) {
-                        regerror(rc, &regexps[i], errbuf, sizeof(errbuf));
-                        errx(3, "Could not execute regexp \"%s\": %s", exprs[i], errbuf);
+                if (!strcmp(argv[i], "-r") ||
+                    !strcmp(argv[i], "--recursive")) {
+                        recursive = true;
+                        continue;
                 }
-                if (rc == REG_NOMATCH)
+
+                if (!strcmp(argv[i], "--compress")) {
+                        if (i == argc-1)
+                                usage(1);
+                        compress_parse(argv[++i], &compress, &compress_level);
                         continue;
-                debug("found a match: %s", exprs[i]);
-                for (int j = 0; j < 80 && matches[j].rm_so != -1; j++)
-                {
-                        int mpos = matches[j].rm_eo;
-                        if (ret < 0 || mpos < ret) {
-                                matched = i;
-                                ret = mpos;
-                        }
                 }
-        }
-        if (ret >= 0)
-                ret++;
-        if (matched > 0)
-                debug("Using shortest match at %zd chars: %s", ret-1, exprs[matched]);
 
-        return ret;
-}
+                if (!strncmp(argv[i], "--compress=", 11)) {
+                        compress_parse(argv[i] + 11, &compress, &compress_level);
+                        continue;
+                }
 
-static char *
-get_state_name(state_t state)
-{
-        static char * state_names[] = {
-                "NEED_ESCAPE",
-                "NEED_ESCAPE_HAVE_CR",
-                "NEED_MATCH",
-                "DONE"
-        };
-        return state_names[state];
-}
+                if (!strcmp(argv[i], "--stats") ||
+                    !strcmp(argv[i], "--stats=json")) {
+                        want_stats = true;
+                        stats_json = stats_json || argv[i][7] == '=';
+                        continue;
+                }
 
-int
-main(int argc, char *argv[])
-{
-        char buf[80];
-        ssize_t pos = 0, esc = -1;
-        regex_t *regexps;
-        char escape = ESC;
-        int infd = STDIN_FILENO;
-        FILE *out = stdout;
-        char *filename = NULL;
-        char *exprfile = NULL;
-        state_t state = NEED_ESCAPE;
+                if (!strcmp(argv[i], "--profile") ||
+                    !strcmp(argv[i], "--profile=json")) {
+                        want_stats = profile = true;
+                        stats_json = stats_json || argv[i][9] == '=';
+                        continue;
+                }
 
-        size_t n_exprs;
-        const char **exprs;
+                if (!strcmp(argv[i], "--index")) {
+                        if (i == argc-1)
+                                usage(1);
+                        indexfile = argv[++i];
+                        continue;
+                }
 
-        for (int i = 1; i < argc && argv[i] != 0; i++) {
-                if (!strcmp(argv[i], "--help") ||
-                    !strcmp(argv[i], "--usage") ||
-                    !strcmp(argv[i], "-?")) {
-                        usage(0);
-                        continue; // never happens
+                if (!strcmp(argv[i], "--index-interval")) {
+                        char *end = NULL;
+
+                        if (i == argc-1)
+                                usage(1);
+                        interval = parse_offset(argv[++i], &end);
+                        if (*end)
+                                errx(1, "Invalid interval: \"%s\"", argv[i]);
+                        continue;
                 }
 
-                if (!strcmp(argv[i], "--version")) {
-                        printf("untty 1\n");
-                        exit(0);
+                if (!strcmp(argv[i], "--lookup")) {
+                        if (i == argc-1)
+                                usage(1);
+                        parse_range(argv[++i], &lookup_start, &lookup_end);
+                        lookup = true;
+                        continue;
                 }
 
-                if (!strcmp(argv[i], "--show-defaults")) {
-                        fwrite(default_exprs, 1, default_exprs_size-1, stdout);
-                        exit(0);
+                if (!strcmp(argv[i], "--match")) {
+                        if (i == argc-1)
+                                usage(1);
+                        matches[n_matches++] = argv[++i];
+                        continue;
                 }
 
-                if (!strcmp(argv[i], "-d") ||
-                    !strcmp(argv[i], "--debug")) {
-                        debug_arg_ = true;
+                if (!strcmp(argv[i], "--invert")) {
+                        invert = true;
                         continue;
                 }
 
-                if (!strcmp(argv[i], "-s") ||
-                    !strcmp(argv[i], "--space-as-escape")) {
-                        escape = SPC;
+                if (!strcmp(argv[i], "--context")) {
+                        char *end = NULL;
+
+                        if (i == argc-1)
+                                usage(1);
+                        context = strtol(argv[++i], &end, 10);
+                        if (!end || *end || context < 0 || context > INT_MAX)
+                                errx(1, "Invalid number of lines: \"%s\"", argv[i]);
                         continue;
                 }
 
-                if (!strcmp(argv[i], "-e") ||
-                    !strcmp(argv[i], "--expression-file")) {
+                if (!strcmp(argv[i], "--escapes-out")) {
                         if (i == argc-1)
                                 usage(1);
-                        exprfile = argv[++i];
+                        escfile = argv[++i];
                         continue;
                 }
 
-                if (!filename) {
-                        filename = argv[i];
-                        infd = open(filename, O_RDONLY);
-                        if (infd < 0)
-                                err(1, "Could not open \"%s\"", filename);
+                if (!strcmp(argv[i], "--state-file")) {
+                        if (i == argc-1)
+                                usage(1);
+                        statefile = argv[++i];
                         continue;
                 }
 
-                errx(1, "Unknown argument: \"%s\"", argv[i]);
+                if (!strcmp(argv[i], "-o") ||
+                    !strcmp(argv[i], "--output")) {
+                        if (i == argc-1)
+                                usage(1);
+                        outfile = argv[++i];
+                        continue;
+                }
+
+                paths[n_paths++] = argv[i];
+        }
+
+        if (getenv("UNTTY_DEBUG"))
+                debug_arg_ = true;
+        if (debug_arg) {
+                setlinebuf(stdout);
+                setlinebuf(stderr);
         }
 
-        setup_regexps(exprfile, &regexps, &n_exprs, &exprs);
-
-        while (state != DONE) {
-                int rc;
-                char c;
-
-                rc = read(infd, &c, 1);
-                if (rc < 0) {
-                        if (errno == EAGAIN || errno == EINTR) {
-                                debug("read() == %d; trying again.", rc);
-                                continue;
-                        }
-                        err(2, "Could not read from stdin");
-                } else if (rc == 0) {
-                        debug("%s->DONE: read() == 0", get_state_name(state));
-                        state = DONE;
+        if (config.builtin && config.escape != ESC)
+                errx(1, "--builtin-parser can't be used with --space-as-escape");
+        if (config.render && config.escape != ESC)
+                errx(1, "--render can't be used with --space-as-escape");
+
+        if (daemon) {
+                struct daemon_config dconfig = {
+                        .flags = config.escape == SPC ? UNTTY_SPACE_AS_ESCAPE : 0,
+                        .socket_path = socket_path,
+                        .output_dir = output_dir,
+                        .paths = paths,
+                        .n_paths = n_paths,
+                        .flush_timeout = flush_timeout,
+                };
+
+                if (!output_dir)
+                        errx(1, "--daemon needs --output-dir");
+                if (compile || follow || outfile || compress || want_stats ||
+                    indexfile || lookup || statefile || n_matches || escfile)
+                        errx(1, "--daemon can't be used with --compile-exprs, --follow, --output, --compress, --stats, --index, --lookup, --state-file, --match or --escapes-out");
+                if (config.utf8)
+                        dconfig.flags |= UNTTY_UTF8;
+                if (config.render) {
+                        dconfig.flags |= UNTTY_RENDER;
+                } else if (config.builtin) {
+                        dconfig.flags |= UNTTY_BUILTIN_PARSER;
                 } else {
-                        if (isprint(c))
-                                debug("%s read \'%c\'", get_state_name(state), c);
-                        else
-                                debug("%s read '\\x%02hhx'", get_state_name(state), c);
-                }
-
-                switch (state) {
-                case NEED_ESCAPE_HAVE_CR:
-                        fputc(NL, out);
-                        debug("%s->NEED_ESCAPE: found CR/NL.",
-                              get_state_name(state));
-                        state = NEED_ESCAPE;
-                        if (c == NL || c == CR)
-                                continue;
-
-                        /* fall through */
-                case NEED_ESCAPE:
-                        if (c == escape) {
-                                buf[pos++] = c;
-                                buf[pos] = '\0';
-                                debug("%s->NEED_MATCH: Got ESC (\\x%02hhx)",
-                                      get_state_name(state), escape);
-                                state = NEED_MATCH;
-                        } else {
-                                if (c == CR)
-                                        state = NEED_ESCAPE_HAVE_CR;
-                                else
-                                        fputc(c, out);
-                        }
-                        continue;
+                        exprset = load_exprs(exprfile);
+                        dconfig.exprs = exprset;
+                }
+                run_daemon(&dconfig);
+                untty_exprs_free(exprset);
+                free(paths);
+                free(matches);
+                return 0;
+        }
+        if (socket_path)
+                errx(1, "--listen needs --daemon");
+
+        if (n_paths > 1 || recursive || output_dir || suffix) {
+                struct batch_config bconfig = {
+                        .flags = config.escape == SPC ? UNTTY_SPACE_AS_ESCAPE : 0,
+                        .output_dir = output_dir,
+                        .suffix = suffix ? suffix : "",
+                        .paths = paths,
+                        .n_paths = n_paths,
+                        .recursive = recursive,
+                        .jobs = jobs,
+                };
+                bool ok;
+
+                if (!output_dir && (!suffix || !*suffix))
+                        errx(1, "More than one file needs --output-dir or --suffix");
+                if (n_paths == 0)
+                        errx(1, "--output-dir and --suffix need files to strip");
+                if (follow || outfile || compress || want_stats || indexfile ||
+                    lookup || statefile || n_matches || escfile)
+                        errx(1, "--follow, --output, --compress, --stats, --index, --lookup, --state-file, --match and --escapes-out only work with one file");
+                if (!jobs) {
+                        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+                        bconfig.jobs = jobs > BATCH_MIN_JOBS ? jobs : BATCH_MIN_JOBS;
+                }
+                if (config.utf8)
+                        bconfig.flags |= UNTTY_UTF8;
+                if (config.render) {
+                        bconfig.flags |= UNTTY_RENDER;
+                } else if (config.builtin) {
+                        bconfig.flags |= UNTTY_BUILTIN_PARSER;
+                } else {
+                        exprset = load_exprs(exprfile);
+                        bconfig.exprs = exprset;
+                }
+                ok = run_batch(&bconfig);
+                untty_exprs_free(exprset);
+                free(paths);
+                free(matches);
+                return ok ? 0 : 1;
+        }
+        if (lookup && !indexfile)
+                errx(1, "--lookup needs --index");
+        if (lookup && (follow || want_stats))
+                errx(1, "--lookup can't be used with --follow or --stats");
+        if (statefile && !outfile)
+                errx(1, "--state-file needs --output");
+        if (statefile && (follow || indexfile))
+                errx(1, "--state-file can't be used with --follow or --index");
+        if ((invert || context) && !n_matches)
+                errx(1, "--invert and --context need --match");
+        if (n_matches && (indexfile || statefile))
+                errx(1, "--match can't be used with --index, --lookup or --state-file");
+        if (escfile && (config.builtin || config.render))
+                errx(1, "--escapes-out needs expressions, not --builtin-parser or --render");
+        if (escfile && (lookup || statefile))
+                errx(1, "--escapes-out can't be used with --lookup or --state-file");
+        if (!jobs)
+                jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        filename = paths[0];
+        free(paths);
+
+        if (compile) {
+                char *cachefile = outfile;
+
+                exprset = exprs_load_file(compile, false);
+                if (!exprset)
+                        errx(1, "%s", untty_error());
+                if (!cachefile && asprintf(&cachefile, "%s.cache", compile) < 0)
+                        err(1, "Could not allocate memory");
+                if (untty_exprs_save(exprset, cachefile) < 0)
+                        errx(1, "%s", untty_error());
+                if (cachefile != outfile)
+                        free(cachefile);
+                untty_exprs_free(exprset);
+                return 0;
+        }
 
-                case NEED_MATCH:
-                        buf[pos++] = c;
-                        buf[pos] = '\0';
-                        debug("new buffer:\"%s\" pos:%zd", buf, pos);
-
-                        if (c == CR || c == NL) {
-                                debug("%s->NEED_ESCAPE: Found %s.",
-                                      get_state_name(state), c == CR ? "return" : "newline");
-                                print_buf(out, buf, pos);
-                                pos = 0;
-                                buf[pos] = '\0';
-                                state = NEED_ESCAPE;
-                                continue;
-                        }
-
-                        if (pos <= 1)
-                                continue;
-
-                        rc = match(regexps, buf, pos, exprs);
-                        if (rc < 0) {
-                                if (c == escape && pos > 1) {
-                                        debug("%s->NEED_MATCH: Found escape",
-                                              get_state_name(state));
-                                        //if (isprint(escape) || escape == SPC) {
-                                        //        print_buf(out, buf, pos-1);
-                                        //}
-                                        debug("Advancing %zd.", pos-1);
-                                        pos--;
-                                        buf[pos] = '\0';
-                                        print_buf(out, buf, pos);
-                                        debug("memset(\"%s\", '\\0', %zd)", buf, pos+1);
-                                        memset(buf, '\0', pos+1);
-                                        pos = 0;
-                                        buf[pos++] = c;
-                                        buf[pos] = '\0';
-                                        debug("new buffer:\"%s\" pos:%zd", buf, pos);
-                                        continue;
-                                }
-
-                                if (pos >= 16 || c == CR || c == NL) {
-                                        if (c == CR || c == NL) {
-                                                debug("%s->NEED_ESCAPE: Found %s.",
-                                                      get_state_name(state),
-                                                      c == CR ? "return" : "newline");
-                                                print_buf(out, buf, pos);
-                                        } else {
-                                                debug("%s->NEED_ESCAPE: Escape unmatched at %zd characters",
-                                                      get_state_name(state), pos);
-                                                /*
-                                                 * Sometimes linux booting logged
-                                                 * through screen(1) winds up with:
-                                                 * \x1b[[    5.953653]
-                                                 * So get rid of \x1b[ there,
-                                                 * because it's garbage.
-                                                 */
-                                                if (pos > 1 &&
-                                                    escape == ESC &&
-                                                    buf[0] == ESC &&
-                                                    buf[1] == '[')
-                                                        print_buf(out, buf+2, pos-2);
-                                                else
-                                                        print_buf(out, buf, pos);
-                                        }
-                                        pos = 0;
-                                        buf[pos] = '\0';
-                                        state = NEED_ESCAPE;
-                                }
-                                continue;
-                        }
-
-                        pos -= rc;
-                        if (pos > 0) {
-                                memmove(buf, buf+rc, pos);
-                                if (buf[0] == escape) {
-                                        debug("%s->NEED_MATCH: matched %d characters",
-                                              get_state_name(state), rc);
-                                        state = NEED_MATCH;
-                                }
-                        } else {
-                                debug("%s->NEED_ESCAPE: matched %d characters",
-                                      get_state_name(state), rc);
-                                state = NEED_ESCAPE;
-                        }
-                        buf[pos] = '\0';
-                        continue;
+        if (!config.builtin && !config.render) {
+                exprset = load_exprs(exprfile);
+                config.matcher = &exprset->matcher;
+        }
 
-                case DONE:
-                        if (pos)
-                                print_buf(out, buf, pos);
-                        continue;
+        input_open(&input, filename);
+        if (outfile) {
+                outfd = open(outfile, O_WRONLY|O_CREAT|O_CLOEXEC|
+                                      (statefile ? 0 : O_TRUNC), 0666);
+                if (outfd < 0)
+                        err(1, "Could not open \"%s\"", outfile);
+        }
+        if (statefile) {
+                struct stat sb;
+
+                if (fstat(input.fd, &sb) < 0 || !S_ISREG(sb.st_mode) ||
+                    input.z)
+                        errx(1, "--state-file needs an uncompressed regular file");
+                resume_load(&rs, statefile, &config,
+                            exprset ? exprset->hash : 0, &input, outfd);
+                if (rs.ok) {
+                        in_off = rs.in_off;
+                        input_skip(&input, in_off);
+                        if (lseek(outfd, 0, SEEK_END) < 0)
+                                err(1, "Could not seek in \"%s\"", outfile);
+                } else if (ftruncate(outfd, 0) < 0) {
+                        err(1, "Could not truncate \"%s\"", outfile);
                 }
         }
-        if (esc >= 0 && escape == ESC)
-                warnx("Unmatched escape at end of input (%zd)", esc);
-
-        for (unsigned int i = 0; i < n_exprs; i++)
-                regfree(&regexps[i]);
-        if (exprs_map && exprs_map_size)
-                munmap((void *)exprs_map, exprs_map_size);
-        free(exprs);
-        free(regexps);
+        if (compress) {
+                line_buffered = line_buffered || follow || debug_arg;
+                z = compress_new(compress, compress_level, outfd,
+                                 outfile ? outfile : "stdout", line_buffered);
+                if (output_open_cb(out, compress_write, z, OUTPUT_BUFSZ) < 0)
+                        err(1, "Could not allocate memory");
+                out->line_buffered = line_buffered;
+        } else if (output_open(out, outfd, outfile ? outfile : "stdout",
+                               line_buffered || follow || debug_arg) < 0) {
+                err(1, "Could not allocate memory");
+        }
+        if (escfile) {
+                escfd = open(escfile, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+                if (escfd < 0)
+                        err(1, "Could not open \"%s\"", escfile);
+                if (output_open(&escout, escfd, escfile,
+                                line_buffered || follow || debug_arg) < 0)
+                        err(1, "Could not allocate memory");
+        }
+        if (n_matches) {
+                filter_open(&filter, out, matches, n_matches, invert, context);
+                sink = &filter.in;
+        }
+        if (follow)
+                input_follow(&input, flush_timeout,
+                             n_matches ? filter_idle : flush_idle,
+                             n_matches ? (void *)&filter : (void *)out);
+
+        if (want_stats) {
+                stats_init(&stats, exprset ? exprset->matcher.n_exprs : 0,
+                           profile);
+                out->timed = profile;
+                start = stats_start(&stats);
+        }
+
+        if (indexfile && !lookup)
+                index_open(&ix, indexfile, interval, &config,
+                           exprset ? exprset->hash : 0);
+
+        strip_init(&strip, &config, sink);
+        if (rs.ok)
+                resume_restore(&rs, &strip);
+        if (escfile)
+                strip.escapes = &escout;
+
+        copying = copy_source(&input, out);
+
+        /*
+         * --stats counts in one strip context, --index needs output
+         * offsets in order, --state-file needs the strip context at the
+         * end, and --escapes-out needs input offsets from the top, so
+         * they all stay on one thread.  Threads aren't worth it when the
+         * kernel is copying the clean spans anyway.
+         */
+        if (lookup) {
+                index_lookup(indexfile, &config, exprset ? exprset->hash : 0,
+                             &input, out, lookup_start, lookup_end);
+        } else if (input.mapped && jobs > 1 && !debug_arg && !want_stats &&
+                   !copying && !indexfile && !statefile && !escfile &&
+                   input.size - input.start >= PARALLEL_CHUNK * PARALLEL_MIN_CHUNKS) {
+                len = input_read(&input, &data);
+                strip_parallel(&config, data, len, sink, jobs);
+        } else if (want_stats) {
+                strip.stats = &stats;
+                while (true) {
+                        uint64_t read_start = stats_start(&stats);
+
+                        len = input_read(&input, &data);
+                        stats_stop(&stats, &stats.read_ns, read_start);
+                        if (len <= 0)
+                                break;
+                        in_off += len;
+                        if (indexfile)
+                                index_feed(&ix, &strip, data, len);
+                        else
+                                strip_feed(&strip, data, len);
+                        check_strip(&strip, out);
+                }
+                /* with --state-file, what's held back waits for more */
+                if (!statefile)
+                        strip_finish(&strip);
+        } else {
+                while ((len = input_read(&input, &data)) > 0) {
+                        in_off += len;
+                        if (indexfile)
+                                index_feed(&ix, &strip, data, len);
+                        else
+                                strip_feed(&strip, data, len);
+                        check_strip(&strip, out);
+                }
+                if (!statefile)
+                        strip_finish(&strip);
+        }
+        check_strip(&strip, out);
+        if (indexfile && !lookup)
+                index_close(&ix);
+
+        if (n_matches)
+                filter_close(&filter);
+        output_close(out);
+        check_output(out);
+        if (escfile) {
+                output_close(&escout);
+                check_output(&escout);
+                if (close(escfd) < 0)
+                        err(2, "Could not write to %s", escfile);
+        }
+        if (want_stats) {
+                stats_stop(&stats, &stats.total_ns, start);
+                stats.bytes_out = out->written;
+                stats.output_ns = out->write_ns;
+                stats_report(stderr, &stats,
+                             exprset ? exprset->matcher.exprs : NULL,
+                             stats_json);
+                stats_free(&stats);
+        }
+        if (z)
+                compress_finish(z);
+        if (statefile)
+                resume_save(statefile, &config, exprset ? exprset->hash : 0,
+                            &input, in_off, outfd, &strip);
+        strip_free(&strip);
+        input_close(&input);
+        if (outfile && close(outfd) < 0)
+                err(2, "Could not write to %s", outfile);
+        untty_exprs_free(exprset);
+        free(matches);
 
         return 0;
 }
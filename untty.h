@@ -0,0 +1,128 @@
+/*
+ * untty.h - strip terminal escape sequences from a stream
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef UNTTY_H_
+#define UNTTY_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A compiled set of escape expressions, one POSIX basic regular
+ * expression per line with '#' starting a comment, as in escape_exprs.
+ * Once created it is never modified, so one set can be shared by any
+ * number of contexts in any number of threads.
+ */
+struct untty_exprs;
+
+/*
+ * Compile the expressions in text[0..size).
+ */
+extern struct untty_exprs *untty_exprs_new(const char *text, size_t size);
+
+/*
+ * Load expressions from filename.  If filename is NULL, use
+ * $UNTTY_ESCAPE_EXPRS, then ~/.config/untty/escape_exprs, then the
+ * built-in defaults, the same way untty(1) does.
+ *
+ * If there's an up to date cache of the file (see untty_exprs_save())
+ * called "<filename>.cache", it's loaded instead.  filename can also be
+ * a cache itself; it's used unless the file it was made from has changed
+ * since, in which case that gets compiled instead.
+ */
+extern struct untty_exprs *untty_exprs_load(const char *filename);
+
+/*
+ * The built-in defaults (see untty --show-defaults).
+ */
+extern struct untty_exprs *untty_exprs_default(void);
+
+/*
+ * The file a set was loaded from, or NULL for the built-in defaults and
+ * sets made with untty_exprs_new().
+ */
+extern const char *untty_exprs_source(const struct untty_exprs *exprs);
+
+/*
+ * Save exprs, compiled, to filename, for untty_exprs_load() to map
+ * instead of compiling it again.  Returns 0, or -1 with errno set.
+ */
+extern int untty_exprs_save(const struct untty_exprs *exprs,
+                            const char *filename);
+
+extern void untty_exprs_free(struct untty_exprs *exprs);
+
+/*
+ * A stripping context.  Feed it input in spans of any size; whatever is
+ * left after removing escape sequences is passed to write() in order.
+ * write() returns 0 on success or -1 with errno set, which makes the
+ * untty_feed() or untty_finish() call that triggered it fail too.
+ *
+ * If write is NULL, output is kept in the context instead; collect it
+ * with untty_take_output().
+ */
+typedef int (*untty_write_fn)(void *data, const char *buf, size_t len);
+
+#define UNTTY_SPACE_AS_ESCAPE   0x1     /* untty -s */
+#define UNTTY_BUILTIN_PARSER    0x2     /* untty --builtin-parser */
+#define UNTTY_RENDER            0x4     /* untty --render */
+#define UNTTY_UTF8              0x8     /* untty --utf8 */
+
+struct untty;
+
+/*
+ * exprs may be NULL with UNTTY_BUILTIN_PARSER or UNTTY_RENDER, and must
+ * outlive the context otherwise.
+ */
+extern struct untty *untty_new(const struct untty_exprs *exprs,
+                               unsigned int flags,
+                               untty_write_fn write, void *data);
+extern int untty_feed(struct untty *ctx, const void *buf, size_t len);
+
+/*
+ * Pass on whatever output is buffered, without ending the stream;
+ * anything held back in case it's the start of an escape sequence stays
+ * held back.
+ */
+extern int untty_flush(struct untty *ctx);
+
+/*
+ * End of input: write out anything still held back waiting to see if it
+ * was an escape sequence, and flush.  The context is then ready to
+ * start on a new stream.
+ */
+extern int untty_finish(struct untty *ctx);
+
+/*
+ * With no write function: returns how many bytes of output are waiting,
+ * and points *buf at them.  They're valid until the next call into the
+ * context, and won't be returned again.
+ */
+extern size_t untty_take_output(struct untty *ctx, const char **buf);
+
+extern void untty_free(struct untty *ctx);
+
+/*
+ * With on set, print what's being stripped and why on stderr from now
+ * on, in every context, the way untty -d does.  It's off until this
+ * turns it on: the library doesn't look at UNTTY_DEBUG, and doesn't
+ * change how stdio is buffered.
+ */
+extern void untty_set_debug(int on);
+
+/*
+ * A description of the last error in this thread, like dlerror().
+ */
+extern const char *untty_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !UNTTY_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,61 @@
+/*
+ * utf8.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef UTF8_H_
+#define UTF8_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * How long the UTF-8 sequence starting with lead is, or 0 if lead can't
+ * start one.  0xc0 and 0xc1 would only make overlong forms, and nothing
+ * past 0xf4 is below U+110000.
+ */
+static inline size_t
+utf8_need(unsigned char lead)
+{
+        if (lead >= 0xc2 && lead <= 0xdf)
+                return 2;
+        if (lead >= 0xe0 && lead <= 0xef)
+                return 3;
+        if (lead >= 0xf0 && lead <= 0xf4)
+                return 4;
+        return 0;
+}
+
+/*
+ * Whether c can be byte n (n >= 1) of a sequence that starts with lead.
+ * The second byte is what rules out overlong forms, surrogates, and
+ * anything past U+10FFFF.
+ */
+static inline bool
+utf8_continues(unsigned char lead, size_t n, unsigned char c)
+{
+        unsigned char lo = 0x80, hi = 0xbf;
+
+        if (n == 1) {
+                switch (lead) {
+                case 0xe0: lo = 0xa0; break;
+                case 0xed: hi = 0x9f; break;
+                case 0xf0: lo = 0x90; break;
+                case 0xf4: hi = 0x8f; break;
+                }
+        }
+        return c >= lo && c <= hi;
+}
+
+/*
+ * U+0080 to U+009F are the C1 controls, spelled out in UTF-8; they're no
+ * more printable than the 8-bit forms.
+ */
+static inline bool
+utf8_is_c1(const char *seq)
+{
+        return (unsigned char)seq[0] == 0xc2 && (unsigned char)seq[1] < 0xa0;
+}
+
+#endif /* !UTF8_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,219 @@
+/*
+ * vtparse.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "vtparse.h"
+
+#define E(action, state)        ((VT_##action << 4) | VT_##state)
+
+/*
+ * The "anywhere" transitions, plus CR and NL, which end any sequence;
+ * everything else in C0 gets act and stays in st.
+ */
+#define C0(act, st)                                                     \
+        [0x00 ... 0x09] = E(act, st),                                   \
+        [0x0a] = E(EXECUTE, GROUND),                                    \
+        [0x0b ... 0x0c] = E(act, st),                                   \
+        [0x0d] = E(EXECUTE, GROUND),                                    \
+        [0x0e ... 0x17] = E(act, st),                                   \
+        [0x18] = E(EXECUTE, GROUND),                                    \
+        [0x19] = E(act, st),                                            \
+        [0x1a] = E(EXECUTE, GROUND),                                    \
+        [0x1b] = E(NONE, ESCAPE),                                       \
+        [0x1c ... 0x1f] = E(act, st)
+
+const uint8_t vt_table[VT_N_STATES][256] = {
+        [VT_GROUND] = {
+                C0(EXECUTE, GROUND),
+                [0x20 ... 0xff] = E(PRINT, GROUND),
+        },
+        [VT_ESCAPE] = {
+                C0(EXECUTE, ESCAPE),
+                [0x20 ... 0x2f] = E(COLLECT, ESCAPE_INTERMEDIATE),
+                [0x30 ... 0x4f] = E(ESC_DISPATCH, GROUND),
+                [0x50] = E(NONE, DCS_ENTRY),
+                [0x51 ... 0x57] = E(ESC_DISPATCH, GROUND),
+                [0x58] = E(NONE, SOS_PM_APC_STRING),
+                [0x59 ... 0x5a] = E(ESC_DISPATCH, GROUND),
+                [0x5b] = E(NONE, CSI_ENTRY),
+                [0x5c] = E(ESC_DISPATCH, GROUND),
+                [0x5d] = E(NONE, OSC_STRING),
+                [0x5e ... 0x5f] = E(NONE, SOS_PM_APC_STRING),
+                [0x60 ... 0x7e] = E(ESC_DISPATCH, GROUND),
+                [0x7f] = E(IGNORE, ESCAPE),
+                [0x80 ... 0xff] = E(PRINT, GROUND),
+        },
+        [VT_ESCAPE_INTERMEDIATE] = {
+                C0(EXECUTE, ESCAPE_INTERMEDIATE),
+                [0x20 ... 0x2f] = E(COLLECT, ESCAPE_INTERMEDIATE),
+                [0x30 ... 0x7e] = E(ESC_DISPATCH, GROUND),
+                [0x7f] = E(IGNORE, ESCAPE_INTERMEDIATE),
+                [0x80 ... 0xff] = E(PRINT, GROUND),
+        },
+        [VT_CSI_ENTRY] = {
+                C0(EXECUTE, CSI_ENTRY),
+                [0x20 ... 0x2f] = E(COLLECT, CSI_INTERMEDIATE),
+                [0x30 ... 0x39] = E(PARAM, CSI_PARAM),
+                [0x3a] = E(NONE, CSI_IGNORE),
+                [0x3b] = E(PARAM, CSI_PARAM),
+                [0x3c ... 0x3f] = E(COLLECT, CSI_PARAM),
+                [0x40 ... 0x7e] = E(CSI_DISPATCH, GROUND),
+                [0x7f ... 0xff] = E(IGNORE, CSI_ENTRY),
+        },
+        [VT_CSI_PARAM] = {
+                C0(EXECUTE, CSI_PARAM),
+                [0x20 ... 0x2f] = E(COLLECT, CSI_INTERMEDIATE),
+                [0x30 ... 0x39] = E(PARAM, CSI_PARAM),
+                [0x3a] = E(NONE, CSI_IGNORE),
+                [0x3b] = E(PARAM, CSI_PARAM),
+                [0x3c ... 0x3f] = E(NONE, CSI_IGNORE),
+                [0x40 ... 0x7e] = E(CSI_DISPATCH, GROUND),
+                [0x7f ... 0xff] = E(IGNORE, CSI_PARAM),
+        },
+        [VT_CSI_INTERMEDIATE] = {
+                C0(EXECUTE, CSI_INTERMEDIATE),
+                [0x20 ... 0x2f] = E(COLLECT, CSI_INTERMEDIATE),
+                [0x30 ... 0x3f] = E(NONE, CSI_IGNORE),
+                [0x40 ... 0x7e] = E(CSI_DISPATCH, GROUND),
+                [0x7f ... 0xff] = E(IGNORE, CSI_INTERMEDIATE),
+        },
+        [VT_CSI_IGNORE] = {
+                C0(EXECUTE, CSI_IGNORE),
+                [0x20 ... 0x3f] = E(IGNORE, CSI_IGNORE),
+                [0x40 ... 0x7e] = E(NONE, GROUND),
+                [0x7f ... 0xff] = E(IGNORE, CSI_IGNORE),
+        },
+        [VT_DCS_ENTRY] = {
+                C0(IGNORE, DCS_ENTRY),
+                [0x20 ... 0x2f] = E(COLLECT, DCS_INTERMEDIATE),
+                [0x30 ... 0x39] = E(PARAM, DCS_PARAM),
+                [0x3a] = E(NONE, DCS_IGNORE),
+                [0x3b] = E(PARAM, DCS_PARAM),
+                [0x3c ... 0x3f] = E(COLLECT, DCS_PARAM),
+                [0x40 ... 0x7e] = E(HOOK, DCS_PASSTHROUGH),
+                [0x7f ... 0xff] = E(IGNORE, DCS_ENTRY),
+        },
+        [VT_DCS_PARAM] = {
+                C0(IGNORE, DCS_PARAM),
+                [0x20 ... 0x2f] = E(COLLECT, DCS_INTERMEDIATE),
+                [0x30 ... 0x39] = E(PARAM, DCS_PARAM),
+                [0x3a] = E(NONE, DCS_IGNORE),
+                [0x3b] = E(PARAM, DCS_PARAM),
+                [0x3c ... 0x3f] = E(NONE, DCS_IGNORE),
+                [0x40 ... 0x7e] = E(HOOK, DCS_PASSTHROUGH),
+                [0x7f ... 0xff] = E(IGNORE, DCS_PARAM),
+        },
+        [VT_DCS_INTERMEDIATE] = {
+                C0(IGNORE, DCS_INTERMEDIATE),
+                [0x20 ... 0x2f] = E(COLLECT, DCS_INTERMEDIATE),
+                [0x30 ... 0x3f] = E(NONE, DCS_IGNORE),
+                [0x40 ... 0x7e] = E(HOOK, DCS_PASSTHROUGH),
+                [0x7f ... 0xff] = E(IGNORE, DCS_INTERMEDIATE),
+        },
+        [VT_DCS_PASSTHROUGH] = {
+                C0(PUT, DCS_PASSTHROUGH),
+                [0x20 ... 0x7e] = E(PUT, DCS_PASSTHROUGH),
+                [0x7f] = E(IGNORE, DCS_PASSTHROUGH),
+                [0x80 ... 0xff] = E(PUT, DCS_PASSTHROUGH),
+        },
+        [VT_DCS_IGNORE] = {
+                C0(IGNORE, DCS_IGNORE),
+                [0x20 ... 0xff] = E(IGNORE, DCS_IGNORE),
+        },
+        [VT_OSC_STRING] = {
+                [0x00 ... 0x06] = E(IGNORE, OSC_STRING),
+                [0x07] = E(NONE, GROUND),
+                [0x08 ... 0x09] = E(IGNORE, OSC_STRING),
+                [0x0a] = E(EXECUTE, GROUND),
+                [0x0b ... 0x0c] = E(IGNORE, OSC_STRING),
+                [0x0d] = E(EXECUTE, GROUND),
+                [0x0e ... 0x17] = E(IGNORE, OSC_STRING),
+                [0x18] = E(EXECUTE, GROUND),
+                [0x19] = E(IGNORE, OSC_STRING),
+                [0x1a] = E(EXECUTE, GROUND),
+                [0x1b] = E(NONE, ESCAPE),
+                [0x1c ... 0x1f] = E(IGNORE, OSC_STRING),
+                [0x20 ... 0xff] = E(OSC_PUT, OSC_STRING),
+        },
+        [VT_SOS_PM_APC_STRING] = {
+                C0(IGNORE, SOS_PM_APC_STRING),
+                [0x20 ... 0xff] = E(IGNORE, SOS_PM_APC_STRING),
+        },
+};
+
+void
+vtparse_clear(struct vtparse *vt)
+{
+        vt->ignoring = false;
+        vt->n_intermediates = 0;
+        vt->n_params = 0;
+        memset(vt->params, 0, sizeof(vt->params));
+}
+
+void
+vtparse_init(struct vtparse *vt)
+{
+        vtparse_clear(vt);
+        vt->state = VT_GROUND;
+}
+
+void
+vtparse_param(struct vtparse *vt, unsigned char c)
+{
+        unsigned int *param;
+
+        if (vt->n_params == 0)
+                vt->n_params = 1;
+
+        if (c == ';') {
+                if (vt->n_params < VT_MAX_PARAMS)
+                        vt->n_params += 1;
+                else
+                        vt->ignoring = true;
+                return;
+        }
+
+        param = &vt->params[vt->n_params-1];
+        *param = *param * 10 + c - '0';
+        if (*param > 65535)
+                *param = 65535;
+}
+
+void
+vtparse_collect(struct vtparse *vt, unsigned char c)
+{
+        if (vt->n_intermediates < VT_MAX_INTERMEDIATES)
+                vt->intermediates[vt->n_intermediates++] = c;
+        else
+                vt->ignoring = true;
+}
+
+const char *
+vtparse_state_name(vt_state_t state)
+{
+        static const char * const state_names[] = {
+                "GROUND",
+                "ESCAPE",
+                "ESCAPE_INTERMEDIATE",
+                "CSI_ENTRY",
+                "CSI_PARAM",
+                "CSI_INTERMEDIATE",
+                "CSI_IGNORE",
+                "DCS_ENTRY",
+                "DCS_PARAM",
+                "DCS_INTERMEDIATE",
+                "DCS_PASSTHROUGH",
+                "DCS_IGNORE",
+                "OSC_STRING",
+                "SOS_PM_APC_STRING",
+        };
+        return state_names[state];
+}
+
+// vim:fenc=utf-8:tw=75:et
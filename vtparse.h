@@ -0,0 +1,112 @@
+/*
+ * vtparse.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef VTPARSE_H_
+#define VTPARSE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A table driven ECMA-48 parser, after Paul Williams' DEC VT500 state
+ * diagram (https://vt100.net/emu/dec_ansi_parser).  It differs from that
+ * in a few ways that suit logs rather than terminals:
+ *
+ * - 8-bit C1 controls aren't recognized; 0x80-0xff print in GROUND so
+ *   UTF-8 text survives.  One right after ESC (and its intermediates)
+ *   can't be part of the sequence either, so it ends it and prints,
+ *   rather than taking a character's first byte with it.
+ * - CR and NL always end whatever sequence they show up in, the same as
+ *   they do for the regexp matcher.
+ * - BEL ends an OSC string, as xterm does.
+ */
+
+typedef enum vt_state {
+        VT_GROUND,
+        VT_ESCAPE,
+        VT_ESCAPE_INTERMEDIATE,
+        VT_CSI_ENTRY,
+        VT_CSI_PARAM,
+        VT_CSI_INTERMEDIATE,
+        VT_CSI_IGNORE,
+        VT_DCS_ENTRY,
+        VT_DCS_PARAM,
+        VT_DCS_INTERMEDIATE,
+        VT_DCS_PASSTHROUGH,
+        VT_DCS_IGNORE,
+        VT_OSC_STRING,
+        VT_SOS_PM_APC_STRING,
+        VT_N_STATES
+} vt_state_t;
+
+typedef enum vt_action {
+        VT_NONE,
+        VT_PRINT,
+        VT_EXECUTE,
+        VT_IGNORE,
+        VT_COLLECT,
+        VT_PARAM,
+        VT_ESC_DISPATCH,
+        VT_CSI_DISPATCH,
+        VT_HOOK,
+        VT_PUT,
+        VT_OSC_PUT,
+} vt_action_t;
+
+#define VT_MAX_PARAMS           16
+#define VT_MAX_INTERMEDIATES    2
+
+struct vtparse {
+        vt_state_t state;
+        bool ignoring;
+        unsigned int n_intermediates;
+        char intermediates[VT_MAX_INTERMEDIATES];
+        unsigned int n_params;
+        unsigned int params[VT_MAX_PARAMS];
+};
+
+extern const uint8_t vt_table[VT_N_STATES][256];
+
+extern void vtparse_init(struct vtparse *vt);
+extern void vtparse_clear(struct vtparse *vt);
+extern void vtparse_param(struct vtparse *vt, unsigned char c);
+extern void vtparse_collect(struct vtparse *vt, unsigned char c);
+extern const char *vtparse_state_name(vt_state_t state);
+
+/*
+ * Runs one byte through the parser and returns the action the caller
+ * needs to care about: VT_PRINT and VT_EXECUTE for output, and
+ * VT_ESC_DISPATCH / VT_CSI_DISPATCH with the final byte in c and the
+ * parameters and intermediates filled in.  Everything else is handled
+ * here.
+ */
+static inline vt_action_t
+vtparse_byte(struct vtparse *vt, unsigned char c)
+{
+        uint8_t entry = vt_table[vt->state][c];
+        vt_action_t action = entry >> 4;
+        vt_state_t next = entry & 0xf;
+
+        if (next != vt->state) {
+                if (next == VT_ESCAPE || next == VT_CSI_ENTRY ||
+                    next == VT_DCS_ENTRY)
+                        vtparse_clear(vt);
+                vt->state = next;
+        }
+
+        switch (action) {
+        case VT_PARAM:
+                vtparse_param(vt, c);
+                return VT_NONE;
+        case VT_COLLECT:
+                vtparse_collect(vt, c);
+                return VT_NONE;
+        default:
+                return action;
+        }
+}
+
+#endif /* !VTPARSE_H_ */
+// vim:fenc=utf-8:tw=75:et